@@ -0,0 +1,127 @@
+#include "checksum.h"
+#include <cstring>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CHECKSUM_X86
+#define CHECKSUM_TARGET_SSE42
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#include <cpuid.h>
+#define CHECKSUM_X86
+#define CHECKSUM_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+static constexpr uint32_t CRC32C_POLYNOMIAL = 0x82F63B78; // Reversed 0x1EDC6F41
+
+struct CRC32CTable
+{
+	CRC32CTable()
+	{
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t nValue = i;
+			for (int j = 0; j < 8; ++j)
+				nValue = (nValue >> 1) ^ ((nValue & 1) ? CRC32C_POLYNOMIAL : 0);
+
+			pTable[0][i] = nValue;
+		}
+
+		for (uint32_t i = 0; i < 256; ++i)
+			for (int nSlice = 1; nSlice < 8; ++nSlice)
+				pTable[nSlice][i] = (pTable[nSlice - 1][i] >> 8) ^ pTable[0][pTable[nSlice - 1][i] & 0xFF];
+	}
+
+	uint32_t pTable[8][256];
+};
+static const CRC32CTable g_pCRC32CTable;
+
+static uint32_t CRC32CSoftware(const unsigned char* pData, std::size_t nSize, uint32_t nChecksum)
+{
+	const auto& pTable = g_pCRC32CTable.pTable;
+	while (nSize >= 8)
+	{
+		uint32_t nLow, nHigh;
+		std::memcpy(&nLow, pData, sizeof(nLow));
+		std::memcpy(&nHigh, pData + 4, sizeof(nHigh));
+		nLow ^= nChecksum; // NOTE: Assumes little endian like the rest of our file formats.
+
+		nChecksum = pTable[7][nLow & 0xFF] ^ pTable[6][(nLow >> 8) & 0xFF] ^ pTable[5][(nLow >> 16) & 0xFF] ^ pTable[4][nLow >> 24] ^
+			pTable[3][nHigh & 0xFF] ^ pTable[2][(nHigh >> 8) & 0xFF] ^ pTable[1][(nHigh >> 16) & 0xFF] ^ pTable[0][nHigh >> 24];
+
+		pData += 8;
+		nSize -= 8;
+	}
+
+	while (nSize-- > 0)
+		nChecksum = (nChecksum >> 8) ^ pTable[0][(nChecksum ^ *pData++) & 0xFF];
+
+	return nChecksum;
+}
+
+#ifdef CHECKSUM_X86
+CHECKSUM_TARGET_SSE42 static uint32_t CRC32CHardware(const unsigned char* pData, std::size_t nSize, uint32_t nChecksum)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	uint64_t nChecksum64 = nChecksum;
+	while (nSize >= 8)
+	{
+		uint64_t nValue;
+		std::memcpy(&nValue, pData, sizeof(nValue));
+		nChecksum64 = _mm_crc32_u64(nChecksum64, nValue);
+		pData += 8;
+		nSize -= 8;
+	}
+	nChecksum = (uint32_t)nChecksum64;
+#endif
+
+	while (nSize >= 4)
+	{
+		uint32_t nValue;
+		std::memcpy(&nValue, pData, sizeof(nValue));
+		nChecksum = _mm_crc32_u32(nChecksum, nValue);
+		pData += 4;
+		nSize -= 4;
+	}
+
+	while (nSize-- > 0)
+		nChecksum = _mm_crc32_u8(nChecksum, *pData++);
+
+	return nChecksum;
+}
+
+static bool CheckSSE42()
+{
+#ifdef _MSC_VER
+	int pInfo[4];
+	__cpuid(pInfo, 1);
+	return (pInfo[2] & (1 << 20)) != 0;
+#else
+	unsigned int nEax, nEbx, nEcx, nEdx;
+	if (!__get_cpuid(1, &nEax, &nEbx, &nEcx, &nEdx))
+		return false;
+
+	return (nEcx & bit_SSE4_2) != 0;
+#endif
+}
+static const bool g_bHardwareCRC32C = CheckSSE42();
+#else
+static const bool g_bHardwareCRC32C = false;
+#endif
+
+uint32_t Checksum::CRC32C(const void* pData, std::size_t nSize, uint32_t nChecksum)
+{
+	nChecksum = ~nChecksum;
+#ifdef CHECKSUM_X86
+	if (g_bHardwareCRC32C)
+		return ~CRC32CHardware((const unsigned char*)pData, nSize, nChecksum);
+#endif
+
+	return ~CRC32CSoftware((const unsigned char*)pData, nSize, nChecksum);
+}
+
+bool Checksum::HasHardwareCRC32C()
+{
+	return g_bHardwareCRC32C;
+}
\ No newline at end of file
@@ -0,0 +1,16 @@
+#include <cstddef>
+#include <cstdint>
+
+/*
+	CRC32C (Castagnoli) which we use to detect torn or corrupted records.
+	On x86 CPUs with SSE4.2 it uses the crc32 instruction which processes 8 bytes per instruction,
+	everywhere else it falls back to a slicing-by-8 table.
+*/
+namespace Checksum
+{
+	// nChecksum can be the result of a previous call to continue it.
+	extern uint32_t CRC32C(const void* pData, std::size_t nSize, uint32_t nChecksum = 0);
+
+	// Returns true if CRC32C uses the hardware instruction.
+	extern bool HasHardwareCRC32C();
+}
\ No newline at end of file
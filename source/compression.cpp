@@ -0,0 +1,209 @@
+#include "compression.h"
+#include <cstring>
+#include <cstdint>
+#include <memory>
+
+static constexpr std::size_t MIN_MATCH = 4;
+static constexpr std::size_t LAST_LITERALS = 5; // The format requires the last 5 bytes to always be literals
+static constexpr std::size_t MATCH_FIND_LIMIT = 12; // and the last match has to start atleast 12 bytes before the end.
+static constexpr std::size_t MAX_OFFSET = 65535;
+static constexpr int HASH_LOG = 14;
+
+static inline uint32_t Read32(const unsigned char* pData)
+{
+	uint32_t nValue;
+	std::memcpy(&nValue, pData, sizeof(nValue));
+	return nValue;
+}
+
+static inline uint32_t Hash(uint32_t nValue)
+{
+	return (nValue * 2654435761U) >> (32 - HASH_LOG);
+}
+
+// Writes the 255, 255, ..., rest encoding used for lengths that don't fit into the 4 bits of the token.
+static inline bool WriteLength(unsigned char*& pOutput, const unsigned char* pOutputEnd, std::size_t nLength)
+{
+	while (nLength >= 255)
+	{
+		if (pOutput >= pOutputEnd)
+			return false;
+
+		*pOutput++ = 255;
+		nLength -= 255;
+	}
+
+	if (pOutput >= pOutputEnd)
+		return false;
+
+	*pOutput++ = (unsigned char)nLength;
+	return true;
+}
+
+static inline bool WriteSequence(unsigned char*& pOutput, const unsigned char* pOutputEnd, const unsigned char* pLiterals, std::size_t nLiterals, std::size_t nOffset, std::size_t nMatchLength)
+{
+	if (pOutput >= pOutputEnd)
+		return false;
+
+	unsigned char* pToken = pOutput++;
+	*pToken = (unsigned char)((nLiterals >= 15 ? 15 : nLiterals) << 4);
+	if (nLiterals >= 15 && !WriteLength(pOutput, pOutputEnd, nLiterals - 15))
+		return false;
+
+	if ((std::size_t)(pOutputEnd - pOutput) < nLiterals)
+		return false;
+
+	std::memcpy(pOutput, pLiterals, nLiterals);
+	pOutput += nLiterals;
+
+	if (nMatchLength == 0) // Last sequence only has literals
+		return true;
+
+	if (pOutputEnd - pOutput < 2)
+		return false;
+
+	*pOutput++ = (unsigned char)(nOffset & 0xFF);
+	*pOutput++ = (unsigned char)(nOffset >> 8);
+
+	nMatchLength -= MIN_MATCH;
+	*pToken |= (unsigned char)(nMatchLength >= 15 ? 15 : nMatchLength);
+	if (nMatchLength >= 15 && !WriteLength(pOutput, pOutputEnd, nMatchLength - 15))
+		return false;
+
+	return true;
+}
+
+std::size_t Compression::GetMaxCompressedSize(std::size_t nSourceSize)
+{
+	return nSourceSize + (nSourceSize / 255) + 16;
+}
+
+std::size_t Compression::Compress(const char* pSourceData, std::size_t nSourceSize, char* pDestData, std::size_t nDestSize)
+{
+	const unsigned char* pSource = (const unsigned char*)pSourceData;
+	const unsigned char* pSourceEnd = pSource + nSourceSize;
+	unsigned char* pOutput = (unsigned char*)pDestData;
+	const unsigned char* pOutputEnd = pOutput + nDestSize;
+
+	const unsigned char* pAnchor = pSource; // Start of the literals that weren't written yet
+	if (nSourceSize > MATCH_FIND_LIMIT)
+	{
+		const unsigned char* pMatchFindLimit = pSourceEnd - MATCH_FIND_LIMIT;
+		const unsigned char* pMatchLimit = pSourceEnd - LAST_LITERALS;
+
+		// Positions are stored +1 so that 0 means empty.
+		std::unique_ptr<uint32_t[]> pTable = std::make_unique<uint32_t[]>(1 << HASH_LOG);
+		const unsigned char* pCurrent = pSource;
+		while (pCurrent < pMatchFindLimit)
+		{
+			uint32_t nHash = Hash(Read32(pCurrent));
+			uint32_t nCandidate = pTable[nHash];
+			pTable[nHash] = (uint32_t)(pCurrent - pSource) + 1;
+
+			const unsigned char* pMatch = pSource + nCandidate - 1;
+			if (nCandidate == 0 || (std::size_t)(pCurrent - pMatch) > MAX_OFFSET || Read32(pMatch) != Read32(pCurrent))
+			{
+				++pCurrent;
+				continue;
+			}
+
+			// Extend the match backwards into the literals
+			while (pCurrent > pAnchor && pMatch > pSource && pCurrent[-1] == pMatch[-1])
+			{
+				--pCurrent;
+				--pMatch;
+			}
+
+			std::size_t nMatchLength = MIN_MATCH;
+			while (pCurrent + nMatchLength < pMatchLimit && pCurrent[nMatchLength] == pMatch[nMatchLength])
+				++nMatchLength;
+
+			if (!WriteSequence(pOutput, pOutputEnd, pAnchor, pCurrent - pAnchor, pCurrent - pMatch, nMatchLength))
+				return 0;
+
+			pCurrent += nMatchLength;
+			pAnchor = pCurrent;
+
+			if (pCurrent - 2 >= pSource && pCurrent < pMatchFindLimit) // Helps the next match to be found
+				pTable[Hash(Read32(pCurrent - 2))] = (uint32_t)(pCurrent - 2 - pSource) + 1;
+		}
+	}
+
+	if (!WriteSequence(pOutput, pOutputEnd, pAnchor, pSourceEnd - pAnchor, 0, 0))
+		return 0;
+
+	return pOutput - (unsigned char*)pDestData;
+}
+
+bool Compression::Decompress(const char* pSourceData, std::size_t nSourceSize, char* pDestData, std::size_t nDestSize)
+{
+	const unsigned char* pInput = (const unsigned char*)pSourceData;
+	const unsigned char* pInputEnd = pInput + nSourceSize;
+	unsigned char* pOutput = (unsigned char*)pDestData;
+	unsigned char* pOutputEnd = pOutput + nDestSize;
+
+	while (pInput < pInputEnd)
+	{
+		unsigned char nToken = *pInput++;
+
+		std::size_t nLiterals = nToken >> 4;
+		if (nLiterals == 15)
+		{
+			unsigned char nByte;
+			do {
+				if (pInput >= pInputEnd)
+					return false;
+
+				nByte = *pInput++;
+				nLiterals += nByte;
+			} while (nByte == 255);
+		}
+
+		if ((std::size_t)(pInputEnd - pInput) < nLiterals || (std::size_t)(pOutputEnd - pOutput) < nLiterals)
+			return false;
+
+		std::memcpy(pOutput, pInput, nLiterals);
+		pInput += nLiterals;
+		pOutput += nLiterals;
+
+		if (pInput >= pInputEnd) // The last sequence has no match
+			break;
+
+		if (pInputEnd - pInput < 2)
+			return false;
+
+		std::size_t nOffset = pInput[0] | (pInput[1] << 8);
+		pInput += 2;
+		if (nOffset == 0 || nOffset > (std::size_t)(pOutput - (unsigned char*)pDestData))
+			return false;
+
+		std::size_t nMatchLength = nToken & 15;
+		if (nMatchLength == 15)
+		{
+			unsigned char nByte;
+			do {
+				if (pInput >= pInputEnd)
+					return false;
+
+				nByte = *pInput++;
+				nMatchLength += nByte;
+			} while (nByte == 255);
+		}
+		nMatchLength += MIN_MATCH;
+
+		if ((std::size_t)(pOutputEnd - pOutput) < nMatchLength)
+			return false;
+
+		const unsigned char* pMatch = pOutput - nOffset;
+		if (nOffset >= nMatchLength)
+		{
+			std::memcpy(pOutput, pMatch, nMatchLength);
+			pOutput += nMatchLength;
+		} else {
+			for (std::size_t i = 0; i < nMatchLength; ++i) // Overlapping, e.g. a run of the same byte
+				*pOutput++ = *pMatch++;
+		}
+	}
+
+	return pOutput == pOutputEnd;
+}
\ No newline at end of file
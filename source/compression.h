@@ -0,0 +1,18 @@
+#include <cstddef>
+
+/*
+	A small LZ77 codec that produces the LZ4 block format.
+	We use it to compress sealed segments, our logs are mostly very repetitive text so even this simple greedy matcher gets good ratios.
+	It's vendored like this since we don't want to pull in any dependencies.
+*/
+namespace Compression
+{
+	// Worst case size of the compressed data for nSourceSize bytes (data that can't be compressed at all)
+	extern std::size_t GetMaxCompressedSize(std::size_t nSourceSize);
+
+	// Returns the compressed size or 0 if pDest was too small.
+	extern std::size_t Compress(const char* pSource, std::size_t nSourceSize, char* pDest, std::size_t nDestSize);
+
+	// Returns false if the data is corrupted or doesn't decompress into exactly nDestSize bytes.
+	extern bool Decompress(const char* pSource, std::size_t nSourceSize, char* pDest, std::size_t nDestSize);
+}
\ No newline at end of file
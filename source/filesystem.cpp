@@ -1,10 +1,20 @@
 #include "filesystem.h"
 #include <iostream>
 #include <filesystem>
+#include <algorithm>
+#include <chrono>
 #if _WIN32
 #include <io.h>
+#include <windows.h>
+#undef CreateDirectory // We got our own.
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <climits>
+#include <cerrno>
 #endif
 
 // ToDo: Go lower and use stuff like CreateFile from windows to hopefully make these faster.
@@ -53,6 +63,12 @@ void FileSystem::CloseFile(FileHandle_t pFileHandle)
 
 }
 
+bool FileSystem::FileExists(const char* pFolderName)
+{
+	std::error_code pError;
+	return std::filesystem::exists(pFolderName, pError);
+}
+
 bool FileSystem::FileExists(const std::string& pFolderName)
 {
 	return std::filesystem::exists(pFolderName);
@@ -63,6 +79,323 @@ void FileSystem::CreateDirectory(const char* pFolderName)
 	std::filesystem::create_directories(pFolderName);
 }
 
+unsigned long long FileSystem::FileSize(const char* pFileName)
+{
+	std::error_code pError;
+	std::uintmax_t nSize = std::filesystem::file_size(pFileName, pError);
+	if (pError)
+		return 0;
+
+	return nSize;
+}
+
+unsigned long long FileSystem::FileModifiedTime(const char* pFileName)
+{
+	std::error_code pError;
+	std::filesystem::file_time_type nTime = std::filesystem::last_write_time(pFileName, pError);
+	if (pError)
+		return 0;
+
+	// C++17 has no clock_cast, so we move it onto the system clock using the current time of both clocks.
+	auto nSystemTime = std::chrono::system_clock::now() + std::chrono::duration_cast<std::chrono::system_clock::duration>(nTime - std::filesystem::file_time_type::clock::now());
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::milliseconds>(nSystemTime.time_since_epoch()).count();
+}
+
+bool FileSystem::RemoveFile(const char* pFileName)
+{
+	std::error_code pError;
+	return std::filesystem::remove(pFileName, pError);
+}
+
+bool FileSystem::RenameFile(const char* pOldFileName, const char* pNewFileName)
+{
+	std::error_code pError;
+	std::filesystem::rename(pOldFileName, pNewFileName, pError);
+	return !pError;
+}
+
+#if defined(_WIN32)
+const FileDescriptor_t FileSystem::INVALID_DESCRIPTOR = INVALID_HANDLE_VALUE;
+
+FileDescriptor_t FileSystem::OpenDescriptor(const char* pFileName, bool bCreate, bool bTruncate)
+{
+	DWORD nDisposition = OPEN_EXISTING;
+	if (bCreate)
+		nDisposition = bTruncate ? CREATE_ALWAYS : OPEN_ALWAYS;
+	else if (bTruncate)
+		nDisposition = TRUNCATE_EXISTING;
+
+	return CreateFileA(pFileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, nDisposition, FILE_ATTRIBUTE_NORMAL, nullptr);
+}
+
+void FileSystem::CloseDescriptor(FileDescriptor_t pFile)
+{
+	if (pFile != INVALID_DESCRIPTOR)
+		CloseHandle(pFile);
+}
+
+long long FileSystem::ReadAt(FileDescriptor_t pFile, void* pBuffer, std::size_t nSize, unsigned long long nOffset)
+{
+	std::size_t nTotalRead = 0;
+	while (nTotalRead < nSize)
+	{
+		OVERLAPPED pOverlapped = {0};
+		pOverlapped.Offset = (DWORD)((nOffset + nTotalRead) & 0xFFFFFFFF);
+		pOverlapped.OffsetHigh = (DWORD)((nOffset + nTotalRead) >> 32);
+
+		DWORD nRead = 0;
+		if (!ReadFile(pFile, (char*)pBuffer + nTotalRead, (DWORD)std::min<std::size_t>(nSize - nTotalRead, 1 << 30), &nRead, &pOverlapped))
+			return GetLastError() == ERROR_HANDLE_EOF ? (long long)nTotalRead : -1;
+
+		if (nRead == 0)
+			break;
+
+		nTotalRead += nRead;
+	}
+
+	return nTotalRead;
+}
+
+bool FileSystem::WriteAt(FileDescriptor_t pFile, const void* pData, std::size_t nSize, unsigned long long nOffset)
+{
+	std::size_t nTotalWritten = 0;
+	while (nTotalWritten < nSize)
+	{
+		OVERLAPPED pOverlapped = {0};
+		pOverlapped.Offset = (DWORD)((nOffset + nTotalWritten) & 0xFFFFFFFF);
+		pOverlapped.OffsetHigh = (DWORD)((nOffset + nTotalWritten) >> 32);
+
+		DWORD nWritten = 0;
+		if (!WriteFile(pFile, (const char*)pData + nTotalWritten, (DWORD)std::min<std::size_t>(nSize - nTotalWritten, 1 << 30), &nWritten, &pOverlapped))
+			return false;
+
+		nTotalWritten += nWritten;
+	}
+
+	return true;
+}
+
+bool FileSystem::WriteVectorAt(FileDescriptor_t pFile, const IOVector* pVectors, int nVectors, unsigned long long nOffset)
+{
+	// Windows has WriteFileGather but it requires page aligned buffers so we just write them one by one.
+	for (int i = 0; i < nVectors; ++i)
+	{
+		if (!WriteAt(pFile, pVectors[i].pData, pVectors[i].nSize, nOffset))
+			return false;
+
+		nOffset += pVectors[i].nSize;
+	}
+
+	return true;
+}
+
+bool FileSystem::SyncDescriptor(FileDescriptor_t pFile)
+{
+	return FlushFileBuffers(pFile) != 0;
+}
+
+bool FileSystem::SyncDirectory(const char* /*pFolderName*/)
+{
+	return true; // NTFS journals directory entries itself & there is no way to flush a directory handle.
+}
+
+unsigned long long FileSystem::DescriptorSize(FileDescriptor_t pFile)
+{
+	LARGE_INTEGER nSize;
+	if (!GetFileSizeEx(pFile, &nSize))
+		return 0;
+
+	return nSize.QuadPart;
+}
+
+bool FileSystem::MapDescriptor(FileDescriptor_t pFile, std::size_t nSize, MappedView& pView, bool bRandomAccess)
+{
+	if (nSize == 0)
+		return false;
+
+	HANDLE pMapping = CreateFileMappingA(pFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!pMapping)
+		return false;
+
+	void* pData = MapViewOfFile(pMapping, FILE_MAP_READ, 0, 0, nSize);
+	if (!pData)
+	{
+		CloseHandle(pMapping);
+		return false;
+	}
+
+	pView.pData = (const char*)pData;
+	pView.nSize = nSize;
+	pView.pMapping = pMapping;
+	return true;
+}
+
+void FileSystem::UnmapView(MappedView& pView)
+{
+	if (pView.pData)
+		UnmapViewOfFile(pView.pData);
+
+	if (pView.pMapping)
+		CloseHandle(pView.pMapping);
+
+	pView = MappedView();
+}
+#else
+const FileDescriptor_t FileSystem::INVALID_DESCRIPTOR = -1;
+
+FileDescriptor_t FileSystem::OpenDescriptor(const char* pFileName, bool bCreate, bool bTruncate)
+{
+	int nFlags = O_RDWR | O_CLOEXEC;
+	if (bCreate)
+		nFlags |= O_CREAT;
+
+	if (bTruncate)
+		nFlags |= O_TRUNC;
+
+	return open(pFileName, nFlags, 0644);
+}
+
+void FileSystem::CloseDescriptor(FileDescriptor_t pFile)
+{
+	if (pFile != INVALID_DESCRIPTOR)
+		close(pFile);
+}
+
+long long FileSystem::ReadAt(FileDescriptor_t pFile, void* pBuffer, std::size_t nSize, unsigned long long nOffset)
+{
+	std::size_t nTotalRead = 0;
+	while (nTotalRead < nSize)
+	{
+		ssize_t nRead = pread(pFile, (char*)pBuffer + nTotalRead, nSize - nTotalRead, nOffset + nTotalRead);
+		if (nRead < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		if (nRead == 0) // End of file
+			break;
+
+		nTotalRead += nRead;
+	}
+
+	return nTotalRead;
+}
+
+bool FileSystem::WriteAt(FileDescriptor_t pFile, const void* pData, std::size_t nSize, unsigned long long nOffset)
+{
+	std::size_t nTotalWritten = 0;
+	while (nTotalWritten < nSize)
+	{
+		ssize_t nWritten = pwrite(pFile, (const char*)pData + nTotalWritten, nSize - nTotalWritten, nOffset + nTotalWritten);
+		if (nWritten < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		nTotalWritten += nWritten;
+	}
+
+	return true;
+}
+
+bool FileSystem::WriteVectorAt(FileDescriptor_t pFile, const IOVector* pVectors, int nVectors, unsigned long long nOffset)
+{
+	static_assert(sizeof(IOVector) == sizeof(iovec), "IOVector has to match iovec!");
+
+	// pwritev can write less than we asked for, in that case we continue from the vector it stopped at.
+	iovec pPartial;
+	while (nVectors > 0)
+	{
+		int nBatch = std::min(nVectors, IOV_MAX);
+		ssize_t nWritten = pwritev(pFile, (const iovec*)pVectors, nBatch, nOffset);
+		if (nWritten < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		nOffset += nWritten;
+		while (nVectors > 0 && (std::size_t)nWritten >= pVectors->nSize)
+		{
+			nWritten -= pVectors->nSize;
+			++pVectors;
+			--nVectors;
+		}
+
+		if (nWritten > 0) // Stopped in the middle of a vector, finish it on its own.
+		{
+			pPartial.iov_base = (char*)pVectors->pData + nWritten;
+			pPartial.iov_len = pVectors->nSize - nWritten;
+			if (!WriteAt(pFile, pPartial.iov_base, pPartial.iov_len, nOffset))
+				return false;
+
+			nOffset += pPartial.iov_len;
+			++pVectors;
+			--nVectors;
+		}
+	}
+
+	return true;
+}
+
+bool FileSystem::SyncDescriptor(FileDescriptor_t pFile)
+{
+	return fdatasync(pFile) == 0;
+}
+
+bool FileSystem::SyncDirectory(const char* pFolderName)
+{
+	int pFolder = open(pFolderName, O_RDONLY | O_DIRECTORY);
+	if (pFolder == -1)
+		return false;
+
+	bool bSuccess = fsync(pFolder) == 0;
+	close(pFolder);
+	return bSuccess;
+}
+
+unsigned long long FileSystem::DescriptorSize(FileDescriptor_t pFile)
+{
+	struct stat pStat;
+	if (fstat(pFile, &pStat) != 0)
+		return 0;
+
+	return pStat.st_size;
+}
+
+bool FileSystem::MapDescriptor(FileDescriptor_t pFile, std::size_t nSize, MappedView& pView, bool bRandomAccess)
+{
+	if (nSize == 0)
+		return false;
+
+	void* pData = mmap(nullptr, nSize, PROT_READ, MAP_SHARED, pFile, 0);
+	if (pData == MAP_FAILED)
+		return false;
+
+	madvise(pData, nSize, bRandomAccess ? MADV_RANDOM : MADV_SEQUENTIAL); // We nearly always walk it from front to back.
+
+	pView.pData = (const char*)pData;
+	pView.nSize = nSize;
+	return true;
+}
+
+void FileSystem::UnmapView(MappedView& pView)
+{
+	if (pView.pData)
+		munmap((void*)pView.pData, pView.nSize);
+
+	pView = MappedView();
+}
+#endif
+
 void FileSystem::TurnaceFile(const std::string& pFileName, unsigned int fileSize)
 {
 #if defined(_WIN32)
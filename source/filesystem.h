@@ -3,6 +3,69 @@
 #undef MAX_PATH // Why tf does fstream have MAX_PATH xD Gotta change it below then later.
 
 typedef std::fstream FileHandle_t;
+
+#if _WIN32
+typedef void* FileDescriptor_t; // A HANDLE
+#else
+typedef int FileDescriptor_t;
+#endif
+
+// Used by FileSystem::WriteVectorAt, same as a iovec.
+struct IOVector
+{
+	const void* pData;
+	std::size_t nSize;
+};
+
+// A single operation for FileSystem::ExecuteBatch
+struct IOOperation
+{
+	enum Type
+	{
+		READ = 0,
+		WRITE = 1,
+		WRITEV = 2,
+		SYNC = 3, // fdatasync
+	};
+
+	static IOOperation Read(FileDescriptor_t pFile, void* pBuffer, std::size_t nSize, unsigned long long nOffset)
+	{
+		return IOOperation{READ, pFile, pBuffer, nullptr, nSize, nOffset};
+	}
+
+	static IOOperation Write(FileDescriptor_t pFile, const void* pData, std::size_t nSize, unsigned long long nOffset)
+	{
+		return IOOperation{WRITE, pFile, (void*)pData, nullptr, nSize, nOffset};
+	}
+
+	static IOOperation WriteVector(FileDescriptor_t pFile, const IOVector* pVectors, int nVectors, unsigned long long nOffset)
+	{
+		return IOOperation{WRITEV, pFile, nullptr, pVectors, (std::size_t)nVectors, nOffset};
+	}
+
+	static IOOperation Sync(FileDescriptor_t pFile)
+	{
+		return IOOperation{SYNC, pFile, nullptr, nullptr, 0, 0};
+	}
+
+	Type nType;
+	FileDescriptor_t pFile;
+	void* pBuffer; // READ / WRITE
+	const IOVector* pVectors; // WRITEV
+	std::size_t nSize; // Bytes for READ / WRITE, number of vectors for WRITEV
+	unsigned long long nOffset;
+	long long nResult = 0; // Bytes read / written once it's done
+	void* pBatch = nullptr; // Internally used by the IO engine
+};
+
+// A read only memory mapping of a file, see FileSystem::MapDescriptor
+struct MappedView
+{
+	const char* pData = nullptr;
+	std::size_t nSize = 0;
+	void* pMapping = nullptr; // Windows only, the HANDLE of the file mapping.
+};
+
 namespace FileSystem
 {
 	constexpr int MAX_PATH = 64; // 260; // NOTE: We don't use any long or absolute file paths so 48 should be more than enouth.
@@ -24,5 +87,55 @@ namespace FileSystem
 
 	extern void TurnaceFile(const std::string& pFileName, unsigned int fileSize);
 
+	// Returns 0 if the file doesn't exist.
+	extern unsigned long long FileSize(const char* pFileName);
+	// Returns when the file was last written in milliseconds since the unix epoch, 0 if it doesn't exist.
+	extern unsigned long long FileModifiedTime(const char* pFileName);
+	extern bool RemoveFile(const char* pFileName);
+	// Replaces pNewFileName if it already exists.
+	extern bool RenameFile(const char* pOldFileName, const char* pNewFileName);
+
+	/*
+		Raw file descriptors with positional reads & writes.
+		Unlike a FileHandle_t they don't have a stream position, so readers and a writer can share one descriptor without reopening or seeking.
+	*/
+	extern const FileDescriptor_t INVALID_DESCRIPTOR;
+
+	// Opens the file for reading and writing, returns INVALID_DESCRIPTOR on failure.
+	extern FileDescriptor_t OpenDescriptor(const char* pFileName, bool bCreate = false, bool bTruncate = false);
+	extern void CloseDescriptor(FileDescriptor_t pFile);
+
+	// Returns the number of bytes read which is only less than nSize at the end of the file, or -1 on failure.
+	extern long long ReadAt(FileDescriptor_t pFile, void* pBuffer, std::size_t nSize, unsigned long long nOffset);
+	// Writes everything or returns false.
+	extern bool WriteAt(FileDescriptor_t pFile, const void* pData, std::size_t nSize, unsigned long long nOffset);
+	// Writes all vectors after each other starting at nOffset using as few syscalls as possible (pwritev).
+	extern bool WriteVectorAt(FileDescriptor_t pFile, const IOVector* pVectors, int nVectors, unsigned long long nOffset);
+	// Forces the data of the file onto the disk (fdatasync).
+	extern bool SyncDescriptor(FileDescriptor_t pFile);
+	// Forces the entries of the directory onto the disk, without it a newly created or renamed file can vanish on power loss.
+	extern bool SyncDirectory(const char* pFolderName);
+	extern unsigned long long DescriptorSize(FileDescriptor_t pFile);
+
+	// Maps the first nSize bytes of the file read only. The mapping stays valid even after the descriptor was closed.
+	// nSize must not go past the end of the file! bRandomAccess disables the read ahead for lookup tables that are probed instead of walked.
+	extern bool MapDescriptor(FileDescriptor_t pFile, std::size_t nSize, MappedView& pView, bool bRandomAccess = false);
+	extern void UnmapView(MappedView& pView);
+
+	/*
+		The IO engine executes batches of IOOperation's.
+		On Linux it uses a io_uring which is driven by a single thread, so the operations of all threads are submitted & completed
+		together with a single syscall instead of every worker doing its own blocking reads/writes.
+		If io_uring or one of the opcodes we use is unavailable (or bAllowIOUring is false) everything falls back to the blocking functions above,
+		the same happens at runtime if the io_uring thread can no longer be woken up.
+		ExecuteBatch still blocks the calling thread until its batch completed since our http handlers are synchronous,
+		so the io_uring saves syscalls but a worker waiting on IO is still a worker that can't handle another request.
+	*/
+	extern void InitIOEngine(bool bAllowIOUring);
+	extern bool IsIOUringActive();
+	// Executes the operations in order (a later one only runs if the previous succeeded) and waits until all are done.
+	// Returns false if any of them failed, reads only fail if they hit an error, not the end of the file.
+	extern bool ExecuteBatch(IOOperation* pOperations, int nOperations);
+
 	extern void CreateDirectory(const char* pFolderName);
 }
\ No newline at end of file
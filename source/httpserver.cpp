@@ -8,6 +8,7 @@ static std::vector<HttpRoute*>& GetRoutes()
 }
 
 static httplib::Server g_pHttpServer;
+static int g_nMaxTails = 8;
 bool HttpServer::Start()
 {
 	if (!CommandLine::HasParam("-address"))
@@ -31,8 +32,9 @@ bool HttpServer::Start()
 		pRoute->Setup(g_pHttpServer);
 	}
 
-	g_pHttpServer.set_payload_max_length(1024 * 32); // 32kb should be more than enouth for a single payload
-	g_pHttpServer.new_task_queue = [] { return new httplib::ThreadPool(4, 4); }; // Don't need many as we really don't expect much traffic
+	g_pHttpServer.set_payload_max_length(CommandLine::GetParamInt("-maxpayload", 1024 * 1024)); // Entries aren't limited to 64kb anymore so large stack traces fit
+	g_nMaxTails = std::max(CommandLine::GetParamInt("-maxtails", g_nMaxTails), 0);
+	g_pHttpServer.new_task_queue = [] { return new httplib::ThreadPool(4 + g_nMaxTails, 4); }; // Don't need many as we really don't expect much traffic
 
 	printf("Starting HttpServer on \"%s:%i\"\n", strAdress.c_str(), nPort);
 	g_pHttpServer.listen(strAdress, nPort);
@@ -57,4 +59,9 @@ void HttpServer::UnregisterRoute(HttpRoute* pRoute)
 
 		it++;
 	}
+}
+
+int HttpServer::GetMaxTails()
+{
+	return g_nMaxTails;
 }
\ No newline at end of file
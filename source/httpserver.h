@@ -13,6 +13,10 @@ namespace HttpServer
 
 	// Unregisters the given Route
 	extern void UnregisterRoute(HttpRoute* pRoute);
+
+	// How many requests can wait for new entries on /Tail at once (-maxtails).
+	// Each one keeps a thread busy, so the server gets this many threads on top of its normal ones.
+	extern int GetMaxTails();
 }
 
 class HttpRoute
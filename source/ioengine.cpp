@@ -0,0 +1,496 @@
+#include "filesystem.h"
+#include "util.h"
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <cstring>
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <climits>
+#include <cerrno>
+#endif
+
+// Completes whatever the io_uring didn't do (a nResult below 0 counts as nothing done).
+// That is short reads/writes or operations that were canceled because an earlier one failed.
+static bool FinishOperation(IOOperation& pOperation)
+{
+	switch (pOperation.nType)
+	{
+		case IOOperation::READ:
+		{
+			if (pOperation.nResult < 0)
+				pOperation.nResult = 0;
+
+			if ((std::size_t)pOperation.nResult >= pOperation.nSize)
+				return true;
+
+			long long nRead = FileSystem::ReadAt(pOperation.pFile, (char*)pOperation.pBuffer + pOperation.nResult, pOperation.nSize - pOperation.nResult, pOperation.nOffset + pOperation.nResult);
+			if (nRead < 0)
+				return false;
+
+			pOperation.nResult += nRead;
+			return true;
+		}
+		case IOOperation::WRITE:
+		{
+			if (pOperation.nResult < 0)
+				pOperation.nResult = 0;
+
+			if ((std::size_t)pOperation.nResult >= pOperation.nSize)
+				return true;
+
+			if (!FileSystem::WriteAt(pOperation.pFile, (const char*)pOperation.pBuffer + pOperation.nResult, pOperation.nSize - pOperation.nResult, pOperation.nOffset + pOperation.nResult))
+				return false;
+
+			pOperation.nResult = pOperation.nSize;
+			return true;
+		}
+		case IOOperation::WRITEV:
+		{
+			std::size_t nSkip = pOperation.nResult < 0 ? 0 : (std::size_t)pOperation.nResult;
+			std::size_t nTotal = 0;
+			for (std::size_t i = 0; i < pOperation.nSize; ++i)
+				nTotal += pOperation.pVectors[i].nSize;
+
+			if (nSkip >= nTotal)
+				return true;
+
+			// Skip the vectors that were fully written and write the rest of the partial one on its own.
+			const IOVector* pVectors = pOperation.pVectors;
+			int nVectors = (int)pOperation.nSize;
+			unsigned long long nOffset = pOperation.nOffset + nSkip;
+			while (nVectors > 0 && nSkip >= pVectors->nSize)
+			{
+				nSkip -= pVectors->nSize;
+				++pVectors;
+				--nVectors;
+			}
+
+			if (nSkip > 0)
+			{
+				if (!FileSystem::WriteAt(pOperation.pFile, (const char*)pVectors->pData + nSkip, pVectors->nSize - nSkip, nOffset))
+					return false;
+
+				nOffset += pVectors->nSize - nSkip;
+				++pVectors;
+				--nVectors;
+			}
+
+			if (!FileSystem::WriteVectorAt(pOperation.pFile, pVectors, nVectors, nOffset))
+				return false;
+
+			pOperation.nResult = nTotal;
+			return true;
+		}
+		case IOOperation::SYNC:
+		{
+			if (pOperation.nResult == 0)
+				return true;
+
+			pOperation.nResult = FileSystem::SyncDescriptor(pOperation.pFile) ? 0 : -1;
+			return pOperation.nResult == 0;
+		}
+	}
+
+	return false;
+}
+
+#if defined(__linux__)
+static constexpr unsigned int IOURING_ENTRIES = 256;
+static constexpr uint64_t IOURING_WAKEUP_DATA = 0; // user_data of the eventfd read that wakes our thread for new submissions.
+
+struct IOBatch
+{
+	IOOperation* pOperations = nullptr;
+	int nOperations = 0;
+	int nPending = 0; // Guarded by g_pCompletionMutex
+};
+
+struct IOURing
+{
+	int nRingFD = -1;
+
+	unsigned int* pSQHead = nullptr;
+	unsigned int* pSQTail = nullptr;
+	unsigned int nSQMask = 0;
+	unsigned int* pSQArray = nullptr;
+	io_uring_sqe* pSQEs = nullptr;
+
+	unsigned int* pCQHead = nullptr;
+	unsigned int* pCQTail = nullptr;
+	unsigned int nCQMask = 0;
+	io_uring_cqe* pCQEs = nullptr;
+};
+
+static IOURing g_pRing;
+static int g_nWakeupFD = -1;
+static uint64_t g_nWakeupValue = 0;
+static std::atomic<bool> g_bIOUringActive = false;
+
+static std::mutex g_pQueueMutex; // Guards g_pQueuedBatches & g_bWakeupPending
+static std::vector<IOBatch*> g_pQueuedBatches;
+static bool g_bWakeupPending = false;
+
+static std::mutex g_pCompletionMutex;
+static std::condition_variable g_pCompletionCondition;
+
+static bool ProbeIOURingOperations(int nRingFD)
+{
+	static constexpr unsigned int PROBE_OPERATIONS = 256;
+	std::vector<char> pProbeBuffer(sizeof(io_uring_probe) + PROBE_OPERATIONS * sizeof(io_uring_probe_op), 0);
+	io_uring_probe* pProbe = (io_uring_probe*)pProbeBuffer.data();
+	if (syscall(__NR_io_uring_register, nRingFD, IORING_REGISTER_PROBE, pProbe, PROBE_OPERATIONS) < 0)
+	{
+		printf("io_uring can't be probed (%s), using blocking IO\n", strerror(errno));
+		return false;
+	}
+
+	for (unsigned int nOpcode : {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_WRITEV, IORING_OP_FSYNC})
+	{
+		if (nOpcode > pProbe->last_op || !(pProbe->ops[nOpcode].flags & IO_URING_OP_SUPPORTED))
+		{
+			printf("io_uring doesn't support opcode %u, using blocking IO\n", nOpcode);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool SetupIOURing()
+{
+	io_uring_params pParams;
+	std::memset(&pParams, 0, sizeof(pParams));
+
+	int nRingFD = (int)syscall(__NR_io_uring_setup, IOURING_ENTRIES, &pParams);
+	if (nRingFD < 0)
+	{
+		printf("io_uring is unavailable (%s), using blocking IO\n", strerror(errno));
+		return false;
+	}
+
+	if (!(pParams.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		printf("io_uring is too old (no IORING_FEAT_SINGLE_MMAP), using blocking IO\n");
+		close(nRingFD);
+		return false;
+	}
+
+	// Kernels (or seccomp filters) can support the ring itself but not every opcode we submit, those would fail every batch.
+	if (!ProbeIOURingOperations(nRingFD))
+	{
+		close(nRingFD);
+		return false;
+	}
+
+	std::size_t nSQSize = pParams.sq_off.array + pParams.sq_entries * sizeof(unsigned int);
+	std::size_t nCQSize = pParams.cq_off.cqes + pParams.cq_entries * sizeof(io_uring_cqe);
+	std::size_t nRingSize = std::max(nSQSize, nCQSize);
+
+	char* pRingPtr = (char*)mmap(nullptr, nRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, nRingFD, IORING_OFF_SQ_RING);
+	if (pRingPtr == MAP_FAILED)
+	{
+		close(nRingFD);
+		return false;
+	}
+
+	io_uring_sqe* pSQEs = (io_uring_sqe*)mmap(nullptr, pParams.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, nRingFD, IORING_OFF_SQES);
+	if (pSQEs == MAP_FAILED)
+	{
+		munmap(pRingPtr, nRingSize);
+		close(nRingFD);
+		return false;
+	}
+
+	g_nWakeupFD = eventfd(0, EFD_CLOEXEC);
+	if (g_nWakeupFD < 0)
+	{
+		munmap(pSQEs, pParams.sq_entries * sizeof(io_uring_sqe));
+		munmap(pRingPtr, nRingSize);
+		close(nRingFD);
+		return false;
+	}
+
+	g_pRing.nRingFD = nRingFD;
+	g_pRing.pSQHead = (unsigned int*)(pRingPtr + pParams.sq_off.head);
+	g_pRing.pSQTail = (unsigned int*)(pRingPtr + pParams.sq_off.tail);
+	g_pRing.nSQMask = *(unsigned int*)(pRingPtr + pParams.sq_off.ring_mask);
+	g_pRing.pSQArray = (unsigned int*)(pRingPtr + pParams.sq_off.array);
+	g_pRing.pSQEs = pSQEs;
+	g_pRing.pCQHead = (unsigned int*)(pRingPtr + pParams.cq_off.head);
+	g_pRing.pCQTail = (unsigned int*)(pRingPtr + pParams.cq_off.tail);
+	g_pRing.nCQMask = *(unsigned int*)(pRingPtr + pParams.cq_off.ring_mask);
+	g_pRing.pCQEs = (io_uring_cqe*)(pRingPtr + pParams.cq_off.cqes);
+
+	return true;
+}
+
+// Only our IO thread ever touches the submission queue so no locking is needed.
+static io_uring_sqe* GetSQE()
+{
+	unsigned int nTail = *g_pRing.pSQTail;
+	unsigned int nHead = __atomic_load_n(g_pRing.pSQHead, __ATOMIC_ACQUIRE);
+	if (nTail - nHead >= IOURING_ENTRIES)
+		return nullptr;
+
+	unsigned int nIndex = nTail & g_pRing.nSQMask;
+	io_uring_sqe* pSQE = &g_pRing.pSQEs[nIndex];
+	std::memset(pSQE, 0, sizeof(io_uring_sqe));
+	g_pRing.pSQArray[nIndex] = nIndex;
+
+	__atomic_store_n(g_pRing.pSQTail, nTail + 1, __ATOMIC_RELEASE);
+	return pSQE;
+}
+
+static unsigned int GetFreeSQEs()
+{
+	return IOURING_ENTRIES - (*g_pRing.pSQTail - __atomic_load_n(g_pRing.pSQHead, __ATOMIC_ACQUIRE));
+}
+
+static void ArmWakeup()
+{
+	io_uring_sqe* pSQE = GetSQE();
+	pSQE->opcode = IORING_OP_READ;
+	pSQE->fd = g_nWakeupFD;
+	pSQE->addr = (uint64_t)&g_nWakeupValue;
+	pSQE->len = sizeof(g_nWakeupValue);
+	pSQE->user_data = IOURING_WAKEUP_DATA;
+}
+
+// Moves as many queued batches as fit into the submission queue. Returns the number of added SQEs.
+static unsigned int SubmitQueuedBatches(unsigned int& nInFlight)
+{
+	std::lock_guard<std::mutex> pLock(g_pQueueMutex);
+	unsigned int nAdded = 0;
+	std::size_t nBatch = 0;
+	for (; nBatch < g_pQueuedBatches.size(); ++nBatch)
+	{
+		IOBatch* pBatch = g_pQueuedBatches[nBatch];
+		// Leave one free for the wakeup read & keep the completion queue (2x the size) from overflowing.
+		if ((unsigned int)pBatch->nOperations + 1 > GetFreeSQEs() || nInFlight + pBatch->nOperations >= IOURING_ENTRIES)
+			break;
+
+		for (int i = 0; i < pBatch->nOperations; ++i)
+		{
+			IOOperation& pOperation = pBatch->pOperations[i];
+			io_uring_sqe* pSQE = GetSQE();
+			pSQE->fd = pOperation.pFile;
+			pSQE->off = pOperation.nOffset;
+			pSQE->user_data = (uint64_t)&pOperation;
+			if (i + 1 < pBatch->nOperations)
+				pSQE->flags = IOSQE_IO_LINK; // Everything in a batch has to happen in order
+
+			switch (pOperation.nType)
+			{
+				case IOOperation::READ:
+					pSQE->opcode = IORING_OP_READ;
+					pSQE->addr = (uint64_t)pOperation.pBuffer;
+					pSQE->len = (unsigned int)pOperation.nSize;
+					break;
+				case IOOperation::WRITE:
+					pSQE->opcode = IORING_OP_WRITE;
+					pSQE->addr = (uint64_t)pOperation.pBuffer;
+					pSQE->len = (unsigned int)pOperation.nSize;
+					break;
+				case IOOperation::WRITEV:
+					pSQE->opcode = IORING_OP_WRITEV;
+					pSQE->addr = (uint64_t)pOperation.pVectors;
+					pSQE->len = (unsigned int)pOperation.nSize;
+					break;
+				case IOOperation::SYNC:
+					pSQE->opcode = IORING_OP_FSYNC;
+					pSQE->fsync_flags = IORING_FSYNC_DATASYNC;
+					break;
+			}
+		}
+
+		nAdded += pBatch->nOperations;
+		nInFlight += pBatch->nOperations;
+	}
+
+	g_pQueuedBatches.erase(g_pQueuedBatches.begin(), g_pQueuedBatches.begin() + nBatch);
+	g_bWakeupPending = !g_pQueuedBatches.empty(); // Anything left over is picked up once some operations completed.
+	return nAdded;
+}
+
+// Runs until the wakeup read fails, after which g_bIOUringActive is false & everyone uses the blocking IO.
+static void IOURingThread()
+{
+	ArmWakeup();
+	unsigned int nToSubmit = 1;
+	unsigned int nInFlight = 0;
+	bool bStopping = false;
+	while (!bStopping || nInFlight > 0)
+	{
+		int nSubmitted = (int)syscall(__NR_io_uring_enter, g_pRing.nRingFD, nToSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (nSubmitted < 0)
+		{
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				printf("io_uring_enter failed (%s)\n", strerror(errno));
+
+			nSubmitted = 0;
+		}
+		nToSubmit -= std::min(nToSubmit, (unsigned int)nSubmitted);
+
+		bool bWokenUp = false;
+		bool bCompletedAny = false;
+		{
+			std::lock_guard<std::mutex> pLock(g_pCompletionMutex);
+			unsigned int nHead = *g_pRing.pCQHead;
+			unsigned int nTail = __atomic_load_n(g_pRing.pCQTail, __ATOMIC_ACQUIRE);
+			for (; nHead != nTail; ++nHead)
+			{
+				io_uring_cqe* pCQE = &g_pRing.pCQEs[nHead & g_pRing.nCQMask];
+				if (pCQE->user_data == IOURING_WAKEUP_DATA)
+				{
+					if (pCQE->res < 0 && pCQE->res != -EINTR && pCQE->res != -EAGAIN)
+					{
+						// Without the wakeup read we would never see new batches again.
+						printf("io_uring wakeup read failed (%s), using blocking IO\n", strerror(-pCQE->res));
+						bStopping = true;
+					} else {
+						bWokenUp = true;
+					}
+					continue;
+				}
+
+				IOOperation* pOperation = (IOOperation*)pCQE->user_data;
+				pOperation->nResult = pCQE->res;
+				--((IOBatch*)pOperation->pBatch)->nPending;
+				--nInFlight;
+				bCompletedAny = true;
+			}
+			__atomic_store_n(g_pRing.pCQHead, nHead, __ATOMIC_RELEASE);
+		}
+
+		if (bCompletedAny)
+			g_pCompletionCondition.notify_all();
+
+		if (bStopping)
+		{
+			{
+				std::lock_guard<std::mutex> pLock(g_pQueueMutex);
+				g_bIOUringActive = false; // ExecuteBatch checks it under the same lock, so nothing new is queued after this.
+			}
+
+			nToSubmit += SubmitQueuedBatches(nInFlight); // Drain whatever was already queued.
+		} else if (bWokenUp) {
+			{
+				std::lock_guard<std::mutex> pLock(g_pQueueMutex);
+				g_bWakeupPending = false;
+			}
+
+			nToSubmit += SubmitQueuedBatches(nInFlight);
+			ArmWakeup();
+			++nToSubmit;
+		} else if (bCompletedAny) {
+			nToSubmit += SubmitQueuedBatches(nInFlight);
+		}
+	}
+}
+
+static std::thread g_pIOURingThread;
+#endif
+
+void FileSystem::InitIOEngine(bool bAllowIOUring)
+{
+#if defined(__linux__)
+	if (!bAllowIOUring || !SetupIOURing())
+		return;
+
+	g_bIOUringActive = true;
+	g_pIOURingThread = std::thread(IOURingThread);
+	Util::SetThreadName(g_pIOURingThread, "IOURingThread");
+	g_pIOURingThread.detach();
+	printf("Using io_uring for file IO\n");
+#endif
+}
+
+bool FileSystem::IsIOUringActive()
+{
+#if defined(__linux__)
+	return g_bIOUringActive;
+#else
+	return false;
+#endif
+}
+
+bool FileSystem::ExecuteBatch(IOOperation* pOperations, int nOperations)
+{
+#if defined(__linux__)
+	bool bUseIOUring = g_bIOUringActive && nOperations < (int)IOURING_ENTRIES / 2;
+	for (int i = 0; bUseIOUring && i < nOperations; ++i)
+	{
+		if (pOperations[i].nType == IOOperation::WRITEV && pOperations[i].nSize > IOV_MAX)
+			bUseIOUring = false; // The io_uring has the same limit as pwritev.
+	}
+
+	if (bUseIOUring)
+	{
+		IOBatch pBatch;
+		pBatch.pOperations = pOperations;
+		pBatch.nOperations = nOperations;
+		pBatch.nPending = nOperations;
+		for (int i = 0; i < nOperations; ++i)
+		{
+			pOperations[i].nResult = 0;
+			pOperations[i].pBatch = &pBatch;
+		}
+
+		bool bWakeup = false;
+		{
+			std::lock_guard<std::mutex> pLock(g_pQueueMutex);
+			bUseIOUring = g_bIOUringActive; // The io_uring thread could have stopped since we checked.
+			if (bUseIOUring)
+			{
+				g_pQueuedBatches.push_back(&pBatch);
+				bWakeup = !g_bWakeupPending; // Only the first one has to wake up the thread, it takes everything that's queued.
+				g_bWakeupPending = true;
+			}
+		}
+
+		if (bWakeup)
+		{
+			uint64_t nValue = 1;
+			if (write(g_nWakeupFD, &nValue, sizeof(nValue)) != sizeof(nValue))
+				printf("Failed to wake up the io_uring thread!\n");
+		}
+
+		if (bUseIOUring)
+		{
+			std::unique_lock<std::mutex> pLock(g_pCompletionMutex);
+			g_pCompletionCondition.wait(pLock, [&pBatch] { return pBatch.nPending == 0; });
+		}
+
+		for (int i = 0; i < nOperations; ++i)
+			pOperations[i].pBatch = nullptr;
+	}
+
+	if (bUseIOUring)
+	{
+		// The io_uring can do short reads/writes & cancels the rest of a batch if anything failed, those are finished blocking.
+		for (int i = 0; i < nOperations; ++i)
+		{
+			if (!FinishOperation(pOperations[i]))
+				return false;
+		}
+
+		return true;
+	}
+#endif
+
+	for (int i = 0; i < nOperations; ++i)
+	{
+		pOperations[i].nResult = -1; // Nothing was done yet.
+		if (!FinishOperation(pOperations[i]))
+			return false;
+	}
+
+	return true;
+}
\ No newline at end of file
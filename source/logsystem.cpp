@@ -1,5 +1,6 @@
 #include "logsystem.h"
 #include "filesystem.h"
+#include "commandline.h"
 #include "shared_mutex"
 #include "util.h"
 #include "algorithm"
@@ -7,13 +8,89 @@
 #include "cstring"
 #include "climits"
 #include "mutex"
+#include "condition_variable"
+#include "vector"
+#include "deque"
+#include "memory"
+#include "atomic"
+#include "charconv"
+#include "unordered_map"
+#include "unordered_set"
+#include "string_view"
+#include "compression.h"
+#include "checksum.h"
+#include "stringsearch.h"
 #include <filesystem>
 
-typedef unsigned short EntrySize;
+typedef unsigned int EntrySize;
+typedef unsigned short LegacyEntrySize; // Size prefix used by RECORD_FORMAT_1 / RECORD_FORMAT_2 and the data files of V1/V2 indexes.
+typedef unsigned int EntryOffset; // Offset of a record inside its segment file, stored in the ".idx" sidecar of each segment.
+typedef unsigned long long EntryTimestamp; // Ingest time in milliseconds since the unix epoch, 0 for entries written before we had timestamps.
 
 static constexpr double MAX_INDEX_LOADED_TIME = 30.0; // Time in seconds after which a index is unloaded. (based off the last time they were accessed)
 static constexpr long long INDEX_LOADED_CHECK_INTERVALS = 1000; // How often we check for indexes to unload (in ms)
 
+// Group commit: concurrent AddEntry calls on the same index are written by a single thread in one write + flush.
+// The first thread becomes the leader and waits up to g_nGroupCommitWindow for more entries or until g_nGroupCommitBytes are queued.
+// With a window of 0 the leader writes immediately, though anything that arrives while a batch is written still becomes the next batch.
+static long long g_nGroupCommitWindow = 0; // in microseconds, set by -groupcommitwindow
+static std::size_t g_nGroupCommitBytes = 1 << 16; // set by -groupcommitbytes
+
+/*
+	How far an entry has to get before AddEntry reports it as written. Ordered from fastest to safest.
+	Set server wide with -durability <level> and per index / name prefix with -durabilityrules "audit=fdatasync-entry;debug_*=none"
+
+	none            - Entries stay inside our stream buffer until it fills up or the segment is closed.
+	                  No syscall per batch, but a crash of the process loses whatever is still buffered.
+	flush           - (default) Every batch is written into the OS page cache with one write.
+	                  Survives the process crashing, but not the machine crashing / power loss.
+	fdatasync-batch - flush + one fdatasync of the segment per batch. Survives power loss.
+	                  Costs a full disk flush per batch so pair it with -groupcommitwindow.
+	fdatasync-entry - flush + fdatasync after every single entry. Also survives power loss,
+	                  but every entry pays the full disk flush and batching no longer helps throughput.
+
+	The LogIndex is only written once an index is unloaded, after a power loss the fdatasync levels rely on the recovery at startup
+	to find the synced entries again. With -norecovery everything written since the last unload is lost.
+	New segments & indexes sync their directory once so that recovery can find them.
+	The offsets sidecar is never synced since it can be rebuilt from the segment itself.
+*/
+enum class Durability
+{
+	NONE = 0,
+	FLUSH = 1,
+	SYNC_BATCH = 2,
+	SYNC_ENTRY = 3,
+};
+
+static Durability g_nDefaultDurability = Durability::FLUSH;
+static std::vector<IndexRule> g_pDurabilityRules;
+
+static bool ParseDurability(const std::string& strDurability, Durability& nDurability)
+{
+	if (strDurability == "none")
+		nDurability = Durability::NONE;
+	else if (strDurability == "flush")
+		nDurability = Durability::FLUSH;
+	else if (strDurability == "fdatasync-batch")
+		nDurability = Durability::SYNC_BATCH;
+	else if (strDurability == "fdatasync-entry")
+		nDurability = Durability::SYNC_ENTRY;
+	else
+		return false;
+
+	return true;
+}
+
+static Durability GetDurabilityForIndex(const std::string& strIndexName)
+{
+	Durability nDurability = g_nDefaultDurability;
+	const std::string* strRule = Util::FindIndexRule(g_pDurabilityRules, strIndexName);
+	if (strRule && !ParseDurability(*strRule, nDurability))
+		printf("Invalid durability \"%s\" for index \"%s\"\n", strRule->c_str(), strIndexName.c_str());
+
+	return nDurability;
+}
+
 // Strings for filesystem stuff
 static constexpr const char* pLogDataDir = "logdata/data/";
 static constexpr int pLogDataDirLength = 13;
@@ -21,9 +98,91 @@ static constexpr const char* pLogIndexesDir = "logdata/indexes/";
 static constexpr int pLogIndexesDirLength = 16;
 static constexpr const char* pLogExtension = ".dat";
 static constexpr int pLogExtensionLength = 4;
+static constexpr const char* pLogIndexTempExtension = ".tmp"; // An index that is still being saved, left over if we crashed while doing so.
+static constexpr const char* pLogOffsetsExtension = ".idx"; // Sidecar of a segment containing one EntryOffset per entry.
+static constexpr const char* pLogTimesExtension = ".tim"; // Sidecar of a segment containing the EntryTimestamp of every TIME_INDEX_INTERVAL'th entry.
+static constexpr unsigned int TIME_INDEX_INTERVAL = 64; // A time range query scans at most this many entries before reaching its range.
+static constexpr const char* pLogTrigramsExtension = ".tri"; // Sidecar of a sealed segment containing the trigram posting lists of its entries, see TrigramIndexHeader.
+static constexpr const char* pLogBloomExtension = ".blm"; // Sidecar of a sealed segment containing Bloom filters of its tokens, see BloomIndexHeader.
+
+static constexpr int ENTRIES_TRIGGER_DELETION = 1 << 14; // Default entries limit of the RetentionPolicy. This can safely be changed without needing a version change.
+static constexpr int ENTRIES_DELETION_CYCLE = 1 << 11; // How many entries are deleted if we ever hit the limit. This is also the number of entries a segment holds.
+
+/*
+	How long an index keeps its entries, checked by a background thread every RETENTION_CHECK_INTERVAL instead of while writing.
+	Once an index is over any of its limits its oldest segments are deleted until it isn't anymore, so it ends up slightly below them.
+	The segment that's still written to is never deleted.
+	Set server wide with -retention "entries:16384,bytes:512m,age:7d" and per index / name prefix with -retentionrules "audit=age:90d;debug_*=entries:4096,bytes:64m"
+	Rules only change the limits they name. Sizes take a k/m/g suffix, ages s/m/h/d (seconds without one) & a limit of 0 means no limit.
+*/
+struct RetentionPolicy
+{
+	unsigned long long nMaxEntries = ENTRIES_TRIGGER_DELETION;
+	unsigned long long nMaxBytes = 0; // Size of the segment files on disk, sidecars aren't included.
+	unsigned long long nMaxAge = 0; // in milliseconds
+};
+
+static constexpr long long RETENTION_CHECK_INTERVAL = 5000; // in ms
+static RetentionPolicy g_pDefaultRetention;
+static std::vector<IndexRule> g_pRetentionRules;
+
+// pPolicy is only changed if all of strRetention is valid.
+static bool ParseRetention(const std::string& strRetention, RetentionPolicy& pPolicy)
+{
+	RetentionPolicy pParsed = pPolicy;
+	std::size_t nStart = 0;
+	while (nStart < strRetention.length())
+	{
+		std::size_t nEnd = strRetention.find(',', nStart);
+		if (nEnd == std::string::npos)
+			nEnd = strRetention.length();
+
+		std::string strLimit = strRetention.substr(nStart, nEnd - nStart);
+		nStart = nEnd + 1;
+
+		std::size_t nColon = strLimit.find(':');
+		if (nColon == std::string::npos)
+			return false;
+
+		std::string strName = strLimit.substr(0, nColon);
+		const char* pValue = strLimit.c_str() + nColon + 1;
+		char* pSuffix = nullptr;
+		unsigned long long nValue = std::strtoull(pValue, &pSuffix, 10);
+		if (pSuffix == pValue)
+			return false;
+
+		std::string strSuffix = pSuffix;
+		if (strName == "entries" && strSuffix.empty())
+		{
+			pParsed.nMaxEntries = nValue;
+		} else if (strName == "bytes" && (strSuffix.empty() || strSuffix == "k" || strSuffix == "m" || strSuffix == "g")) {
+			unsigned int nShift = strSuffix.empty() ? 0 : (strSuffix == "k" ? 10 : (strSuffix == "m" ? 20 : 30));
+			pParsed.nMaxBytes = nValue << nShift;
+		} else if (strName == "age" && (strSuffix.empty() || strSuffix == "s" || strSuffix == "m" || strSuffix == "h" || strSuffix == "d")) {
+			unsigned long long nUnit = (strSuffix.empty() || strSuffix == "s") ? 1000 : (strSuffix == "m" ? 60 * 1000 : (strSuffix == "h" ? 60 * 60 * 1000 : 24 * 60 * 60 * 1000));
+			pParsed.nMaxAge = nValue * nUnit;
+		} else {
+			return false;
+		}
+	}
+
+	pPolicy = pParsed;
+	return true;
+}
+
+static RetentionPolicy GetRetentionForIndex(const std::string& strIndexName)
+{
+	RetentionPolicy pPolicy = g_pDefaultRetention;
+	const std::string* strRule = Util::FindIndexRule(g_pRetentionRules, strIndexName);
+	if (strRule && !ParseRetention(*strRule, pPolicy))
+	{
+		printf("Invalid retention \"%s\" for index \"%s\"\n", strRule->c_str(), strIndexName.c_str());
+		pPolicy = g_pDefaultRetention;
+	}
+
+	return pPolicy;
+}
 
-static constexpr int ENTRIES_TRIGGER_DELETION = 1 << 14; // This can safely be increased without needing a version change since the nEntriesData is at the end of the LogIndex
-static constexpr int ENTRIES_DELETION_CYCLE = 1 << 11; // How many entries are deleted if we ever hit the limit.
 // FileSystem::MAX_PATH is set to 256 since most OS filesystems only allow file names/paths up to that length.
 
 // Simplified it by every Index having a single unique name instead of this.
@@ -46,7 +205,7 @@ struct LogIndex_V1
 	unsigned int nTotalSize = 0;
 };
 
-static constexpr int INDEX_VERSION_LATEST = 2;
+static constexpr int INDEX_VERSION_2 = 2;
 struct LogIndex_V2 // This should NEVER have stuff like std::string, we write this entire sturcture straight to disk!
 {
 	unsigned int version = 2; // In case we change any of the structs in the future.
@@ -58,7 +217,52 @@ struct LogIndex_V2 // This should NEVER have stuff like std::string, we write th
 	unsigned int nKeys = 0; // The total number of LogKey that refer to this log entry.
 };
 
-struct LogIndex : LogIndex_V2 // Implements all functions. Done like this simply to keep it more readable.
+/*
+	Since V3 the data of an index is no longer a single file but is split into segments
+	"logdata/data/<id>/<segment>.dat" which each hold exactly nSegmentEntries entries.
+	Only the newest segment is ever written to, once it's full it's sealed and a new one is started.
+	Because of this, retention is simply unlinking the oldest segment instead of rewriting the entire file.
+*/
+static constexpr int INDEX_VERSION_3 = 3;
+struct LogIndex_V3 // This should NEVER have stuff like std::string, we write this entire sturcture straight to disk!
+{
+	unsigned int version = 3; // In case we change any of the structs in the future.
+	UniqueFilenameId nFileName; // FileName of the index file containing this LogIndex data.
+	char nIndexName[48] = {0}; // Unique name of this index that is given to use to find it.
+	unsigned int nEntries = 0; // Number of entries across all segments that are still on disk.
+	unsigned int nTotalSize = 0; // Size of all records across all segments, excluding the SegmentHeader's.
+
+	unsigned int nKeys = 0; // The total number of LogKey that refer to this log entry.
+
+	unsigned int nFirstSegment = 0; // The oldest segment that still exists on disk.
+	unsigned int nSegmentEntries = ENTRIES_DELETION_CYCLE; // Stored per index so that changing ENTRIES_DELETION_CYCLE doesn't break existing indexes.
+	unsigned int nActiveSegmentSize = 0; // Size of the newest segment including its SegmentHeader. 0 if it wasn't created yet.
+};
+
+/*
+	V4 only widens nTotalSize since all segments together can easily hold more than 4GB.
+	A single segment is still limited to 4GB, see Log::GetMaxEntrySize.
+*/
+static constexpr int INDEX_VERSION_LATEST = 4;
+struct LogIndex_V4 // This should NEVER have stuff like std::string, we write this entire sturcture straight to disk!
+{
+	unsigned int version = 4; // In case we change any of the structs in the future.
+	UniqueFilenameId nFileName; // FileName of the index file containing this LogIndex data.
+	char nIndexName[48] = {0}; // Unique name of this index that is given to use to find it.
+	unsigned short nPadding = 0; // Explicit so that comparing two LogIndex's with memcmp works.
+	unsigned int nEntries = 0; // Number of entries across all segments that are still on disk.
+
+	unsigned int nKeys = 0; // The total number of LogKey that refer to this log entry.
+
+	unsigned int nFirstSegment = 0; // The oldest segment that still exists on disk.
+	unsigned int nSegmentEntries = ENTRIES_DELETION_CYCLE; // Stored per index so that changing ENTRIES_DELETION_CYCLE doesn't break existing indexes.
+	unsigned int nActiveSegmentSize = 0; // Size of the newest segment including its SegmentHeader. 0 if it wasn't created yet.
+
+	unsigned long long nTotalSize = 0; // Size of all records across all segments, excluding the SegmentHeader's.
+};
+static_assert(sizeof(LogIndex_V4) == 96, "LogIndex_V4 has implicit padding");
+
+struct LogIndex : LogIndex_V4 // Implements all functions. Done like this simply to keep it more readable.
 {
 	LogIndex()
 	{
@@ -74,10 +278,38 @@ struct LogIndex : LogIndex_V2 // Implements all functions. Done like this simply
 		nIndexName[MAX_KEY_SIZE - 1] = '\0';
 	}
 
+	// NOTE: The version is kept so that the Log knows that it still has to migrate its data file.
 	LogIndex& operator=(const LogIndex_V1& other)
 	{
-		memcpy(this, &other, sizeof(LogIndex_V1));
+		version = other.version;
+		nFileName = other.nFileName;
+		memcpy(nIndexName, other.nIndexName, sizeof(nIndexName));
+		nEntries = other.nEntries;
+		nTotalSize = other.nTotalSize;
 		nKeys = 0;
+		nFirstSegment = 0;
+		nSegmentEntries = ENTRIES_DELETION_CYCLE;
+		nActiveSegmentSize = 0;
+		return *this;
+	}
+
+	LogIndex& operator=(const LogIndex_V2& other)
+	{
+		*this = (const LogIndex_V1&)other;
+		nKeys = other.nKeys;
+		return *this;
+	}
+
+	// V3 already uses segments so only the layout changes.
+	LogIndex& operator=(const LogIndex_V3& other)
+	{
+		*this = (const LogIndex_V1&)other;
+		version = INDEX_VERSION_LATEST;
+		nKeys = other.nKeys;
+		nFirstSegment = other.nFirstSegment;
+		nSegmentEntries = other.nSegmentEntries;
+		nActiveSegmentSize = other.nActiveSegmentSize;
+		return *this;
 	}
 };
 
@@ -96,660 +328,4304 @@ static inline bool LoadLogIndex(LogIndex& pIndex, FileHandle_t& pHandle)
 		return true;
 	}
 
-	if (indexVersion == INDEX_VERSION_LATEST)
+	if (indexVersion == INDEX_VERSION_2)
+	{
+		LogIndex_V2 pIndexV2;
+		pHandle.read((char*)&pIndexV2, sizeof(LogIndex_V2));
+
+		pIndex = pIndexV2;
+		return true;
+	}
+
+	if (indexVersion == INDEX_VERSION_3)
 	{
-		pHandle.read((char*)&pIndex, sizeof(LogIndex));
+		LogIndex_V3 pIndexV3;
+		pHandle.read((char*)&pIndexV3, sizeof(LogIndex_V3));
+		if (pHandle.gcount() != sizeof(LogIndex_V3))
+			return false;
+
+		pIndex = pIndexV3;
 		return true;
 	}
 
+	if (indexVersion == INDEX_VERSION_LATEST)
+	{
+		pHandle.read((char*)(LogIndex_V4*)&pIndex, sizeof(LogIndex_V4));
+		return pHandle.gcount() == sizeof(LogIndex_V4);
+	}
+
 	return false;
 }
 
-struct Log // This stuct will be in memory, and only the LogIndex is written to disk.
+// Every segment file starts with this header so that each segment describes its own record format.
+// This allows us to change the record format in the future without having to rewrite older segments.
+static constexpr unsigned int SEGMENT_MAGIC = 0x474C5348; // "HSLG"
+static constexpr unsigned short RECORD_FORMAT_1 = 1; // [LegacyEntrySize][Data]
+static constexpr unsigned short RECORD_FORMAT_COMPRESSED = 2; // Records grouped into compressed blocks, only used by sealed segments.
+static constexpr unsigned short RECORD_FORMAT_2 = 3; // [LegacyEntrySize][CRC32C of Data][Data]
+static constexpr unsigned short RECORD_FORMAT_3 = 4; // [Varint size][CRC32C of Data][Data] - small entries pay a single byte for their size & entries can be larger than 64kb.
+static constexpr unsigned short RECORD_FORMAT_4 = 5; // [Varint size][CRC32C of everything after it][Varint EntryTimestamp][Data]
+static constexpr unsigned short RECORD_FORMAT_LATEST = RECORD_FORMAT_4;
+struct SegmentHeader
 {
-public:
-	enum FileMode
-	{
-		NONE = 0,
-		READ = 1,
-		WRITE = 2,
-		APPEND = 3,
-		READWRITE = 4,
-	};
-
-	Log()
-	{
-		MarkTouched();
-	}
+	unsigned int nMagic = SEGMENT_MAGIC;
+	unsigned short nRecordFormat = RECORD_FORMAT_LATEST;
+	unsigned short nBlockRecordFormat = 0; // Only for RECORD_FORMAT_COMPRESSED, the format of the records inside the blocks. 0 = RECORD_FORMAT_1
+};
 
-	~Log()
-	{
-		FileHandle_t pFile = OpenIndexFile();
-		if (pFile.is_open())
-		{
-			pFile.write((char*)this, sizeof(LogIndex));
-			pFile.close();
-		}
+// The header of a single record, in RECORD_FORMAT_1 only the nSize exists.
+struct RecordHeader
+{
+	EntrySize nSize = 0;
+	unsigned int nChecksum = 0;
+	EntryTimestamp nTimestamp = 0;
+	std::size_t nChecksumStart = 0; // Where the checksummed bytes start, relative to the start of the record. They always end with the data.
+};
+static constexpr std::size_t MAX_VARINT_SIZE = 10; // 7 bits per byte for a 64 bit value
+static constexpr std::size_t MAX_RECORD_HEADER_SIZE = 5 + sizeof(unsigned int) + MAX_VARINT_SIZE;
 
-		if (pEntryFile.is_open())
-			pEntryFile.close();
+static inline bool IsRecordFormatValid(unsigned short nRecordFormat)
+{
+	return nRecordFormat == RECORD_FORMAT_1 || nRecordFormat == RECORD_FORMAT_2 || nRecordFormat == RECORD_FORMAT_3 || nRecordFormat == RECORD_FORMAT_4;
+}
 
-		printf("Unloaded Log Index \"%s\" from memory\n", pIndex.nIndexName);
-	}
+static inline bool HasRecordChecksum(unsigned short nRecordFormat)
+{
+	return nRecordFormat == RECORD_FORMAT_2 || nRecordFormat == RECORD_FORMAT_3 || nRecordFormat == RECORD_FORMAT_4;
+}
 
-	FileHandle_t OpenIndexFile()
+// Returns false if nAvailable bytes aren't enouth or it's longer than nMaxSize bytes.
+static inline bool ReadVarint(const char* pData, std::size_t nAvailable, std::size_t nMaxSize, std::size_t& nPos, unsigned long long& nValue)
+{
+	nValue = 0;
+	for (std::size_t nShift = 0, nStart = nPos; ; nShift += 7)
 	{
-		char nIndexFileName[FileSystem::MAX_PATH];
-		std::memcpy(nIndexFileName, pLogIndexesDir, pLogIndexesDirLength);
-		int nWritten = Util::WriteUniqueFilenameIntoBuffer(pIndex.nFileName, nIndexFileName + pLogIndexesDirLength, sizeof(nIndexFileName) - pLogIndexesDirLength);
-		std::memcpy(nIndexFileName + pLogIndexesDirLength + nWritten, pLogExtension, pLogExtensionLength);
-		nIndexFileName[pLogIndexesDirLength + nWritten + pLogExtensionLength] = '\0';
+		if (nPos >= nAvailable || nPos - nStart >= nMaxSize)
+			return false;
 
-		return FileSystem::OpenWriteFile(nIndexFileName);
+		unsigned char nByte = (unsigned char)pData[nPos++];
+		nValue |= (unsigned long long)(nByte & 0x7F) << nShift;
+		if (!(nByte & 0x80))
+			return true;
 	}
+}
 
-	FileHandle_t& OpenDataFile(FileMode pFileMode)
+static inline std::size_t WriteVarint(char* pBuffer, unsigned long long nValue)
+{
+	std::size_t nPos = 0;
+	while (nValue >= 0x80)
 	{
-		if (pEntryFile.is_open() && pFileMode != nEntryFileMode)
-			pEntryFile.close();
-
-		if (!pEntryFile.is_open())
-		{
-			char nEntryFileName[FileSystem::MAX_PATH];
-			std::memcpy(nEntryFileName, pLogDataDir, pLogDataDirLength);
-			int nWritten = Util::WriteUniqueFilenameIntoBuffer(pIndex.nFileName, nEntryFileName + pLogDataDirLength, sizeof(nEntryFileName) - pLogDataDirLength);
-			std::memcpy(nEntryFileName + pLogDataDirLength + nWritten, pLogExtension, pLogExtensionLength);
-			nEntryFileName[pLogDataDirLength + nWritten + pLogExtensionLength] = '\0';
+		pBuffer[nPos++] = (char)((nValue & 0x7F) | 0x80);
+		nValue >>= 7;
+	}
+	pBuffer[nPos++] = (char)nValue;
 
-			nEntryFileMode = pFileMode;
-			if (nEntryFileMode == FileMode::APPEND) {
-				pEntryFile = FileSystem::OpenAppendFile(nEntryFileName);
-			} else if (nEntryFileMode == FileMode::READ) {
-				pEntryFile = FileSystem::OpenReadFile(nEntryFileName);
-			} else if (nEntryFileMode == FileMode::WRITE) {
-				pEntryFile = FileSystem::OpenWriteFile(nEntryFileName);
-			} else {
-				pEntryFile = FileSystem::OpenFile(nEntryFileName);
-			}
-		}
+	return nPos;
+}
 
-		return pEntryFile;
+// Returns the size of the header or 0 if nAvailable bytes aren't enouth to contain it / it's invalid.
+static inline std::size_t ReadRecordHeader(unsigned short nRecordFormat, const char* pData, std::size_t nAvailable, RecordHeader& pRecord)
+{
+	std::size_t nPos = 0;
+	if (nRecordFormat == RECORD_FORMAT_3 || nRecordFormat == RECORD_FORMAT_4)
+	{
+		unsigned long long nSize;
+		if (!ReadVarint(pData, nAvailable, 5, nPos, nSize) || nSize > UINT_MAX)
+			return 0;
+
+		pRecord.nSize = (EntrySize)nSize;
+	} else {
+		LegacyEntrySize nSize;
+		if (nAvailable < sizeof(nSize))
+			return 0;
+
+		std::memcpy(&nSize, pData, sizeof(nSize));
+		pRecord.nSize = nSize;
+		nPos = sizeof(nSize);
 	}
 
-	void AddEntry(const std::string& pEntryData)
+	pRecord.nChecksum = 0;
+	if (HasRecordChecksum(nRecordFormat))
 	{
-		// We need to do a full lock since currently we do not support multiple threads writing to the same log entry.
-		std::lock_guard<std::mutex> lock(pMutex);
+		if (nAvailable - nPos < sizeof(pRecord.nChecksum))
+			return 0;
 
-		MarkTouched();
+		std::memcpy(&pRecord.nChecksum, pData + nPos, sizeof(pRecord.nChecksum));
+		nPos += sizeof(pRecord.nChecksum);
+	}
+	pRecord.nChecksumStart = nPos;
 
-		if (pIndex.nEntries >= ENTRIES_TRIGGER_DELETION) // Well... Now we got a problem.
-		{
-			DoEntryDeletionCycle();
-		}
+	pRecord.nTimestamp = 0;
+	if (nRecordFormat == RECORD_FORMAT_4 && !ReadVarint(pData, nAvailable, MAX_VARINT_SIZE, nPos, pRecord.nTimestamp))
+		return 0;
 
-		int nLogIndex = pIndex.nEntries; // Will always be 1 above the last since Array's start at 0... (I messed this up already once...)
-		if (nLogIndex >= ENTRIES_TRIGGER_DELETION)
-			nLogIndex = ENTRIES_TRIGGER_DELETION-1; // Should never happen but it threw me a warning anyways!
-	
-		FileHandle_t& pFile = OpenDataFile(FileMode::APPEND);
-		if (!pFile.is_open())
-			return;
+	return nPos;
+}
+
+// pRecordData is the start of the record, its data has to directly follow the header.
+static inline bool IsRecordChecksumValid(unsigned short nRecordFormat, const char* pRecordData, std::size_t nHeaderSize, const RecordHeader& pRecord)
+{
+	if (!HasRecordChecksum(nRecordFormat))
+		return true;
 
-		pFile.seekp(pIndex.nTotalSize); // We do this before we set the nSize since else it would also include the file were actively writing!
+	return Checksum::CRC32C(pRecordData + pRecord.nChecksumStart, nHeaderSize - pRecord.nChecksumStart + pRecord.nSize) == pRecord.nChecksum;
+}
 
-		EntrySize nSize = std::min(USHRT_MAX, (int)pEntryData.length()); // Limit to USHRT_MAX
-		++pIndex.nEntries;
-		pIndex.nTotalSize += nSize;
-		pIndex.nTotalSize += sizeof(nSize);
+// Always writes RECORD_FORMAT_LATEST, pBuffer needs atleast MAX_RECORD_HEADER_SIZE bytes. Returns the size of the header.
+// bInvalidChecksum is used when rewriting a corrupted record so that it stays detectable.
+static inline std::size_t WriteRecordHeader(char* pBuffer, EntrySize nSize, EntryTimestamp nTimestamp, const char* pData, bool bInvalidChecksum = false)
+{
+	std::size_t nPos = WriteVarint(pBuffer, nSize);
+	std::size_t nChecksumPos = nPos;
+	nPos += sizeof(unsigned int);
+	nPos += WriteVarint(pBuffer + nPos, nTimestamp);
+
+	unsigned int nChecksum = Checksum::CRC32C(pBuffer + nChecksumPos + sizeof(unsigned int), nPos - nChecksumPos - sizeof(unsigned int));
+	nChecksum = Checksum::CRC32C(pData, nSize, nChecksum);
+	if (bInvalidChecksum)
+		nChecksum = ~nChecksum;
+
+	std::memcpy(pBuffer + nChecksumPos, &nChecksum, sizeof(nChecksum));
+	return nPos;
+}
 
-		pFile.write((char*)&nSize, sizeof(nSize));
-		pFile.write(pEntryData.c_str(), nSize);
+static inline EntryTimestamp GetCurrentTimestamp()
+{
+	return (EntryTimestamp)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
 
-		printf("Wrote a new Log Entry into \"%s\" (Size: %i)\n", pIndex.nIndexName, nSize);
+/*
+	When a segment is sealed, its records are grouped into blocks of atleast COMPRESSION_BLOCK_SIZE bytes which are compressed one by one.
+	A record never spans two blocks, so a single record can be read by only decompressing the block that contains it.
+	Layout: [SegmentHeader][CompressedSegmentHeader][CompressedBlock * nBlocks][Block data...]
+	The records keep their original format (SegmentHeader::nBlockRecordFormat) including their checksums.
+
+	Offsets (the ".idx" sidecar) still point into the uncompressed segment, which is why every block knows its uncompressed offset.
+	Disabled with -nocompression, in which case sealed segments simply stay in RECORD_FORMAT_1.
+*/
+static constexpr std::size_t COMPRESSION_BLOCK_SIZE = 1 << 16;
+static bool g_bCompression = true;
+static bool g_bVerifyOnLoad = false; // -verifyonload, checks every index with Log::VerifySegments when it's loaded.
+static bool g_bTrigramIndex = true; // -notrigrams, searches then only skip what the Bloom filters of sealed segments rule out.
+
+struct CompressedSegmentHeader
+{
+	unsigned int nSegmentSize = 0; // Size of the uncompressed segment including its SegmentHeader.
+	unsigned int nBlocks = 0;
+};
 
-		pFile.flush();
-	}
+struct CompressedBlock
+{
+	unsigned int nOffset = 0; // Offset of the first record inside the uncompressed segment.
+	unsigned int nSize = 0; // Uncompressed size.
+	unsigned int nCompressedSize = 0; // If it's equal to nSize the block is stored uncompressed since compressing it didn't help.
+	unsigned int nFileOffset = 0;
+};
 
-	bool ShouldUnload(std::chrono::system_clock::time_point pTimePoint)
-	{
-		return std::chrono::duration<double>(pTimePoint - nLastTouched).count() > MAX_INDEX_LOADED_TIME;
-	}
+// Since startup, exposed through LogSystem::GetCompressionStats
+static std::atomic<unsigned long long> g_nCompressionInputBytes = 0;
+static std::atomic<unsigned long long> g_nCompressionOutputBytes = 0;
+static std::atomic<unsigned long long> g_nDecompressedBytes = 0;
+static std::atomic<unsigned long long> g_nDecompressionTime = 0; // in nanoseconds
+
+// Every 3 consecutive bytes of an entry are a trigram, packed into the lower 24 bits.
+// A search only has to read the entries that contain every trigram of what it's looking for.
+typedef unsigned short TrigramPosting; // An entry inside its segment, so nSegmentEntries can't exceed 65536.
+typedef std::unordered_map<unsigned int, std::vector<TrigramPosting>> TrigramPostings; // Postings are always sorted since entries are added in order.
+static constexpr unsigned int MAX_TRIGRAM_SEGMENT_ENTRIES = 1 << 16;
+
+// The ".tri" sidecar: [TrigramIndexHeader][TrigramList * nTrigrams, sorted by nTrigram][TrigramPosting * nPostings]
+static constexpr unsigned int TRIGRAM_MAGIC = 0x49525448; // "HTRI"
+struct TrigramIndexHeader
+{
+	unsigned int nMagic = TRIGRAM_MAGIC;
+	unsigned int nTrigrams = 0;
+	unsigned int nPostings = 0;
+};
 
-	void SetIndexName(const std::string& pKeyName)
-	{
-		pIndex.SetIndexName(pKeyName);
-		pIndexHash = std::hash<std::string>{}(pKeyName);
-	}
+struct TrigramList
+{
+	unsigned int nTrigram = 0;
+	unsigned int nFirstPosting = 0;
+	unsigned int nPostings = 0;
+};
 
-	void SetIndexHash(const std::size_t pHash)
+/*
+	Everything that reads a whole sealed segment is done by a single compactor thread instead of whoever wrote the entry that filled it.
+	Sealed segments get their trigram index & Bloom filters & are compressed there, the compressed segment replaces the old one with a rename
+	so readers either see the old or the new file. Deleted segments are only unlinked there, the Log just moves its nFirstSegment.
+	Jobs run in the order they were queued, so a segment is never unlinked before its compaction is done.
+*/
+struct Log;
+struct CompactionJob
+{
+	Log* pLog = nullptr; // The Log isn't unloaded while it has queued jobs, see Log::nPendingCompactions
+	unsigned int nSegment = 0;
+	unsigned int nSegmentSize = 0;
+	bool bVerify = false; // Runs Log::VerifySegments instead, see Log::QueueVerify.
+	bool bHasTrigrams = false; // pTrigrams holds the posting lists the segment had in memory when it was sealed, otherwise they're read from it.
+	TrigramPostings pTrigrams;
+	std::vector<std::string> pRemoveFiles;
+};
+
+static std::mutex g_pCompactionMutex;
+static std::condition_variable g_pCompactionCondition;
+static std::deque<CompactionJob> g_pCompactionQueue;
+static void QueueCompaction(CompactionJob&& pJob)
+{
 	{
-		pIndexHash = pHash;
+		std::lock_guard<std::mutex> lock(g_pCompactionMutex);
+		g_pCompactionQueue.push_back(std::move(pJob));
 	}
 
-private:
-	// This is VERY expensive!!!
-	// Why is it expensive?
-	// We restructure the entire LogIndex shifitng all entires and we write the entire data file again to remove old entires and update all offsets.
-	void DoEntryDeletionCycle()
-	{
-		if (pIndex.nEntries <= ENTRIES_DELETION_CYCLE)
-			return; // Not enouth entries!
+	g_pCompactionCondition.notify_one();
+}
 
-		FileHandle_t& pFile = OpenDataFile(FileMode::READWRITE);
-		if (!pFile.is_open())
-			return; // Failed to open? Ok...
+// Fills pTrigrams with the distinct trigrams of pData.
+static inline void CollectTrigrams(const char* pData, std::size_t nSize, std::vector<unsigned int>& pTrigrams)
+{
+	pTrigrams.clear();
+	if (nSize < 3)
+		return;
 
-		pFile.seekg(0);
-		int nCurrentOffset = 0; // Total size of data that we will remove from the head of the file.
-		for (int i=0; i<ENTRIES_DELETION_CYCLE; ++i)
-		{
-			EntrySize nSize;
-			pFile.read((char*)&nSize, sizeof(nSize));
-			nCurrentOffset += nSize; // Skipping these.
-			nCurrentOffset += sizeof(nSize);
-		}
+	pTrigrams.reserve(nSize - 2);
+	unsigned int nTrigram = ((unsigned char)pData[0] << 8) | (unsigned char)pData[1];
+	for (std::size_t i=2; i<nSize; ++i)
+	{
+		nTrigram = ((nTrigram << 8) | (unsigned char)pData[i]) & 0xFFFFFF;
+		pTrigrams.push_back(nTrigram);
+	}
 
-		char pBuffer[USHRT_MAX]; // 64kb buffer to use while were swapping things around.
-		int i = ENTRIES_DELETION_CYCLE; // Skip these first as the lower their index the older they are.
-		int nNewOffset = 0; // Offset for the moved data
-		for (; i<pIndex.nEntries; ++i)
-		{
-			int nNewIndex = i - ENTRIES_DELETION_CYCLE;
+	std::sort(pTrigrams.begin(), pTrigrams.end());
+	pTrigrams.erase(std::unique(pTrigrams.begin(), pTrigrams.end()), pTrigrams.end());
+}
 
-			pFile.seekg(nCurrentOffset);
+/*
+	Every sealed segment also gets Bloom filters of its tokens, one for every BLOOM_RANGE_SIZE bytes of records.
+	A scan for something that contains whole tokens can skip every range whose filter lacks one of them.
+	They're a fraction of the size of the trigram index, so indexes that are rarely searched can run with -notrigrams.
+	Layout: [BloomIndexHeader][BloomRange * nRanges][Filter bits...]
+*/
+static constexpr std::size_t BLOOM_RANGE_SIZE = 1 << 16;
+static constexpr unsigned int BLOOM_BITS_PER_TOKEN = 10; // ~1% false positives with BLOOM_HASHES
+static constexpr unsigned int BLOOM_HASHES = 7;
+static constexpr unsigned int BLOOM_MAGIC = 0x4D4C4248; // "HBLM"
+struct BloomIndexHeader
+{
+	unsigned int nMagic = BLOOM_MAGIC;
+	unsigned int nRanges = 0;
+};
 
-			EntrySize nSize;
-			pFile.read((char*)&nSize, sizeof(nSize));
-			pFile.read(pBuffer, nSize); // We don't need to check bounds since each entry has a size limit of USHRT_MAX
+struct BloomRange
+{
+	EntryOffset nStart = 0; // Offsets inside the uncompressed segment.
+	EntryOffset nEnd = 0;
+	unsigned int nFirstByte = 0; // Where its filter starts behind the ranges.
+	unsigned int nBytes = 0;
+};
 
-			pFile.seekp(nNewOffset);
-			pFile.write((char*)&nSize, sizeof(nSize));
-			pFile.write(pBuffer, nSize);
+static inline bool IsTokenByte(unsigned char nByte)
+{
+	return (nByte >= '0' && nByte <= '9') || (nByte >= 'a' && nByte <= 'z') || (nByte >= 'A' && nByte <= 'Z') || nByte == '_' || nByte >= 0x80;
+}
 
-			// Now update our offsets
-			nSize += sizeof(nSize); // increment by this since we also write it into the file.
-			nCurrentOffset += nSize;
-			nNewOffset += nSize;
-		}
+// FNV-1a, this can never change since the filters are stored on disk.
+static inline unsigned long long HashToken(const char* pData, std::size_t nSize)
+{
+	unsigned long long nHash = 14695981039346656037ULL;
+	for (std::size_t i=0; i<nSize; ++i)
+	{
+		nHash ^= (unsigned char)pData[i];
+		nHash *= 1099511628211ULL;
+	}
 
-		pIndex.nEntries -= ENTRIES_DELETION_CYCLE;
+	return nHash;
+}
 
-		pIndex.nTotalSize = nNewOffset;
+// Appends the hash of every token in pData.
+// If bCompleteOnly is set, tokens touching the start or end are skipped since in a record they could be part of a longer token.
+static inline void CollectTokenHashes(const char* pData, std::size_t nSize, bool bCompleteOnly, std::vector<unsigned long long>& pHashes)
+{
+	std::size_t nStart = 0;
+	for (std::size_t i=0; i<=nSize; ++i)
+	{
+		if (i < nSize && IsTokenByte(pData[i]))
+			continue;
 
-		// We need to close since else FileSystem::TurnaceFile will corrupt the handle and cause a crash
-		// UPDATE: I had a crash INSIDE TurnaceFile and not because of this being flush... flush should be fine, right?
-		pFile.flush();
+		if (i > nStart && (!bCompleteOnly || (nStart > 0 && i < nSize)))
+			pHashes.push_back(HashToken(pData + nStart, i - nStart));
 
-		// Yeah, duplicate code... anyways, it helps memory usage.
-		char nEntryFileName[FileSystem::MAX_PATH];
-		std::memcpy(nEntryFileName, pLogDataDir, pLogDataDirLength);
-		int nWritten = Util::WriteUniqueFilenameIntoBuffer(pIndex.nFileName, nEntryFileName + pLogDataDirLength, sizeof(nEntryFileName) - pLogDataDirLength);
-		std::memcpy(nEntryFileName + pLogDataDirLength + nWritten, pLogExtension, pLogExtensionLength);
-		nEntryFileName[pLogDataDirLength + nWritten + pLogExtensionLength] = '\0';
+		nStart = i + 1;
+	}
+}
 
-		FileSystem::TurnaceFile(nEntryFileName, nNewOffset);
+static inline void AddToBloom(unsigned char* pBits, std::size_t nBits, unsigned long long nHash)
+{
+	unsigned int nHashA = (unsigned int)nHash;
+	unsigned int nHashB = (unsigned int)(nHash >> 32) | 1;
+	for (unsigned int i=0; i<BLOOM_HASHES; ++i)
+	{
+		std::size_t nBit = (nHashA + i * nHashB) % nBits;
+		pBits[nBit >> 3] |= (unsigned char)(1 << (nBit & 7));
 	}
+}
 
-	// We got touched >:3
-	void MarkTouched()
+static inline bool BloomContains(const unsigned char* pBits, std::size_t nBits, unsigned long long nHash)
+{
+	unsigned int nHashA = (unsigned int)nHash;
+	unsigned int nHashB = (unsigned int)(nHash >> 32) | 1;
+	for (unsigned int i=0; i<BLOOM_HASHES; ++i)
 	{
-		nLastTouched = std::chrono::system_clock::now();
+		std::size_t nBit = (nHashA + i * nHashB) % nBits;
+		if (!(pBits[nBit >> 3] & (1 << (nBit & 7))))
+			return false;
 	}
 
-public:
-	LogIndex pIndex;
-	std::mutex pMutex; // Used to lock this LogIndex while we write/read from it as we cannot guarantee safetry in our setup in any different way.
-	std::size_t pIndexHash = 0;
+	return true;
+}
 
-private:
-	// We don't close the files instantly to heavily improve performance.
-	FileHandle_t pEntryFile;
-	FileMode nEntryFileMode = FileMode::NONE; // -1 = Read, 0 = None, 1 = Write
+// Walks the records of a single segment sequentially.
+// The committed range of the segment is memory mapped so records are read straight out of the page cache,
+// only if mapping fails we fall back to reading it in large chunks.
+// Compressed segments are decompressed one block at a time.
+class SegmentReader
+{
+public:
+	static constexpr std::size_t BUFFER_SIZE = 1 << 18; // Grows if a single record doesn't fit.
 
-	// Last time we touched this Log entry.
-	std::chrono::system_clock::time_point nLastTouched;
-};
+	enum RecordResult
+	{
+		RECORD_OK = 0,
+		RECORD_END = 1, // No more records, or the last one was torn.
+		RECORD_CORRUPTED = 2, // The checksum doesn't match, the reader is already positioned at the next record.
+	};
 
-static std::vector<std::unique_ptr<Log>> g_pLogIndexes = {};
-static std::shared_mutex g_LogIndexesMutex;
-static void UnloadAnyNonTouchedIndexes()
-{
-	while (true)
+	~SegmentReader()
 	{
-		std::this_thread::sleep_for(std::chrono::milliseconds(INDEX_LOADED_CHECK_INTERVALS));
+		Close();
+	}
 
-		bool bHasIndexesToDelete = false;
+	// If bOwnsFile is false, the descriptor is borrowed (the active segment shares the descriptor of its Log) and won't be closed by us.
+	// nEndOffset is where the committed data of the segment ends.
+	bool Open(FileDescriptor_t pNewFile, bool bNewOwnsFile, unsigned long long nNewEndOffset)
+	{
+		Close();
+
+		pFile = pNewFile;
+		bOwnsFile = bNewOwnsFile;
+		nEndOffset = nNewEndOffset;
+		nBufferOffset = 0;
+		nBufferPos = 0;
+		nBufferSize = 0;
+		bCompressed = false;
+		nNextBlock = 0;
+		nCorruptedRecords = 0;
+
+		if (FileSystem::MapDescriptor(pFile, (std::size_t)nEndOffset, pView))
 		{
-			std::shared_lock<std::shared_mutex> readLock(g_LogIndexesMutex);
-			auto pCurrentTime = std::chrono::system_clock::now();
-			for (auto& pLog : g_pLogIndexes)
+			pData = pView.pData;
+			nBufferSize = pView.nSize;
+		} else {
+			if (!pBuffer)
 			{
-				if (!pLog.get()->ShouldUnload(pCurrentTime))
-					continue;
-
-				bHasIndexesToDelete = true;
-				break;
+				pBuffer = std::make_unique<char[]>(BUFFER_SIZE);
+				nBufferCapacity = BUFFER_SIZE;
 			}
+
+			pData = pBuffer.get();
 		}
 
-		if (!bHasIndexesToDelete)
-			continue;
+		if (!Fill(sizeof(SegmentHeader)))
+			return false;
 
+		std::memcpy(&pHeader, pData, sizeof(pHeader));
+		nBufferPos = sizeof(pHeader);
 
-		std::vector<Log*> pLogsToDelete;
+		if (pHeader.nMagic != SEGMENT_MAGIC)
+			return false;
+
+		nRecordFormat = pHeader.nRecordFormat;
+		if (pHeader.nRecordFormat == RECORD_FORMAT_COMPRESSED)
 		{
-			std::unique_lock<std::shared_mutex> writeLock(g_LogIndexesMutex);
-			auto pCurrentTime = std::chrono::system_clock::now();
-			for (auto it = g_pLogIndexes.begin(); it != g_pLogIndexes.end(); )
-			{
-				if (!it->get()->ShouldUnload(pCurrentTime))
-				{
-					it++;
-					continue;
-				}
+			nRecordFormat = pHeader.nBlockRecordFormat == 0 ? RECORD_FORMAT_1 : pHeader.nBlockRecordFormat;
+			return IsRecordFormatValid(nRecordFormat) && OpenCompressed();
+		}
 
-				// Deleting the logs in here would block everything!
-				// So we move it outside of our lock to unblock g_LogIndexesMutex
-				pLogsToDelete.push_back(it->get());
-				it->release();
+		return IsRecordFormatValid(nRecordFormat);
+	}
 
-				it = g_pLogIndexes.erase(it);
-			}
+	// pEntryData stays valid until the next call.
+	RecordResult ReadNext(const char*& pEntryData, EntrySize& nSize)
+	{
+		if (!Fill(1))
+			return RECORD_END;
+
+		RecordHeader pRecord;
+		std::size_t nHeaderSize;
+		while ((nHeaderSize = ReadRecordHeader(nRecordFormat, pData + nBufferPos, nBufferSize - nBufferPos, pRecord)) == 0)
+		{
+			std::size_t nAvailable = nBufferSize - nBufferPos;
+			if (nAvailable >= MAX_RECORD_HEADER_SIZE || !Fill(nAvailable + 1))
+				return RECORD_END;
 		}
 
-		for (Log* pLog : pLogsToDelete)
-			delete pLog;
+		if (!Fill(nHeaderSize + pRecord.nSize))
+			return RECORD_END;
+
+		const char* pRecordData = pData + nBufferPos;
+		nSize = pRecord.nSize;
+		nTimestamp = pRecord.nTimestamp;
+		pEntryData = pRecordData + nHeaderSize;
+		nBufferPos += nHeaderSize + nSize;
 
+		if (!IsRecordChecksumValid(nRecordFormat, pRecordData, nHeaderSize, pRecord))
 		{
-			std::unique_lock<std::shared_mutex> writeLock(g_LogIndexesMutex);
-			extern void CheckLogState();
-			CheckLogState();
+			++nCorruptedRecords;
+			return RECORD_CORRUPTED;
 		}
+
+		return RECORD_OK;
 	}
-}
 
-static std::thread g_pLoggingIndexesThread(UnloadAnyNonTouchedIndexes);
-void LogSystem::Init()
-{
-	FileSystem::CreateDirectory("logdata/data");
-	FileSystem::CreateDirectory("logdata/indexes");
+	// Same as ReadNext though it skips any corrupted records.
+	bool Next(const char*& pEntryData, EntrySize& nSize)
+	{
+		RecordResult nResult;
+		do {
+			nResult = ReadNext(pEntryData, nSize);
+		} while (nResult == RECORD_CORRUPTED);
 
-	Util::SetThreadName(g_pLoggingIndexesThread, "UnloadAnyNonTouchedIndexes");
-}
+		return nResult == RECORD_OK;
+	}
 
-#ifdef LOGSYSTEM_MULTIPLE_KEYS
-static Log* FindOrCreateLogIndex(const std::unordered_map<std::string, std::string>& entryKeys)
+	// Positions the reader so that Next returns the record at nOffset.
+	bool Seek(EntryOffset nOffset)
+	{
+		if (bCompressed)
+			return SeekCompressed(nOffset);
+
+		if (nOffset < sizeof(SegmentHeader) || nOffset > nEndOffset)
+			return false;
+
+		if (pView.pData)
+		{
+			nBufferPos = nOffset;
+		} else {
+			nBufferOffset = nOffset;
+			nBufferPos = 0;
+			nBufferSize = 0;
+		}
+
+		return true;
+	}
+
+	// Only for compressed segments. Decompresses the block containing the record at nOffset (an offset inside the uncompressed segment)
+	// after which Next returns that record.
+	bool SeekCompressed(EntryOffset nOffset)
+	{
+		auto it = std::upper_bound(pBlocks.begin(), pBlocks.end(), nOffset, [](EntryOffset nValue, const CompressedBlock& pBlock) {
+			return nValue < pBlock.nOffset;
+		});
+
+		if (it == pBlocks.begin())
+			return false;
+
+		unsigned int nBlock = (unsigned int)(it - pBlocks.begin()) - 1;
+		if (nOffset - pBlocks[nBlock].nOffset >= pBlocks[nBlock].nSize)
+			return false;
+
+		bool bLoaded = nNextBlock == nBlock + 1 && nBufferOffset == pBlocks[nBlock].nOffset && nBufferSize == pBlocks[nBlock].nSize;
+		if (!bLoaded && !LoadBlock(nBlock))
+			return false;
+
+		nBufferPos = nOffset - pBlocks[nBlock].nOffset;
+		return true;
+	}
+
+	void Close()
+	{
+		FileSystem::UnmapView(pView);
+
+		if (bOwnsFile && pFile != FileSystem::INVALID_DESCRIPTOR)
+			FileSystem::CloseDescriptor(pFile);
+
+		pFile = FileSystem::INVALID_DESCRIPTOR;
+		bOwnsFile = false;
+	}
+
+	const SegmentHeader& GetHeader() const { return pHeader; }
+	bool IsCompressed() const { return bCompressed; }
+	// Number of records with a mismatching checksum that we found since Open.
+	unsigned int GetCorruptedRecords() const { return nCorruptedRecords; }
+	unsigned long long GetEndOffset() const { return nEndOffset; }
+	// Timestamp of the record that was returned last.
+	EntryTimestamp GetTimestamp() const { return nTimestamp; }
+	// Offset of the next record, for compressed segments it's the offset inside the uncompressed segment.
+	unsigned long long GetOffset() const { return nBufferOffset + nBufferPos; }
+
+private:
+	// Ensures that atleast nNeeded bytes are available at nBufferPos.
+	bool Fill(std::size_t nNeeded)
+	{
+		if (nBufferSize - nBufferPos >= nNeeded)
+			return true;
+
+		if (bCompressed)
+		{
+			if (nBufferPos != nBufferSize)
+				return false; // Records never span blocks so the block is corrupted.
+
+			return LoadBlock(nNextBlock) && nBufferSize >= nNeeded;
+		}
+
+		if (pView.pData)
+			return false; // Everything is already mapped, so we reached the end.
+
+		// Move the remaining bytes to the front & read the next chunk behind them.
+		std::size_t nRemaining = nBufferSize - nBufferPos;
+		if (nNeeded > nBufferCapacity)
+		{
+			std::unique_ptr<char[]> pNewBuffer = std::make_unique<char[]>(nNeeded);
+			std::memcpy(pNewBuffer.get(), pBuffer.get() + nBufferPos, nRemaining);
+			pBuffer = std::move(pNewBuffer);
+			pData = pBuffer.get();
+			nBufferCapacity = nNeeded;
+		} else {
+			std::memmove(pBuffer.get(), pBuffer.get() + nBufferPos, nRemaining);
+		}
+		nBufferOffset += nBufferPos;
+		nBufferPos = 0;
+		nBufferSize = nRemaining;
+
+		while (nBufferSize < nNeeded)
+		{
+			unsigned long long nReadOffset = nBufferOffset + nBufferSize;
+			if (nReadOffset >= nEndOffset)
+				return false;
+
+			std::size_t nToRead = (std::size_t)std::min<unsigned long long>(nBufferCapacity - nBufferSize, nEndOffset - nReadOffset);
+			long long nRead = FileSystem::ReadAt(pFile, pBuffer.get() + nBufferSize, nToRead, nReadOffset);
+			if (nRead <= 0)
+				return false;
+
+			nBufferSize += nRead;
+		}
+
+		return true;
+	}
+
+	// Reads raw bytes of the file, either out of our mapping or with a positional read.
+	bool ReadRaw(void* pDest, std::size_t nSize, unsigned long long nOffset)
+	{
+		if (nOffset + nSize > nEndOffset)
+			return false;
+
+		if (pView.pData)
+		{
+			std::memcpy(pDest, pView.pData + nOffset, nSize);
+			return true;
+		}
+
+		return FileSystem::ReadAt(pFile, pDest, nSize, nOffset) == (long long)nSize;
+	}
+
+	bool OpenCompressed()
+	{
+		bCompressed = true;
+
+		CompressedSegmentHeader pSegmentHeader;
+		if (!ReadRaw(&pSegmentHeader, sizeof(pSegmentHeader), sizeof(SegmentHeader)))
+			return false;
+
+		// A corrupted header must not make us allocate more than the file could ever contain.
+		if (sizeof(SegmentHeader) + sizeof(CompressedSegmentHeader) + (unsigned long long)pSegmentHeader.nBlocks * sizeof(CompressedBlock) > nEndOffset)
+			return false;
+
+		pBlocks.resize(pSegmentHeader.nBlocks);
+		if (!ReadRaw(pBlocks.data(), pBlocks.size() * sizeof(CompressedBlock), sizeof(SegmentHeader) + sizeof(CompressedSegmentHeader)))
+			return false;
+
+		std::size_t nLargestBlock = 0;
+		for (const CompressedBlock& pBlock : pBlocks)
+		{
+			if (pBlock.nSize > pSegmentHeader.nSegmentSize || pBlock.nCompressedSize > nEndOffset)
+				return false;
+
+			nLargestBlock = std::max<std::size_t>(nLargestBlock, std::max(pBlock.nSize, pBlock.nCompressedSize));
+		}
+
+		if (nBlockBufferSize < nLargestBlock)
+		{
+			pBlockBuffer = std::make_unique<char[]>(nLargestBlock);
+			pCompressedBuffer.reset(); // Only needed if we aren't mapped, so it's allocated lazily.
+			nBlockBufferSize = nLargestBlock;
+		}
+
+		pData = pBlockBuffer.get();
+		nBufferOffset = sizeof(SegmentHeader);
+		nBufferPos = 0;
+		nBufferSize = 0;
+		return true;
+	}
+
+	bool LoadBlock(unsigned int nBlock)
+	{
+		if (nBlock >= pBlocks.size())
+			return false;
+
+		const CompressedBlock& pBlock = pBlocks[nBlock];
+		if ((unsigned long long)pBlock.nFileOffset + pBlock.nCompressedSize > nEndOffset)
+			return false;
+
+		const char* pSource = nullptr;
+		if (pView.pData)
+		{
+			pSource = pView.pData + pBlock.nFileOffset;
+		} else {
+			if (!pCompressedBuffer)
+				pCompressedBuffer = std::make_unique<char[]>(nBlockBufferSize);
+
+			if (!ReadRaw(pCompressedBuffer.get(), pBlock.nCompressedSize, pBlock.nFileOffset))
+				return false;
+
+			pSource = pCompressedBuffer.get();
+		}
+
+		if (pBlock.nCompressedSize == pBlock.nSize)
+		{
+			std::memcpy(pBlockBuffer.get(), pSource, pBlock.nSize);
+		} else {
+			auto pStart = std::chrono::steady_clock::now();
+			if (!Compression::Decompress(pSource, pBlock.nCompressedSize, pBlockBuffer.get(), pBlock.nSize))
+			{
+				printf("Failed to decompress block %u of a segment!\n", nBlock);
+				return false;
+			}
+
+			g_nDecompressionTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - pStart).count();
+			g_nDecompressedBytes += pBlock.nSize;
+		}
+
+		nNextBlock = nBlock + 1;
+		nBufferOffset = pBlock.nOffset;
+		nBufferPos = 0;
+		nBufferSize = pBlock.nSize;
+		return true;
+	}
+
+	FileDescriptor_t pFile = FileSystem::INVALID_DESCRIPTOR;
+	bool bOwnsFile = false;
+	unsigned long long nEndOffset = 0;
+	SegmentHeader pHeader;
+	unsigned short nRecordFormat = RECORD_FORMAT_1; // For compressed segments, it's the format of the records inside the blocks.
+	unsigned int nCorruptedRecords = 0;
+	EntryTimestamp nTimestamp = 0;
+
+	MappedView pView;
+	std::unique_ptr<char[]> pBuffer; // Only used if we failed to map the segment.
+	std::size_t nBufferCapacity = 0;
+	const char* pData = nullptr; // Either the mapped segment, pBuffer or pBlockBuffer
+	unsigned long long nBufferOffset = 0; // File offset of pData[0], for compressed segments its offset inside the uncompressed segment.
+	std::size_t nBufferPos = 0;
+	std::size_t nBufferSize = 0;
+
+	// Compressed segments
+	bool bCompressed = false;
+	std::vector<CompressedBlock> pBlocks;
+	unsigned int nNextBlock = 0;
+	std::unique_ptr<char[]> pBlockBuffer; // The currently decompressed block.
+	std::unique_ptr<char[]> pCompressedBuffer; // Only used if we failed to map the segment.
+	std::size_t nBlockBufferSize = 0;
+};
+
+// Result of Log::VerifySegments
+struct VerifyResult
 {
+	unsigned int nSegments = 0;
+	unsigned int nRecords = 0; // Records that were found, including corrupted ones.
+	unsigned int nCorruptedRecords = 0;
+	unsigned int nMissingRecords = 0; // Records the index expects but that are torn or missing.
+	unsigned long long nBytes = 0;
+	double nSeconds = 0;
+};
+
+struct Log // This stuct will be in memory, and only the LogIndex is written to disk.
+{
+public:
+	Log()
 	{
-		std::shared_lock<std::shared_mutex> readLock(g_LogIndexesMutex);
-		for (Log& pLog : g_pLogIndexes)
+		MarkTouched();
+	}
+
+	~Log()
+	{
+		CloseActiveSegment();
+		if (std::memcmp(&pSavedIndex, (LogIndex_V4*)&pIndex, sizeof(LogIndex_V4)) != 0)
+			SaveIndex();
+	}
+
+	// Call this once pIndex was loaded from disk, we then only write it back if it changed.
+	void MarkIndexSaved()
+	{
+		std::memcpy(&pSavedIndex, (LogIndex_V4*)&pIndex, sizeof(LogIndex_V4));
+	}
+
+	// Writes "logdata/indexes/<id><extension>" into the given buffer.
+	void BuildIndexFileName(char* pBuffer, int nBufferSize, const char* pExtension = pLogExtension)
+	{
+		std::memcpy(pBuffer, pLogIndexesDir, pLogIndexesDirLength);
+		int nWritten = pLogIndexesDirLength + Util::WriteUniqueFilenameIntoBuffer(pIndex.nFileName, pBuffer + pLogIndexesDirLength, nBufferSize - pLogIndexesDirLength);
+		snprintf(pBuffer + nWritten, nBufferSize - nWritten, "%s", pExtension);
+	}
+
+	// Writes the LogIndex into a temp file & then switches it with the current one so a crash never leaves a half written index behind.
+	bool SaveIndex()
+	{
+		char nIndexFileName[FileSystem::MAX_PATH];
+		BuildIndexFileName(nIndexFileName, sizeof(nIndexFileName));
+
+		char nTempFileName[FileSystem::MAX_PATH];
+		BuildIndexFileName(nTempFileName, sizeof(nTempFileName), pLogIndexTempExtension);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nTempFileName, true, true);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
 		{
-			LogIndex& pIndex = pLog.pIndex;
-			if (pIndex.nKeys == 0)
-				continue; // Useless.
+			printf("Failed to save index \"%s\"\n", pIndex.nIndexName);
+			return false;
+		}
 
-			if (pIndex.nKeys != entryKeys.size())
-				continue; // Different entryKeys!
+		bool bWritten = FileSystem::WriteAt(pFile, (LogIndex_V4*)&pIndex, sizeof(LogIndex_V4), 0) && FileSystem::SyncDescriptor(pFile);
+		FileSystem::CloseDescriptor(pFile);
+		if (!bWritten || !FileSystem::RenameFile(nTempFileName, nIndexFileName))
+		{
+			printf("Failed to save index \"%s\"\n", pIndex.nIndexName);
+			FileSystem::RemoveFile(nTempFileName);
+			return false;
+		}
 
-			bool bMatches = true; // All the keys have to match!
-			for (int nKey = 0; nKey < pIndex.nKeys; ++nKey)
+		MarkIndexSaved();
+		return FileSystem::SyncDirectory(pLogIndexesDir);
+	}
+
+	// Writes "logdata/data/<id>" into the given buffer.
+	int BuildDataDirectoryName(char* pBuffer, int nBufferSize)
+	{
+		std::memcpy(pBuffer, pLogDataDir, pLogDataDirLength);
+		return pLogDataDirLength + Util::WriteUniqueFilenameIntoBuffer(pIndex.nFileName, pBuffer + pLogDataDirLength, nBufferSize - pLogDataDirLength);
+	}
+
+	// Writes "logdata/data/<id>.dat" into the given buffer, the data file of V1/V2 indexes.
+	void BuildLegacyDataFileName(char* pBuffer, int nBufferSize)
+	{
+		int nWritten = BuildDataDirectoryName(pBuffer, nBufferSize - pLogExtensionLength - 1);
+		std::memcpy(pBuffer + nWritten, pLogExtension, pLogExtensionLength);
+		pBuffer[nWritten + pLogExtensionLength] = '\0';
+	}
+
+	// Writes "logdata/data/<id>/<segment><extension>" into the given buffer.
+	int BuildSegmentFileName(char* pBuffer, int nBufferSize, unsigned int nSegment, const char* pExtension = pLogExtension)
+	{
+		int nWritten = BuildDataDirectoryName(pBuffer, nBufferSize);
+		return nWritten + std::snprintf(pBuffer + nWritten, nBufferSize - nWritten, "/%u%s", nSegment, pExtension);
+	}
+
+	// Returns the segment that contains the given entry (0 = oldest entry that is still on disk)
+	unsigned int GetSegmentForEntry(unsigned int nEntry) const
+	{
+		return pIndex.nFirstSegment + (nEntry / pIndex.nSegmentEntries);
+	}
+
+	// Opens a reader for the given segment, the active segment is read through our own descriptor.
+	// pMutex has to be locked!
+	bool OpenSegmentReader(unsigned int nSegment, SegmentReader& pReader)
+	{
+		if (pEntryFile != FileSystem::INVALID_DESCRIPTOR && nSegment == nEntryFileSegment)
+			return pReader.Open(pEntryFile, false, nWrittenSegmentSize);
+
+		char nSegmentFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nSegmentFileName);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return false;
+
+		return pReader.Open(pFile, true, FileSystem::DescriptorSize(pFile));
+	}
+
+	// Opens a new descriptor of the given segment which keeps its current contents readable even if it's compressed or deleted afterwards.
+	// nSize is set to how much of it was written. pMutex has to be locked!
+	FileDescriptor_t OpenSegmentSnapshot(unsigned int nSegment, unsigned long long& nSize)
+	{
+		char nSegmentFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nSegmentFileName);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return pFile;
+
+		if (pEntryFile != FileSystem::INVALID_DESCRIPTOR && nSegment == nEntryFileSegment)
+			nSize = nWrittenSegmentSize;
+		else
+			nSize = FileSystem::DescriptorSize(pFile);
+
+		return pFile;
+	}
+
+	// Opens the segment that the next entry will be written into, creating it if needed.
+	// We keep a single read/write descriptor for it which the readers share as everything uses positional reads/writes.
+	bool OpenActiveSegment()
+	{
+		unsigned int nSegment = GetSegmentForEntry(pIndex.nEntries);
+		if (pEntryFile != FileSystem::INVALID_DESCRIPTOR && nEntryFileSegment == nSegment)
+			return true;
+
+		if (!CloseActiveSegment())
+			return false; // Its queued records were rolled back, CommitBatch has to know.
+
+		char nSegmentFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+		char nOffsetsFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nOffsetsFileName, sizeof(nOffsetsFileName), nSegment, pLogOffsetsExtension);
+
+		char nTimesFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nTimesFileName, sizeof(nTimesFileName), nSegment, pLogTimesExtension);
+
+		nEntryFileSegment = nSegment;
+		if (pIndex.nActiveSegmentSize == 0)
+		{
+			char nDataDirectory[FileSystem::MAX_PATH];
+			BuildDataDirectoryName(nDataDirectory, sizeof(nDataDirectory));
+			FileSystem::CreateDirectory(nDataDirectory);
+
+			// New segment, so we truncate anything that might have been left behind and write our header.
+			pEntryFile = FileSystem::OpenDescriptor(nSegmentFileName, true, true);
+			pOffsetFile = FileSystem::OpenDescriptor(nOffsetsFileName, true, true);
+			pTimeFile = FileSystem::OpenDescriptor(nTimesFileName, true, true);
+
+			char nTrigramsFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nTrigramsFileName, sizeof(nTrigramsFileName), nSegment, pLogTrigramsExtension);
+			FileSystem::RemoveFile(nTrigramsFileName); // Only sealed segments have these.
+
+			char nBloomFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nBloomFileName, sizeof(nBloomFileName), nSegment, pLogBloomExtension);
+			FileSystem::RemoveFile(nBloomFileName);
+
+			SegmentHeader pHeader;
+			if (pEntryFile != FileSystem::INVALID_DESCRIPTOR && FileSystem::WriteAt(pEntryFile, &pHeader, sizeof(pHeader), 0))
+				pIndex.nActiveSegmentSize = sizeof(pHeader);
+
+			// Recovery only finds indexes that have a header on disk, which is otherwise only written once we're unloaded.
+			// For the fdatasync levels the directories are synced too, syncing the segment is useless if its directory entry is lost.
+			bool bSyncDirectories = nDurability == Durability::SYNC_BATCH || nDurability == Durability::SYNC_ENTRY;
+			if (pIndex.nActiveSegmentSize != 0 && (bSyncDirectories || (pIndex.nEntries == 0 && pIndex.version == INDEX_VERSION_LATEST)))
 			{
-				const LogKey& pKey = pIndex.nKeysData[nKey];
-				auto it = entryKeys.find(pKey.nKeyName);
-				if (it == entryKeys.end())
-				{
-					bMatches = false;
-					break; // Key doesn't match. GG
-				}
+				bool bCreated = !bSyncDirectories || FileSystem::SyncDirectory(nDataDirectory);
+				if (bCreated && pIndex.nEntries == 0 && pIndex.version == INDEX_VERSION_LATEST)
+					bCreated = (!bSyncDirectories || FileSystem::SyncDirectory(pLogDataDir)) && SaveIndex();
 
-				if (it->second != pKey.nKeyValue)
+				if (!bCreated)
 				{
-					bMatches = false;
-					break; // Value doesn't match. Another GG
+					printf("Failed to create the new segment %u of \"%s\"!\n", nSegment, pIndex.nIndexName);
+					pIndex.nActiveSegmentSize = 0; // Try creating it again with the next write.
 				}
 			}
 
-			if (bMatches)
-				return pLog;
+			nWrittenOffsetsSize = 0;
+			nWrittenTimesSize = 0;
+		} else {
+			// We only ever append in RECORD_FORMAT_LATEST, sealed segments can stay in their format.
+			if (!UpgradeActiveSegment(nSegment))
+			{
+				printf("Failed to upgrade active segment %u of \"%s\"!\n", nSegment, pIndex.nIndexName);
+				return false;
+			}
+
+			pEntryFile = FileSystem::OpenDescriptor(nSegmentFileName, true);
+			pOffsetFile = FileSystem::OpenDescriptor(nOffsetsFileName, true);
+			pTimeFile = FileSystem::OpenDescriptor(nTimesFileName, true);
+
+			// Left behind if the segment was sealed before a crash lost its last entries, it doesn't match anymore.
+			char nTrigramsFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nTrigramsFileName, sizeof(nTrigramsFileName), nSegment, pLogTrigramsExtension);
+			FileSystem::RemoveFile(nTrigramsFileName);
+
+			nWrittenOffsetsSize = (pIndex.nEntries % pIndex.nSegmentEntries) * sizeof(EntryOffset);
+			nWrittenTimesSize = ((pIndex.nEntries % pIndex.nSegmentEntries) + TIME_INDEX_INTERVAL - 1) / TIME_INDEX_INTERVAL * sizeof(EntryTimestamp);
+		}
+
+		nWrittenSegmentSize = pIndex.nActiveSegmentSize;
+		if (pEntryFile == FileSystem::INVALID_DESCRIPTOR || pOffsetFile == FileSystem::INVALID_DESCRIPTOR || pTimeFile == FileSystem::INVALID_DESCRIPTOR || pIndex.nActiveSegmentSize == 0)
+		{
+			CloseActiveSegment();
+			return false;
+		}
+
+		// The posting lists of the active segment only live in memory until it's sealed.
+		pActiveTrigrams.clear();
+		if (g_bTrigramIndex && pIndex.nEntries % pIndex.nSegmentEntries != 0)
+			BuildTrigramPostings(nSegment, pIndex.nEntries % pIndex.nSegmentEntries, pActiveTrigrams);
+
+		nTrigramSegment = nSegment;
+		bHasActiveTrigrams = true;
+		return true;
+	}
+
+	// Builds the posting lists of the given segment by reading all of its records. pMutex has to be locked!
+	void BuildTrigramPostings(unsigned int nSegment, unsigned int nEntries, TrigramPostings& pPostings)
+	{
+		pPostings.clear();
+		if (!g_bTrigramIndex || pIndex.nSegmentEntries > MAX_TRIGRAM_SEGMENT_ENTRIES)
+			return;
+
+		SegmentReader pReader;
+		if (OpenSegmentReader(nSegment, pReader))
+			ReadTrigramPostings(pReader, nEntries, pPostings);
+	}
+
+	static void ReadTrigramPostings(SegmentReader& pReader, unsigned int nEntries, TrigramPostings& pPostings)
+	{
+		std::vector<unsigned int> pTrigrams;
+		const char* pData;
+		EntrySize nSize;
+		for (unsigned int i=0; i<nEntries; ++i)
+		{
+			SegmentReader::RecordResult nResult = pReader.ReadNext(pData, nSize);
+			if (nResult == SegmentReader::RECORD_END)
+				break;
+
+			if (nResult != SegmentReader::RECORD_OK)
+				continue;
+
+			CollectTrigrams(pData, nSize, pTrigrams);
+			for (unsigned int nTrigram : pTrigrams)
+				pPostings[nTrigram].push_back((TrigramPosting)i);
 		}
 	}
 
-	std::unique_lock<std::shared_mutex> writeLock(g_LogIndexesMutex);
-	return g_pLogIndexes.emplace_back();
-}
+	// Writes the ".tri" of a sealed segment, pPostings are the ones it had in memory or nullptr if they have to be read from it.
+	// It uses its own descriptor & no other state of ours since the compactor calls it without pMutex.
+	void WriteSealedTrigramIndex(unsigned int nSegment, const TrigramPostings* pPostings)
+	{
+		if (!g_bTrigramIndex || pIndex.nSegmentEntries > MAX_TRIGRAM_SEGMENT_ENTRIES)
+			return;
 
-// Every entryKeys is limited by Util::ReadFakeJson to 64 characters per key or value & in total they can be 512 characters.
-static void FillLogIndexKeys(LogIndex& pIndex, const std::unordered_map<std::string, std::string>& entryKeys)
-{
-	// If it already has keys, we can skip since for the LogIndex to be picked all keys had to match
-	if (pIndex.nKeys > 0)
+		TrigramPostings pReadPostings;
+		if (!pPostings)
+		{
+			char nTrigramsFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nTrigramsFileName, sizeof(nTrigramsFileName), nSegment, pLogTrigramsExtension);
+			if (FileSystem::FileExists(nTrigramsFileName))
+				return; // Only the compactor writes them, so it's the one we wrote when it was sealed.
+
+			char nSegmentFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+			FileDescriptor_t pFile = FileSystem::OpenDescriptor(nSegmentFileName);
+			if (pFile == FileSystem::INVALID_DESCRIPTOR)
+				return;
+
+			SegmentReader pReader;
+			if (!pReader.Open(pFile, true, FileSystem::DescriptorSize(pFile)))
+				return;
+
+			ReadTrigramPostings(pReader, pIndex.nSegmentEntries, pReadPostings);
+			pPostings = &pReadPostings;
+		}
+
+		WriteTrigramIndex(nSegment, *pPostings);
+	}
+
+	void WriteTrigramIndex(unsigned int nSegment, const TrigramPostings& pPostings)
+	{
+		std::vector<unsigned int> pTrigrams;
+		pTrigrams.reserve(pPostings.size());
+		for (auto& it : pPostings)
+			pTrigrams.push_back(it.first);
+		std::sort(pTrigrams.begin(), pTrigrams.end());
+
+		TrigramIndexHeader pHeader;
+		pHeader.nTrigrams = (unsigned int)pTrigrams.size();
+		std::string pLists;
+		std::string pPostingData;
+		for (unsigned int nTrigram : pTrigrams)
+		{
+			const std::vector<TrigramPosting>& pList = pPostings.at(nTrigram);
+			TrigramList pEntry;
+			pEntry.nTrigram = nTrigram;
+			pEntry.nFirstPosting = pHeader.nPostings;
+			pEntry.nPostings = (unsigned int)pList.size();
+			pLists.append((const char*)&pEntry, sizeof(pEntry));
+			pPostingData.append((const char*)pList.data(), pList.size() * sizeof(TrigramPosting));
+			pHeader.nPostings += pEntry.nPostings;
+		}
+
+		std::string pData((const char*)&pHeader, sizeof(pHeader));
+		pData.append(pLists);
+		pData.append(pPostingData);
+		WriteSegmentSidecar(nSegment, pLogTrigramsExtension, pData);
+	}
+
+	// Fills pCandidates with the entries of the segment that contain every one of pTrigrams, they still have to be checked.
+	// Returns false if there is no trigram index for it, it has to be scanned then.
+	// Sealed segments only have one once the compactor wrote it, see CompactSegment. pMutex has to be locked!
+	bool FindTrigramCandidates(unsigned int nSegment, const std::vector<unsigned int>& pTrigrams, std::vector<TrigramPosting>& pCandidates)
+	{
+		pCandidates.clear();
+		if (!g_bTrigramIndex || pIndex.nSegmentEntries > MAX_TRIGRAM_SEGMENT_ENTRIES)
+			return false;
+
+		std::vector<std::pair<const TrigramPosting*, std::size_t>> pLists;
+		MappedView pView;
+		if (!IsSegmentSealed(nSegment) && (!bHasActiveTrigrams || nSegment != nTrigramSegment))
+		{
+			// The active segment was never opened since we were loaded, a ".tri" is only ever written once it's sealed.
+			BuildTrigramPostings(nSegment, pIndex.nEntries % pIndex.nSegmentEntries, pActiveTrigrams);
+			nTrigramSegment = nSegment;
+			bHasActiveTrigrams = true;
+		}
+
+		if (bHasActiveTrigrams && nSegment == nTrigramSegment)
+		{
+			for (unsigned int nTrigram : pTrigrams)
+			{
+				auto it = pActiveTrigrams.find(nTrigram);
+				if (it == pActiveTrigrams.end())
+					return true; // Nothing can match.
+
+				pLists.push_back({it->second.data(), it->second.size()});
+			}
+		} else {
+			char nTrigramsFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nTrigramsFileName, sizeof(nTrigramsFileName), nSegment, pLogTrigramsExtension);
+
+			FileDescriptor_t pFile = FileSystem::OpenDescriptor(nTrigramsFileName);
+			if (pFile == FileSystem::INVALID_DESCRIPTOR)
+				return false;
+
+			bool bMapped = FileSystem::MapDescriptor(pFile, (std::size_t)FileSystem::DescriptorSize(pFile), pView);
+			FileSystem::CloseDescriptor(pFile);
+
+			TrigramIndexHeader pHeader;
+			if (!bMapped || pView.nSize < sizeof(pHeader))
+			{
+				FileSystem::UnmapView(pView);
+				return false;
+			}
+
+			std::memcpy(&pHeader, pView.pData, sizeof(pHeader));
+			std::size_t nListsSize = (std::size_t)pHeader.nTrigrams * sizeof(TrigramList);
+			if (pHeader.nMagic != TRIGRAM_MAGIC || pView.nSize != sizeof(pHeader) + nListsSize + (std::size_t)pHeader.nPostings * sizeof(TrigramPosting))
+			{
+				printf("Trigram index of segment %u of \"%s\" is corrupted!\n", nSegment, pIndex.nIndexName);
+				FileSystem::UnmapView(pView);
+				return false;
+			}
+
+			const TrigramList* pTrigramLists = (const TrigramList*)(pView.pData + sizeof(pHeader));
+			const TrigramPosting* pPostings = (const TrigramPosting*)(pView.pData + sizeof(pHeader) + nListsSize);
+			for (unsigned int nTrigram : pTrigrams)
+			{
+				const TrigramList* pList = std::lower_bound(pTrigramLists, pTrigramLists + pHeader.nTrigrams, nTrigram, [](const TrigramList& pEntry, unsigned int nValue) {
+					return pEntry.nTrigram < nValue;
+				});
+
+				if (pList == pTrigramLists + pHeader.nTrigrams || pList->nTrigram != nTrigram || (unsigned long long)pList->nFirstPosting + pList->nPostings > pHeader.nPostings)
+				{
+					pLists.clear(); // Nothing can match.
+					break;
+				}
+
+				pLists.push_back({pPostings + pList->nFirstPosting, pList->nPostings});
+			}
+		}
+
+		// Intersect starting with the shortest list so the candidates only shrink.
+		std::sort(pLists.begin(), pLists.end(), [](const auto& pA, const auto& pB) { return pA.second < pB.second; });
+		std::vector<TrigramPosting> pIntersection;
+		for (std::size_t i=0; i<pLists.size(); ++i)
+		{
+			if (i == 0)
+			{
+				pCandidates.assign(pLists[i].first, pLists[i].first + pLists[i].second);
+				continue;
+			}
+
+			pIntersection.clear();
+			std::set_intersection(pCandidates.begin(), pCandidates.end(), pLists[i].first, pLists[i].first + pLists[i].second, std::back_inserter(pIntersection));
+			pCandidates.swap(pIntersection);
+			if (pCandidates.empty())
+				break;
+		}
+
+		FileSystem::UnmapView(pView);
+		return true;
+	}
+
+	// A segment is sealed once it's full, even if SealActiveSegment wasn't called for it yet.
+	bool IsSegmentSealed(unsigned int nSegment)
+	{
+		return nSegment < GetSegmentForEntry(pIndex.nEntries);
+	}
+
+	// An export reads the segment files while it's sent & a resumed one only matches if they didn't change,
+	// so the compactor doesn't replace any of our segments while one is running. pMutex has to be locked!
+	void BeginExport()
+	{
+		++nExports;
+	}
+
+	void EndExport()
+	{
+		std::lock_guard<std::mutex> lock(pMutex);
+		--nExports;
+	}
+
+	// Builds the Bloom filters of a sealed segment by reading all of its records.
+	// It uses its own descriptor & no other state of ours since the compactor calls it without pMutex.
+	void WriteBloomIndex(unsigned int nSegment)
+	{
+		char nSegmentFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nSegmentFileName);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return;
+
+		SegmentReader pReader;
+		if (!pReader.Open(pFile, true, FileSystem::DescriptorSize(pFile)))
+			return;
+
+		std::vector<BloomRange> pRanges;
+		std::string pFilters;
+		std::vector<unsigned long long> pHashes;
+		BloomRange pRange;
+		pRange.nStart = (EntryOffset)pReader.GetOffset();
+		while (true)
+		{
+			const char* pData;
+			EntrySize nSize;
+			SegmentReader::RecordResult nResult = pReader.ReadNext(pData, nSize);
+			if (nResult == SegmentReader::RECORD_OK)
+				CollectTokenHashes(pData, nSize, false, pHashes);
+
+			pRange.nEnd = (EntryOffset)pReader.GetOffset();
+			bool bEnd = nResult == SegmentReader::RECORD_END;
+			if ((bEnd && pRange.nEnd > pRange.nStart) || pRange.nEnd - pRange.nStart >= BLOOM_RANGE_SIZE)
+			{
+				std::sort(pHashes.begin(), pHashes.end());
+				pHashes.erase(std::unique(pHashes.begin(), pHashes.end()), pHashes.end());
+
+				pRange.nFirstByte = (unsigned int)pFilters.size();
+				pRange.nBytes = (unsigned int)std::max<std::size_t>(8, (pHashes.size() * BLOOM_BITS_PER_TOKEN + 7) / 8);
+				pFilters.resize(pFilters.size() + pRange.nBytes, '\0');
+				for (unsigned long long nHash : pHashes)
+					AddToBloom((unsigned char*)pFilters.data() + pRange.nFirstByte, pRange.nBytes * 8, nHash);
+
+				pRanges.push_back(pRange);
+				pHashes.clear();
+				pRange.nStart = pRange.nEnd;
+			}
+
+			if (bEnd)
+				break;
+		}
+
+		BloomIndexHeader pHeader;
+		pHeader.nRanges = (unsigned int)pRanges.size();
+		std::string pIndexData((const char*)&pHeader, sizeof(pHeader));
+		pIndexData.append((const char*)pRanges.data(), pRanges.size() * sizeof(BloomRange));
+		pIndexData.append(pFilters);
+		WriteSegmentSidecar(nSegment, pLogBloomExtension, pIndexData);
+	}
+
+	// Fills pRanges with the [start, end) offset ranges of the segment whose Bloom filters contain all of pTokenHashes.
+	// Returns false if there are no filters for it, it has to be scanned entirely then.
+	// Sealed segments without them (sealed before we had them) get them built now. pMutex has to be locked!
+	bool FindBloomRanges(unsigned int nSegment, const std::vector<unsigned long long>& pTokenHashes, std::vector<std::pair<EntryOffset, EntryOffset>>& pRanges)
+	{
+		pRanges.clear();
+		if (pTokenHashes.empty() || !IsSegmentSealed(nSegment))
+			return false;
+
+		char nBloomFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nBloomFileName, sizeof(nBloomFileName), nSegment, pLogBloomExtension);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nBloomFileName);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+		{
+			if (nPendingCompactions > 0)
+				return false; // The compactor is most likely writing them right now.
+
+			WriteBloomIndex(nSegment);
+			pFile = FileSystem::OpenDescriptor(nBloomFileName);
+			if (pFile == FileSystem::INVALID_DESCRIPTOR)
+				return false;
+		}
+
+		MappedView pView;
+		bool bMapped = FileSystem::MapDescriptor(pFile, (std::size_t)FileSystem::DescriptorSize(pFile), pView);
+		FileSystem::CloseDescriptor(pFile);
+
+		BloomIndexHeader pHeader;
+		if (!bMapped || pView.nSize < sizeof(pHeader))
+		{
+			FileSystem::UnmapView(pView);
+			return false;
+		}
+
+		std::memcpy(&pHeader, pView.pData, sizeof(pHeader));
+		std::size_t nRangesSize = (std::size_t)pHeader.nRanges * sizeof(BloomRange);
+		if (pHeader.nMagic != BLOOM_MAGIC || pView.nSize < sizeof(pHeader) + nRangesSize)
+		{
+			printf("Bloom filters of segment %u of \"%s\" are corrupted!\n", nSegment, pIndex.nIndexName);
+			FileSystem::UnmapView(pView);
+			return false;
+		}
+
+		const BloomRange* pBloomRanges = (const BloomRange*)(pView.pData + sizeof(pHeader));
+		const unsigned char* pFilters = (const unsigned char*)pView.pData + sizeof(pHeader) + nRangesSize;
+		std::size_t nFiltersSize = pView.nSize - sizeof(pHeader) - nRangesSize;
+		for (unsigned int i=0; i<pHeader.nRanges; ++i)
+		{
+			const BloomRange& pRange = pBloomRanges[i];
+			bool bMatches = (unsigned long long)pRange.nFirstByte + pRange.nBytes > nFiltersSize || pRange.nBytes == 0; // Can't check it, so it has to be scanned.
+			if (!bMatches)
+			{
+				bMatches = true;
+				for (unsigned long long nHash : pTokenHashes)
+				{
+					if (!BloomContains(pFilters + pRange.nFirstByte, (std::size_t)pRange.nBytes * 8, nHash))
+					{
+						bMatches = false;
+						break;
+					}
+				}
+			}
+
+			if (!bMatches)
+				continue;
+
+			if (!pRanges.empty() && pRanges.back().second == pRange.nStart)
+				pRanges.back().second = pRange.nEnd; // Continue reading instead of seeking.
+			else
+				pRanges.push_back({pRange.nStart, pRange.nEnd});
+		}
+
+		FileSystem::UnmapView(pView);
+		return true;
+	}
+
+	// Reads the whole offsets sidecar of a segment.
+	bool ReadSegmentOffsets(unsigned int nSegment, std::vector<EntryOffset>& pOffsets)
+	{
+		char nOffsetsFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nOffsetsFileName, sizeof(nOffsetsFileName), nSegment, pLogOffsetsExtension);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nOffsetsFileName);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return false;
+
+		pOffsets.resize((std::size_t)FileSystem::DescriptorSize(pFile) / sizeof(EntryOffset));
+		long long nRead = FileSystem::ReadAt(pFile, pOffsets.data(), pOffsets.size() * sizeof(EntryOffset), 0);
+		FileSystem::CloseDescriptor(pFile);
+
+		return nRead == (long long)(pOffsets.size() * sizeof(EntryOffset));
+	}
+
+	// Rewrites the active segment in RECORD_FORMAT_LATEST if it was created by an older version.
+	// Like CompressSegment it's written into a temporary file that replaces the segment, the offsets & times sidecars are rebuilt afterwards.
+	// Records that had no timestamp get 0, so they are only found by queries without a start time.
+	bool UpgradeActiveSegment(unsigned int nSegment)
+	{
+		char nSegmentFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nSegmentFileName);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return false;
+
+		SegmentHeader pHeader;
+		if (FileSystem::ReadAt(pFile, &pHeader, sizeof(pHeader), 0) != sizeof(pHeader) || pHeader.nMagic != SEGMENT_MAGIC || !IsRecordFormatValid(pHeader.nRecordFormat))
+		{
+			FileSystem::CloseDescriptor(pFile);
+			return false;
+		}
+
+		if (pHeader.nRecordFormat == RECORD_FORMAT_LATEST)
+		{
+			FileSystem::CloseDescriptor(pFile);
+			return true;
+		}
+
+		SegmentReader pReader;
+		if (!pReader.Open(pFile, true, pIndex.nActiveSegmentSize))
+			return false;
+
+		pHeader.nRecordFormat = RECORD_FORMAT_LATEST;
+		std::string pSegment((const char*)&pHeader, sizeof(pHeader));
+		std::string pOffsets;
+		std::string pTimes;
+		unsigned int nEntries = pIndex.nEntries % pIndex.nSegmentEntries;
+		for (unsigned int i=0; i<nEntries; ++i)
+		{
+			const char* pData;
+			EntrySize nSize;
+			SegmentReader::RecordResult nResult = pReader.ReadNext(pData, nSize);
+			if (nResult == SegmentReader::RECORD_END)
+				return false;
+
+			EntryOffset nOffset = (EntryOffset)pSegment.size();
+			pOffsets.append((char*)&nOffset, sizeof(nOffset));
+
+			EntryTimestamp nTimestamp = pReader.GetTimestamp();
+			if ((i % TIME_INDEX_INTERVAL) == 0)
+				pTimes.append((char*)&nTimestamp, sizeof(nTimestamp));
+
+			// Don't let the rewrite turn a corrupted record into a valid one.
+			char pRecordHeader[MAX_RECORD_HEADER_SIZE];
+			pSegment.append(pRecordHeader, WriteRecordHeader(pRecordHeader, nSize, nTimestamp, pData, nResult == SegmentReader::RECORD_CORRUPTED));
+			pSegment.append(pData, nSize);
+		}
+		pReader.Close();
+
+		char nTempFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nTempFileName, sizeof(nTempFileName), nSegment, ".tmp");
+
+		pFile = FileSystem::OpenDescriptor(nTempFileName, true, true);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return false;
+
+		bool bSuccess = FileSystem::WriteAt(pFile, pSegment.data(), pSegment.size(), 0) && FileSystem::SyncDescriptor(pFile);
+		FileSystem::CloseDescriptor(pFile);
+		if (!bSuccess || !FileSystem::RenameFile(nTempFileName, nSegmentFileName))
+		{
+			FileSystem::RemoveFile(nTempFileName);
+			return false;
+		}
+
+		WriteSegmentSidecar(nSegment, pLogOffsetsExtension, pOffsets);
+		WriteSegmentSidecar(nSegment, pLogTimesExtension, pTimes);
+
+		pIndex.nTotalSize = pIndex.nTotalSize - (pIndex.nActiveSegmentSize - sizeof(SegmentHeader)) + (pSegment.size() - sizeof(SegmentHeader));
+		pIndex.nActiveSegmentSize = (unsigned int)pSegment.size();
+		nLastEntryOffset = 0;
+
+		printf("Upgraded active segment %u of \"%s\" to the latest record format\n", nSegment, pIndex.nIndexName);
+		return true;
+	}
+
+	// A full segment has to fit into 32 bits since that's what EntryOffset, the CompressedBlock's & nActiveSegmentSize use.
+	// With the default ENTRIES_DELETION_CYCLE that's about 2MB per entry, above the default -maxpayload.
+	std::size_t GetMaxEntrySize() const
+	{
+		return (UINT_MAX - sizeof(SegmentHeader)) / pIndex.nSegmentEntries - MAX_RECORD_HEADER_SIZE;
+	}
+
+	// Queues the entry and returns once the batch it ended up in was written.
+	bool AddEntry(const std::string& pEntryData)
+	{
+		if (pEntryData.length() > GetMaxEntrySize())
+		{
+			printf("Rejected an entry of %zu bytes for \"%s\", the limit is %zu bytes\n", pEntryData.length(), pIndex.nIndexName, GetMaxEntrySize());
+			return false;
+		}
+
+		PendingEntry pEntry;
+		pEntry.pData = &pEntryData;
+
+		std::unique_lock<std::mutex> queueLock(pQueueMutex);
+		pPendingEntries.push_back(&pEntry);
+		nPendingBytes += pEntryData.length();
+		if (nPendingBytes >= g_nGroupCommitBytes)
+			pQueueCondition.notify_all(); // Wake the leader up early, the batch is full.
+
+		while (!pEntry.bCommitted)
+		{
+			if (bHasCommitLeader)
+			{
+				pQueueCondition.wait(queueLock);
+				continue;
+			}
+
+			// No one is writing right now, so we become the leader and write everything that was queued.
+			bHasCommitLeader = true;
+			if (g_nGroupCommitWindow > 0)
+			{
+				auto pDeadline = std::chrono::steady_clock::now() + std::chrono::microseconds(g_nGroupCommitWindow);
+				pQueueCondition.wait_until(queueLock, pDeadline, [this] { return nPendingBytes >= g_nGroupCommitBytes; });
+			}
+
+			std::vector<PendingEntry*> pBatch;
+			pBatch.swap(pPendingEntries);
+			nPendingBytes = 0;
+			queueLock.unlock();
+
+			std::size_t nWritten = CommitBatch(pBatch);
+
+			queueLock.lock();
+			for (std::size_t i=0; i<pBatch.size(); ++i)
+			{
+				pBatch[i]->bSuccess = i < nWritten;
+				pBatch[i]->bCommitted = true;
+			}
+
+			bHasCommitLeader = false;
+			pQueueCondition.notify_all(); // Wakes everyone from our batch & lets someone else become the next leader.
+		}
+
+		return pEntry.bSuccess;
+	}
+
+	// Replaces the given sidecar of a segment, it's left untouched if it already contains pData.
+	// It's written into a temporary file first so that readers mapping it never see it half written.
+	void WriteSegmentSidecar(unsigned int nSegment, const char* pExtension, const std::string& pData)
+	{
+		char nFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nFileName, sizeof(nFileName), nSegment, pExtension);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nFileName);
+		if (pFile != FileSystem::INVALID_DESCRIPTOR)
+		{
+			std::string pOldData(pData.size(), '\0');
+			long long nRead = FileSystem::ReadAt(pFile, pOldData.data(), pOldData.size(), 0);
+			bool bUnchanged = nRead == (long long)pData.size() && pOldData == pData && FileSystem::DescriptorSize(pFile) == pData.size();
+			FileSystem::CloseDescriptor(pFile);
+
+			if (bUnchanged)
+				return;
+		}
+
+		char nTempFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nTempFileName, sizeof(nTempFileName), nSegment, (std::string(pExtension) + ".tmp").c_str());
+
+		pFile = FileSystem::OpenDescriptor(nTempFileName, true, true);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return;
+
+		bool bWritten = FileSystem::WriteAt(pFile, pData.data(), pData.size(), 0);
+		FileSystem::CloseDescriptor(pFile);
+		if (!bWritten || !FileSystem::RenameFile(nTempFileName, nFileName))
+			FileSystem::RemoveFile(nTempFileName);
+	}
+
+	// Reads a single entry using the offsets sidecar of its segment, so it's one seek + one read instead of walking the segment.
+	// nEntry is relative to the oldest entry that is still on disk.
+	bool ReadEntry(unsigned int nEntry, std::string& pOutput)
+	{
+		EntryOffset nOffset;
+		if (!GetEntryOffset(nEntry, nOffset))
+			return false;
+
+		return ReadRecord(GetSegmentForEntry(nEntry), nOffset, pOutput);
+	}
+
+	// Reads the newest entry without ever scanning the data file.
+	// The offset of the last record is cached, if we don't know it yet (freshly loaded) we ask the offsets sidecar once.
+	bool ReadLastEntry(std::string& pOutput)
+	{
+		if (pIndex.nEntries == 0)
+			return false;
+
+		if (nLastEntryOffset == 0) // 0 is never a valid offset since every segment starts with its SegmentHeader
+		{
+			if (!GetEntryOffset(pIndex.nEntries - 1, nLastEntryOffset))
+				return false;
+		}
+
+		return ReadRecord(GetSegmentForEntry(pIndex.nEntries - 1), nLastEntryOffset, pOutput);
+	}
+
+	bool GetEntryOffset(unsigned int nEntry, EntryOffset& nOffset)
+	{
+		if (nEntry >= pIndex.nEntries)
+			return false;
+
+		unsigned int nSegment = GetSegmentForEntry(nEntry);
+		unsigned long long nSlotOffset = (nEntry % pIndex.nSegmentEntries) * sizeof(EntryOffset);
+		FileDescriptor_t pFile = pOffsetFile;
+		if (pFile == FileSystem::INVALID_DESCRIPTOR || nSegment != nEntryFileSegment)
+		{
+			char nOffsetsFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nOffsetsFileName, sizeof(nOffsetsFileName), nSegment, pLogOffsetsExtension);
+
+			pFile = FileSystem::OpenDescriptor(nOffsetsFileName);
+			if (pFile == FileSystem::INVALID_DESCRIPTOR)
+				return false;
+		}
+
+		IOOperation pRead = IOOperation::Read(pFile, &nOffset, sizeof(nOffset), nSlotOffset);
+		bool bSuccess = FileSystem::ExecuteBatch(&pRead, 1) && pRead.nResult == sizeof(nOffset);
+
+		if (pFile != pOffsetFile)
+			FileSystem::CloseDescriptor(pFile);
+
+		return bSuccess;
+	}
+
+	// The offset of a cursor comes from the client, so it's only used if it really is where nEntry starts. Returns 0 otherwise.
+	EntryOffset ValidateCursorOffset(unsigned int nEntry, EntryOffset nOffset)
+	{
+		EntryOffset nEntryOffset;
+		if (nOffset == 0 || !GetEntryOffset(nEntry, nEntryOffset) || nEntryOffset != nOffset)
+			return 0;
+
+		return nOffset;
+	}
+
+	// Reads the times sidecar of a segment, segments written before we had timestamps have none.
+	void ReadTimeSamples(unsigned int nSegment, std::vector<EntryTimestamp>& pSamples)
+	{
+		pSamples.clear();
+
+		char nTimesFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nTimesFileName, sizeof(nTimesFileName), nSegment, pLogTimesExtension);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nTimesFileName);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return;
+
+		unsigned long long nSegmentSamples = ((unsigned long long)pIndex.nSegmentEntries + TIME_INDEX_INTERVAL - 1) / TIME_INDEX_INTERVAL;
+		pSamples.resize((std::size_t)std::min(FileSystem::DescriptorSize(pFile) / sizeof(EntryTimestamp), nSegmentSamples));
+		long long nRead = FileSystem::ReadAt(pFile, pSamples.data(), pSamples.size() * sizeof(EntryTimestamp), 0);
+		pSamples.resize(nRead > 0 ? (std::size_t)nRead / sizeof(EntryTimestamp) : 0);
+		FileSystem::CloseDescriptor(pFile);
+	}
+
+	// Returns the entry a scan for everything written at or after nTimestamp has to start at.
+	// Timestamps never go backwards, so we binary search the segments by their first sample & then the samples of that segment.
+	// It's always a sample before nTimestamp, so the scan skips at most TIME_INDEX_INTERVAL entries.
+	// If bAfter is set, it instead returns the first sample at or after nTimestamp, so every entry from there on is atleast nTimestamp.
+	unsigned int FindEntryForTimestamp(EntryTimestamp nTimestamp, bool bAfter = false)
+	{
+		if (pIndex.nEntries == 0 || nTimestamp == 0)
+			return 0;
+
+		std::vector<EntryTimestamp> pSamples;
+		unsigned int nLow = 0; // Segments are relative to pIndex.nFirstSegment
+		unsigned int nHigh = GetSegmentForEntry(pIndex.nEntries - 1) - pIndex.nFirstSegment;
+		while (nLow < nHigh) // Last segment whose first entry is before nTimestamp, one without samples counts as 0
+		{
+			unsigned int nMiddle = nLow + (nHigh - nLow + 1) / 2;
+			ReadTimeSamples(pIndex.nFirstSegment + nMiddle, pSamples);
+			if (pSamples.empty() || pSamples[0] < nTimestamp)
+				nLow = nMiddle;
+			else
+				nHigh = nMiddle - 1;
+		}
+
+		ReadTimeSamples(pIndex.nFirstSegment + nLow, pSamples);
+		std::size_t nSample = std::lower_bound(pSamples.begin(), pSamples.end(), nTimestamp) - pSamples.begin();
+		if (bAfter && nSample == pSamples.size())
+			return std::min((nLow + 1) * pIndex.nSegmentEntries, pIndex.nEntries); // The next segment starts at or after it.
+
+		if (!bAfter && nSample > 0)
+			--nSample;
+
+		return std::min(nLow * pIndex.nSegmentEntries + (unsigned int)nSample * TIME_INDEX_INTERVAL, pIndex.nEntries);
+	}
+
+	bool ReadRecord(unsigned int nSegment, EntryOffset nOffset, std::string& pOutput)
+	{
+		FileDescriptor_t pFile = pEntryFile;
+		if (pFile == FileSystem::INVALID_DESCRIPTOR || nSegment != nEntryFileSegment)
+		{
+			char nSegmentFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+			pFile = FileSystem::OpenDescriptor(nSegmentFileName);
+			if (pFile == FileSystem::INVALID_DESCRIPTOR)
+				return false;
+		}
+
+		// We guess that the record is small, so most of the time the size & data are read with a single read.
+		// Sealed segments might be compressed or use an older record format, so we read their header in the same batch.
+		static constexpr std::size_t RECORD_READAHEAD = 4096;
+		bool bSuccess = false;
+		pOutput.resize(RECORD_READAHEAD);
+		SegmentHeader pHeader; // The active segment is always in RECORD_FORMAT_LATEST
+		IOOperation pOperations[2];
+		int nOperations = 0;
+		if (pFile != pEntryFile)
+			pOperations[nOperations++] = IOOperation::Read(pFile, &pHeader, sizeof(pHeader), 0);
+
+		IOOperation& pRead = pOperations[nOperations++];
+		pRead = IOOperation::Read(pFile, pOutput.data(), RECORD_READAHEAD, nOffset);
+		bool bRead = FileSystem::ExecuteBatch(pOperations, nOperations);
+		RecordHeader pRecord;
+		std::size_t nHeaderSize = 0;
+		if (bRead && IsRecordFormatValid(pHeader.nRecordFormat) && pRead.nResult > 0)
+			nHeaderSize = ReadRecordHeader(pHeader.nRecordFormat, pOutput.data(), (std::size_t)pRead.nResult, pRecord);
+
+		if (bRead && pHeader.nRecordFormat == RECORD_FORMAT_COMPRESSED)
+		{
+			SegmentReader pReader;
+			const char* pData;
+			EntrySize nSize;
+			if (pReader.Open(pFile, false, FileSystem::DescriptorSize(pFile)) && pReader.SeekCompressed(nOffset))
+			{
+				SegmentReader::RecordResult nResult = pReader.ReadNext(pData, nSize);
+				if (nResult == SegmentReader::RECORD_OK)
+				{
+					pOutput.assign(pData, nSize);
+					bSuccess = true;
+				} else if (nResult == SegmentReader::RECORD_CORRUPTED) {
+					printf("Record at %u in segment %u of \"%s\" is corrupted!\n", nOffset, nSegment, pIndex.nIndexName);
+				}
+			}
+		} else if (nHeaderSize > 0) {
+			std::size_t nAlreadyRead = (std::size_t)pRead.nResult - nHeaderSize;
+			if (nAlreadyRead >= pRecord.nSize)
+			{
+				bSuccess = true;
+			} else {
+				pOutput.resize(nHeaderSize + pRecord.nSize);
+				pRead = IOOperation::Read(pFile, pOutput.data() + pRead.nResult, pOutput.size() - pRead.nResult, nOffset + pRead.nResult);
+				bSuccess = FileSystem::ExecuteBatch(&pRead, 1) && (std::size_t)pRead.nResult == pRead.nSize;
+			}
+
+			if (bSuccess && !IsRecordChecksumValid(pHeader.nRecordFormat, pOutput.data(), nHeaderSize, pRecord))
+			{
+				printf("Record at %u in segment %u of \"%s\" is corrupted!\n", nOffset, nSegment, pIndex.nIndexName);
+				bSuccess = false;
+			}
+
+			pOutput.erase(0, nHeaderSize);
+			pOutput.resize(pRecord.nSize);
+		}
+
+		if (pFile != pEntryFile)
+			FileSystem::CloseDescriptor(pFile);
+
+		return bSuccess;
+	}
+
+	// Reads every segment once and validates the checksum of every record (segments in RECORD_FORMAT_1 have none),
+	// segments are memory mapped & read sequentially so this runs at roughly disk bandwidth.
+	// pMutex has to be locked!
+	void VerifySegments(VerifyResult& pResult)
+	{
+		auto pStart = std::chrono::steady_clock::now();
+
+		SegmentReader pReader;
+		unsigned int nRemainingEntries = pIndex.nEntries;
+		for (unsigned int nSegment = pIndex.nFirstSegment; nRemainingEntries > 0; ++nSegment)
+		{
+			unsigned int nSegmentEntries = std::min(nRemainingEntries, pIndex.nSegmentEntries);
+			nRemainingEntries -= nSegmentEntries;
+			++pResult.nSegments;
+
+			if (!OpenSegmentReader(nSegment, pReader))
+			{
+				printf("Failed to read segment %u of \"%s\"!\n", nSegment, pIndex.nIndexName);
+				pResult.nMissingRecords += nSegmentEntries;
+				continue;
+			}
+
+			unsigned int nFound = 0;
+			const char* pData;
+			EntrySize nSize;
+			while (nFound < nSegmentEntries && pReader.ReadNext(pData, nSize) != SegmentReader::RECORD_END)
+				++nFound;
+
+			if (pReader.GetCorruptedRecords() > 0 || nFound < nSegmentEntries)
+				printf("Segment %u of \"%s\" has %u corrupted and %u missing records!\n", nSegment, pIndex.nIndexName, pReader.GetCorruptedRecords(), nSegmentEntries - nFound);
+
+			pResult.nBytes += pReader.GetEndOffset();
+			pResult.nRecords += nFound;
+			pResult.nCorruptedRecords += pReader.GetCorruptedRecords();
+			pResult.nMissingRecords += nSegmentEntries - nFound;
+		}
+
+		pResult.nSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - pStart).count();
+	}
+
+	// The LogIndex is only written once the index is unloaded, so after a crash it can be far behind its segments.
+	// This rebuilds it from the segments that are on disk, the newest one is scanned record by record
+	// and anything after its last complete record (a torn write) is cut off. Its offsets sidecar is rebuilt too since it's never synced.
+	// Returns true if the LogIndex had to be changed.
+	bool RecoverFromSegments()
+	{
+		char nDataDirectory[FileSystem::MAX_PATH];
+		BuildDataDirectoryName(nDataDirectory, sizeof(nDataDirectory));
+
+		if (pIndex.version != INDEX_VERSION_LATEST)
+		{
+			// The migration removes the legacy data file, if it's gone we crashed before the migrated LogIndex was written.
+			char nLegacyFileName[FileSystem::MAX_PATH];
+			BuildLegacyDataFileName(nLegacyFileName, sizeof(nLegacyFileName));
+			if (FileSystem::FileExists(nLegacyFileName) || !FileSystem::FileExists(nDataDirectory))
+				return false;
+		}
+
+		bool bFound = false;
+		unsigned int nFirstSegment = UINT_MAX;
+		unsigned int nLastSegment = 0;
+		std::error_code pError;
+		for (auto& pFile : std::filesystem::directory_iterator(nDataDirectory, pError))
+		{
+			std::string strFileName = pFile.path().filename().string();
+			if (pFile.path().extension() == ".tmp") // Left behind by CompressSegment or WriteSegmentSidecar, the file it replaces is still intact.
+			{
+				FileSystem::RemoveFile(pFile.path().string().c_str());
+				continue;
+			}
+
+			char* pEnd = nullptr;
+			unsigned long nSegment = std::strtoul(strFileName.c_str(), &pEnd, 10);
+			if (pEnd == strFileName.c_str() || *pEnd != '.')
+				continue;
+
+			// Our LogIndex is only saved after nFirstSegment moved, so we crashed before the compactor unlinked the deleted segments.
+			if (nSegment < pIndex.nFirstSegment)
+			{
+				FileSystem::RemoveFile(pFile.path().string().c_str());
+				continue;
+			}
+
+			if (pFile.path().extension() != pLogExtension)
+				continue;
+
+			bFound = true;
+			nFirstSegment = std::min(nFirstSegment, (unsigned int)nSegment);
+			nLastSegment = std::max(nLastSegment, (unsigned int)nSegment);
+		}
+
+		LogIndex_V4 pOldIndex = pIndex;
+		pIndex.version = INDEX_VERSION_LATEST;
+		if (!bFound)
+		{
+			pIndex.nEntries = 0;
+			pIndex.nTotalSize = 0;
+			pIndex.nActiveSegmentSize = 0;
+			return std::memcmp(&pOldIndex, (LogIndex_V4*)&pIndex, sizeof(LogIndex_V4)) != 0;
+		}
+
+		pIndex.nFirstSegment = nFirstSegment;
+		pIndex.nEntries = (nLastSegment - nFirstSegment) * pIndex.nSegmentEntries;
+		pIndex.nTotalSize = 0;
+		for (unsigned int nSegment = nFirstSegment; nSegment < nLastSegment; ++nSegment)
+			pIndex.nTotalSize += GetSegmentRecordsSize(nSegment);
+
+		pIndex.nActiveSegmentSize = 0;
+		RecoverLastSegment(nLastSegment);
+
+		if (std::memcmp(&pOldIndex, (LogIndex_V4*)&pIndex, sizeof(LogIndex_V4)) == 0)
+			return false;
+
+		printf("Recovered Log Index \"%s\": %u -> %u entries\n", pIndex.nIndexName, pOldIndex.nEntries, pIndex.nEntries);
+		return true;
+	}
+
+	// Size of all segments on disk, compressed or not. Offsets sidecars are not included.
+	// pMutex has to be locked!
+	unsigned long long GetDiskSize()
+	{
+		if (pIndex.nEntries == 0)
+			return 0;
+
+		unsigned long long nDiskSize = 0;
+		unsigned int nLastSegment = GetSegmentForEntry(pIndex.nEntries - 1);
+		for (unsigned int nSegment = pIndex.nFirstSegment; nSegment <= nLastSegment; ++nSegment)
+		{
+			char nSegmentFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+			nDiskSize += FileSystem::FileSize(nSegmentFileName);
+		}
+
+		return nDiskSize;
+	}
+
+	bool ShouldUnload(std::chrono::system_clock::time_point pTimePoint)
+	{
+		return nPins == 0 && nTailWaiters == 0 && nPendingCompactions == 0 && std::chrono::duration<double>(pTimePoint - nLastTouched).count() > MAX_INDEX_LOADED_TIME;
+	}
+
+	// Entry number that the next written entry gets, counted from the very first entry of the index like cursors are.
+	unsigned long long GetNextAbsoluteEntry() const
+	{
+		return (unsigned long long)pIndex.nFirstSegment * pIndex.nSegmentEntries + pIndex.nEntries;
+	}
+
+	// Offset inside its segment that the next written entry gets, 0 if it starts a new segment.
+	EntryOffset GetNextEntryOffset() const
+	{
+		return (pIndex.nEntries % pIndex.nSegmentEntries) == 0 ? 0 : (EntryOffset)pIndex.nActiveSegmentSize;
+	}
+
+	// Blocks until an entry at or past nAbsoluteEntry was committed or nTimeout passed, returns false if it timed out.
+	// writeLock has to hold pMutex. We aren't unloaded while someone waits.
+	bool WaitForEntries(std::unique_lock<std::mutex>& writeLock, unsigned long long nAbsoluteEntry, std::chrono::milliseconds nTimeout)
+	{
+		++nTailWaiters;
+		bool bHasEntries = pTailCondition.wait_for(writeLock, nTimeout, [&] { return GetNextAbsoluteEntry() > nAbsoluteEntry; });
+		--nTailWaiters;
+
+		MarkTouched(); // Someone's watching us, so stay loaded.
+		return bHasEntries;
+	}
+
+	void SetIndexName(const std::string& pKeyName)
+	{
+		pIndex.SetIndexName(pKeyName);
+		pIndexHash = std::hash<std::string>{}(pKeyName);
+	}
+
+	void SetDurability(Durability nNewDurability)
+	{
+		nDurability = nNewDurability;
+	}
+
+	void SetRetention(const RetentionPolicy& pNewRetention)
+	{
+		pRetention = pNewRetention;
+	}
+
+	// Deletes our oldest segments until we are within our RetentionPolicy again, returns how many were deleted.
+	unsigned int EnforceRetention()
+	{
+		std::lock_guard<std::mutex> lock(pMutex);
+
+		unsigned long long nDiskSize = pRetention.nMaxBytes > 0 ? GetDiskSize() : 0;
+		EntryTimestamp nCurrentTime = GetCurrentTimestamp();
+		EntryTimestamp nExpireBefore = nCurrentTime - std::min(nCurrentTime, pRetention.nMaxAge);
+		std::vector<EntryTimestamp> pSamples;
+		unsigned int nDeleted = 0;
+		while (pIndex.nEntries > pIndex.nSegmentEntries) // The newest segment always stays.
+		{
+			bool bExpired = (pRetention.nMaxEntries > 0 && pIndex.nEntries > pRetention.nMaxEntries) || (pRetention.nMaxBytes > 0 && nDiskSize > pRetention.nMaxBytes);
+			if (!bExpired && pRetention.nMaxAge > 0)
+			{
+				// Timestamps never go backwards, so every entry of the oldest segment is at most as old as the first one of the next segment.
+				ReadTimeSamples(pIndex.nFirstSegment + 1, pSamples);
+				EntryTimestamp nNewestTime = !pSamples.empty() ? pSamples[0] : 0;
+				if (nNewestTime == 0)
+				{
+					// Segments written before we had ".tim" sidecars or migrated entries don't know when they were written,
+					// the last time the segment was written is the closest we have.
+					char nSegmentFileName[FileSystem::MAX_PATH];
+					BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), pIndex.nFirstSegment);
+					nNewestTime = FileSystem::FileModifiedTime(nSegmentFileName);
+				}
+
+				bExpired = nNewestTime != 0 && nNewestTime < nExpireBefore;
+			}
+
+			if (!bExpired)
+				break;
+
+			char nSegmentFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), pIndex.nFirstSegment);
+			nDiskSize -= std::min(nDiskSize, (unsigned long long)FileSystem::FileSize(nSegmentFileName));
+
+			DoEntryDeletionCycle();
+			++nDeleted;
+		}
+
+		return nDeleted;
+	}
+
+	// Queues a CompactionJob for every sealed segment whose compaction never finished since we crashed or were stopped before it ran.
+	// Called once we're loaded, before anyone else can use us.
+	void QueueMissingCompactions()
+	{
+		if (nPendingCompactions > 0 || pIndex.nEntries < pIndex.nSegmentEntries)
+			return; // Our migration just queued them.
+
+		// A full segment that is still the newest one is sealed with the next write, which queues its compaction.
+		unsigned int nNewestSegment = GetSegmentForEntry(pIndex.nEntries - 1);
+		for (unsigned int nSegment = pIndex.nFirstSegment; nSegment < nNewestSegment; ++nSegment)
+		{
+			char nSegmentFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+			FileDescriptor_t pFile = FileSystem::OpenDescriptor(nSegmentFileName);
+			if (pFile == FileSystem::INVALID_DESCRIPTOR)
+				continue;
+
+			SegmentHeader pHeader;
+			bool bCompressed = FileSystem::ReadAt(pFile, &pHeader, sizeof(pHeader), 0) == sizeof(pHeader) && pHeader.nRecordFormat == RECORD_FORMAT_COMPRESSED;
+			unsigned long long nSegmentSize = FileSystem::DescriptorSize(pFile);
+			FileSystem::CloseDescriptor(pFile);
+
+			char nBloomFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nBloomFileName, sizeof(nBloomFileName), nSegment, pLogBloomExtension);
+
+			char nTrigramsFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nTrigramsFileName, sizeof(nTrigramsFileName), nSegment, pLogTrigramsExtension);
+			bool bHasTrigrams = !g_bTrigramIndex || pIndex.nSegmentEntries > MAX_TRIGRAM_SEGMENT_ENTRIES || FileSystem::FileExists(nTrigramsFileName);
+			if ((bCompressed || !g_bCompression) && FileSystem::FileExists(nBloomFileName) && bHasTrigrams)
+				continue;
+
+			CompactionJob pJob;
+			pJob.pLog = this;
+			pJob.nSegment = nSegment;
+			pJob.nSegmentSize = (unsigned int)nSegmentSize;
+			++nPendingCompactions;
+			QueueCompaction(std::move(pJob));
+		}
+	}
+
+	// -verifyonload, the verification runs on the compactor thread so that loading us doesn't wait for it.
+	void QueueVerify()
+	{
+		CompactionJob pJob;
+		pJob.pLog = this;
+		pJob.bVerify = true;
+		++nPendingCompactions;
+		QueueCompaction(std::move(pJob));
+	}
+
+	void VerifyQueued()
+	{
+		VerifyResult pResult;
+		{
+			std::lock_guard<std::mutex> lock(pMutex);
+			VerifySegments(pResult);
+		}
+
+		printf("Verified \"%s\": %u records, %u corrupted, %u missing (%.1f MB/s)\n", pIndex.nIndexName, pResult.nRecords, pResult.nCorruptedRecords, pResult.nMissingRecords,
+			pResult.nSeconds > 0 ? (pResult.nBytes / (1024.0 * 1024.0)) / pResult.nSeconds : 0.0);
+		--nPendingCompactions;
+	}
+
+	// Runs on the compactor thread without pMutex, so only the files of the sealed segment are touched.
+	void CompactSegment(const CompactionJob& pJob)
+	{
+		WriteSealedTrigramIndex(pJob.nSegment, pJob.bHasTrigrams ? &pJob.pTrigrams : nullptr);
+		WriteBloomIndex(pJob.nSegment);
+
+		if (g_bCompression)
+			CompressSegment(pJob.nSegment, pJob.nSegmentSize);
+
+		--nPendingCompactions;
+	}
+
+	// With Durability::NONE entries can still be sitting in our write buffer, readers would miss them.
+	// pMutex has to be locked!
+	void PrepareRead()
+	{
+		if (nDurability != Durability::NONE)
+			return;
+
+		FlushWrites(true);
+	}
+
+	void SetIndexHash(const std::size_t pHash)
+	{
+		pIndexHash = pHash;
+	}
+
+	// V1/V2 indexes stored all their entries inside a single "logdata/data/<id>.dat" file.
+	// We split it into segments once when it's loaded, after which it's a normal V3 index.
+	// Returns false if that failed, the index then keeps its legacy header & data file so that it's tried again the next time.
+	bool MigrateLegacyDataFile()
+	{
+		char nLegacyFileName[FileSystem::MAX_PATH];
+		BuildLegacyDataFileName(nLegacyFileName, sizeof(nLegacyFileName));
+
+		LogIndex pLegacyIndex = pIndex;
+		unsigned int nLegacyEntries = pIndex.nEntries;
+		pIndex.nEntries = 0;
+		pIndex.nTotalSize = 0;
+		pIndex.nFirstSegment = 0;
+		pIndex.nActiveSegmentSize = 0;
+
+		FileHandle_t pLegacyFile = FileSystem::OpenReadFile(nLegacyFileName);
+		if (!pLegacyFile.is_open())
+		{
+			printf("Failed to open legacy data file of \"%s\", starting empty\n", pIndex.nIndexName);
+			pIndex.version = INDEX_VERSION_LATEST;
+			return true;
+		}
+
+		bool bWritten = true;
+		char pBuffer[USHRT_MAX]; // We don't need to check bounds since each entry has a size limit of USHRT_MAX
+		for (unsigned int i=0; i<nLegacyEntries && bWritten; ++i)
+		{
+			LegacyEntrySize nSize;
+			pLegacyFile.read((char*)&nSize, sizeof(nSize));
+			if (pLegacyFile.gcount() != sizeof(nSize))
+				break;
+
+			pLegacyFile.read(pBuffer, nSize);
+			if (pLegacyFile.gcount() != nSize)
+				break;
+
+			if (pIndex.nEntries > 0 && (pIndex.nEntries % pIndex.nSegmentEntries) == 0 && !SealActiveSegment())
+			{
+				bWritten = false;
+				break;
+			}
+
+			if (!OpenActiveSegment())
+			{
+				bWritten = false;
+				break;
+			}
+
+			WriteRecord(pBuffer, nSize, 0, true); // We never knew when they were written.
+			if (pOwnedData.size() >= (1 << 20))
+				bWritten = FlushWrites(true);
+		}
+		pLegacyFile.close();
+
+		// The legacy file is the only copy of the entries until the V3 header pointing at the segments is on disk.
+		bWritten = FlushWrites(true) && bWritten;
+		pIndex.version = INDEX_VERSION_LATEST; // Only now, until here OpenActiveSegment must not save our header.
+		if (!bWritten || !SaveIndex())
+		{
+			printf("Failed to migrate legacy data file of \"%s\", keeping it\n", pIndex.nIndexName);
+			CloseActiveSegment();
+			pActiveTrigrams.clear();
+			bHasActiveTrigrams = false;
+			pIndex = pLegacyIndex; // The segments are simply recreated from scratch.
+
+			while (nPendingCompactions > 0) // Our caller deletes us, the segments we already sealed are still queued.
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+			return false;
+		}
+
+		FileSystem::RemoveFile(nLegacyFileName);
+		printf("Migrated legacy data file of \"%s\" into segments (%u entries)\n", pIndex.nIndexName, pIndex.nEntries);
+		return true;
+	}
+
+private:
+	struct PendingEntry
+	{
+		const std::string* pData = nullptr;
+		bool bCommitted = false;
+		bool bSuccess = false;
+	};
+
+	// Writes all given entries with a single write + flush per segment.
+	// Returns how many of them were written, a failed write rolls back every entry after those so none of them are stored.
+	std::size_t CommitBatch(const std::vector<PendingEntry*>& pBatch)
+	{
+		// We need to do a full lock since currently we do not support multiple threads writing to the same log entry.
+		std::lock_guard<std::mutex> lock(pMutex);
+
+		MarkTouched();
+
+		// The whole batch shares one timestamp, it never goes backwards so that time range queries can binary search.
+		nLastTimestamp = std::max(nLastTimestamp, GetCurrentTimestamp());
+
+		// Sealing a segment & Durability::SYNC_ENTRY write what was queued so far, a failure after that only rolls back the records queued since.
+		std::size_t nQueued = 0;
+		std::size_t nWritten = 0;
+		bool bFailed = false;
+		for (PendingEntry* pEntry : pBatch)
+		{
+			if (pIndex.nEntries > 0 && (pIndex.nEntries % pIndex.nSegmentEntries) == 0) // Active segment is full
+			{
+				bFailed = !SealActiveSegment();
+				if (bFailed)
+					break;
+
+				nWritten = nQueued;
+			}
+
+			bFailed = !OpenActiveSegment();
+			if (bFailed)
+				break;
+
+			// The data of the entry is only referenced since its owner waits until we are done,
+			// with Durability::NONE we keep it buffered past this batch so we have to copy it.
+			WriteRecord(pEntry->pData->c_str(), (EntrySize)pEntry->pData->length(), nLastTimestamp, nDurability == Durability::NONE);
+			++nQueued;
+
+			if (nDurability == Durability::SYNC_ENTRY)
+			{
+				bFailed = !FlushWrites();
+				if (bFailed)
+					break;
+
+				nWritten = nQueued;
+			}
+		}
+
+		if (!bFailed && FlushWrites())
+			nWritten = nQueued;
+
+		if (nWritten > 0)
+		{
+			printf("Wrote %i new Log Entries into \"%s\"\n", (int)nWritten, pIndex.nIndexName);
+			pTailCondition.notify_all(); // Wakes up everyone in WaitForEntries, costs nothing if no one is tailing us.
+		}
+
+		return nWritten;
+	}
+
+	// Only queues the record, FlushWrites has to be called to actually write it into the active segment.
+	// If bCopy is false, pData has to stay valid until FlushWrites was called!
+	void WriteRecord(const char* pData, EntrySize nSize, EntryTimestamp nTimestamp, bool bCopy)
+	{
+		EntryOffset nOffset = pIndex.nActiveSegmentSize;
+		pOffsetBuffer.append((char*)&nOffset, sizeof(nOffset));
+		nLastEntryOffset = nOffset;
+
+		if ((pIndex.nEntries % pIndex.nSegmentEntries) % TIME_INDEX_INTERVAL == 0)
+			pTimeBuffer.append((char*)&nTimestamp, sizeof(nTimestamp));
+
+		if (g_bTrigramIndex && pIndex.nSegmentEntries <= MAX_TRIGRAM_SEGMENT_ENTRIES)
+		{
+			CollectTrigrams(pData, nSize, pTrigramBuffer);
+			for (unsigned int nTrigram : pTrigramBuffer)
+				pActiveTrigrams[nTrigram].push_back((TrigramPosting)(pIndex.nEntries % pIndex.nSegmentEntries));
+		}
+
+		PendingRecord& pRecord = pPendingRecords.emplace_back();
+		pRecord.nSize = nSize;
+		pRecord.nHeaderSize = (unsigned char)WriteRecordHeader(pRecord.pHeader, nSize, nTimestamp, pData);
+
+		if (bCopy)
+		{
+			pRecord.nOwnedOffset = pOwnedData.size();
+			pOwnedData.append(pData, nSize);
+		} else {
+			pRecord.pData = pData;
+		}
+
+		std::size_t nRecordSize = pRecord.nHeaderSize + nSize;
+		++pIndex.nEntries;
+		pIndex.nTotalSize += nRecordSize;
+		pIndex.nActiveSegmentSize += nRecordSize;
+	}
+
+	// Writes the queued records into the active segment using a single vectored write, how far they get depends on our Durability.
+	bool FlushWrites(bool bForce = false)
+	{
+		if (pPendingRecords.empty())
+			return true;
+
+		static constexpr std::size_t NONE_BUFFER_SIZE = 1 << 16;
+		if (!bForce && nDurability == Durability::NONE && pOwnedData.size() < NONE_BUFFER_SIZE)
+			return true; // Keep collecting.
+
+		pWriteVectors.clear();
+		for (PendingRecord& pRecord : pPendingRecords)
+		{
+			pWriteVectors.push_back({pRecord.pHeader, pRecord.nHeaderSize});
+			pWriteVectors.push_back({pRecord.pData ? pRecord.pData : (pOwnedData.data() + pRecord.nOwnedOffset), pRecord.nSize});
+		}
+
+		// Data, offsets, times & the sync are submitted as one batch, with the io_uring that's a single syscall.
+		IOOperation pOperations[4];
+		int nOperations = 0;
+		pOperations[nOperations++] = IOOperation::WriteVector(pEntryFile, pWriteVectors.data(), (int)pWriteVectors.size(), nWrittenSegmentSize);
+		pOperations[nOperations++] = IOOperation::Write(pOffsetFile, pOffsetBuffer.data(), pOffsetBuffer.size(), nWrittenOffsetsSize);
+		if (!pTimeBuffer.empty())
+			pOperations[nOperations++] = IOOperation::Write(pTimeFile, pTimeBuffer.data(), pTimeBuffer.size(), nWrittenTimesSize);
+		if (nDurability == Durability::SYNC_BATCH || nDurability == Durability::SYNC_ENTRY)
+			pOperations[nOperations++] = IOOperation::Sync(pEntryFile);
+
+		bool bSuccess = FileSystem::ExecuteBatch(pOperations, nOperations);
+		if (bSuccess)
+		{
+			nWrittenSegmentSize = pIndex.nActiveSegmentSize;
+			nWrittenOffsetsSize += pOffsetBuffer.size();
+			nWrittenTimesSize += pTimeBuffer.size();
+		} else {
+			DiscardPendingRecords();
+		}
+
+		pPendingRecords.clear();
+		pOwnedData.clear();
+		pOffsetBuffer.clear();
+		pTimeBuffer.clear();
+
+		return bSuccess;
+	}
+
+	// Rolls the index back to what is actually on disk after a failed FlushWrites.
+	// The next write simply overwrites whatever part of the records made it into the files.
+	void DiscardPendingRecords()
+	{
+		unsigned int nFirstLost = (unsigned int)((pIndex.nEntries - pPendingRecords.size()) % pIndex.nSegmentEntries);
+		for (auto it = pActiveTrigrams.begin(); it != pActiveTrigrams.end();)
+		{
+			std::vector<TrigramPosting>& pPostings = it->second;
+			while (!pPostings.empty() && pPostings.back() >= nFirstLost)
+				pPostings.pop_back();
+
+			it = pPostings.empty() ? pActiveTrigrams.erase(it) : std::next(it);
+		}
+
+		printf("Failed to write %i Log Entries into \"%s\", discarding them\n", (int)pPendingRecords.size(), pIndex.nIndexName);
+		pIndex.nEntries -= (unsigned int)pPendingRecords.size();
+		pIndex.nTotalSize -= pIndex.nActiveSegmentSize - nWrittenSegmentSize;
+		pIndex.nActiveSegmentSize = nWrittenSegmentSize;
+		nLastEntryOffset = 0;
+	}
+
+	bool CloseActiveSegment()
+	{
+		bool bFlushed = FlushWrites(true);
+
+		FileSystem::CloseDescriptor(pEntryFile);
+		FileSystem::CloseDescriptor(pOffsetFile);
+		FileSystem::CloseDescriptor(pTimeFile);
+		pEntryFile = FileSystem::INVALID_DESCRIPTOR;
+		pOffsetFile = FileSystem::INVALID_DESCRIPTOR;
+		pTimeFile = FileSystem::INVALID_DESCRIPTOR;
+
+		return bFlushed;
+	}
+
+	// Closes the full active segment, the next write will create a new one.
+	// If its last records couldn't be written it's no longer full and stays the active segment.
+	bool SealActiveSegment()
+	{
+		if (!CloseActiveSegment())
+			return false;
+
+		// Not nEntryFileSegment since after being loaded the full segment was never opened.
+		unsigned int nSegment = GetSegmentForEntry(pIndex.nEntries - 1);
+		CompactionJob pJob;
+		pJob.pLog = this;
+		pJob.nSegment = nSegment;
+		pJob.nSegmentSize = pIndex.nActiveSegmentSize;
+		if (bHasActiveTrigrams && nTrigramSegment == nSegment)
+		{
+			// Saves the compactor from reading the whole segment again for its ".tri".
+			pJob.pTrigrams = std::move(pActiveTrigrams);
+			pJob.bHasTrigrams = true;
+		}
+		pActiveTrigrams.clear();
+		bHasActiveTrigrams = false;
+
+		QueueDeferredCompressions();
+		++nPendingCompactions;
+		QueueCompaction(std::move(pJob));
+
+		pIndex.nActiveSegmentSize = 0;
+		return true;
+	}
+
+	// The deferred segments are only compressed once another one is sealed, a new entry changes the ETag of the export anyway
+	// while resuming the one that just ended still works until then. QueueMissingCompactions gets them if we're unloaded first.
+	// pMutex has to be locked!
+	void QueueDeferredCompressions()
+	{
+		if (nExports > 0)
+			return;
+
+		for (unsigned int nSegment : pDeferredCompressions)
+		{
+			if (nSegment < pIndex.nFirstSegment)
+				continue; // Deleted since.
+
+			char nSegmentFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+			CompactionJob pJob;
+			pJob.pLog = this;
+			pJob.nSegment = nSegment;
+			pJob.nSegmentSize = (unsigned int)FileSystem::FileSize(nSegmentFileName);
+			++nPendingCompactions;
+			QueueCompaction(std::move(pJob));
+		}
+		pDeferredCompressions.clear();
+	}
+
+	// Returns true if the segment can't be replaced right now, see QueueDeferredCompressions. pMutex has to be locked!
+	bool DeferCompression(unsigned int nSegment)
+	{
+		if (nExports == 0)
+			return false;
+
+		pDeferredCompressions.push_back(nSegment);
+		return true;
+	}
+
+	// Rewrites the sealed segment in RECORD_FORMAT_COMPRESSED, see COMPRESSION_BLOCK_SIZE.
+	// The compressed segment is written into a temporary file that replaces the segment once it's complete,
+	// so if anything fails or we crash the segment simply stays uncompressed.
+	void CompressSegment(unsigned int nSegment, unsigned int nSegmentSize)
+	{
+		{
+			std::lock_guard<std::mutex> lock(pMutex);
+			if (DeferCompression(nSegment))
+				return;
+		}
+
+		char nSegmentFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nSegmentFileName);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return;
+
+		nSegmentSize = (unsigned int)std::min<unsigned long long>(nSegmentSize, FileSystem::DescriptorSize(pFile)); // Already compressed if it shrank.
+		MappedView pView;
+		std::string pSegmentData;
+		const char* pSegment = nullptr;
+		if (FileSystem::MapDescriptor(pFile, nSegmentSize, pView))
+		{
+			pSegment = pView.pData;
+		} else {
+			pSegmentData.resize(nSegmentSize);
+			if (FileSystem::ReadAt(pFile, pSegmentData.data(), nSegmentSize, 0) == (long long)nSegmentSize)
+				pSegment = pSegmentData.data();
+		}
+		FileSystem::CloseDescriptor(pFile);
+
+		SegmentHeader pHeader;
+		if (!pSegment || nSegmentSize < sizeof(pHeader))
+		{
+			FileSystem::UnmapView(pView);
+			return;
+		}
+
+		std::memcpy(&pHeader, pSegment, sizeof(pHeader));
+		if (pHeader.nMagic != SEGMENT_MAGIC || !IsRecordFormatValid(pHeader.nRecordFormat))
+		{
+			FileSystem::UnmapView(pView);
+			return;
+		}
+
+
+		// Split it into blocks at record boundaries.
+		std::vector<CompressedBlock> pBlocks;
+		unsigned int nOffset = sizeof(SegmentHeader);
+		while (nOffset < nSegmentSize)
+		{
+			CompressedBlock& pBlock = pBlocks.emplace_back();
+			pBlock.nOffset = nOffset;
+			while (nOffset < nSegmentSize && (nOffset - pBlock.nOffset) < COMPRESSION_BLOCK_SIZE)
+			{
+				RecordHeader pRecord;
+				std::size_t nHeaderSize = ReadRecordHeader(pHeader.nRecordFormat, pSegment + nOffset, nSegmentSize - nOffset, pRecord);
+				if (nHeaderSize == 0 || nSegmentSize - nOffset - nHeaderSize < pRecord.nSize)
+					break;
+
+				nOffset += nHeaderSize + pRecord.nSize;
+			}
+
+			pBlock.nSize = nOffset - pBlock.nOffset;
+			if (pBlock.nSize == 0) // Truncated record
+			{
+				FileSystem::UnmapView(pView);
+				return;
+			}
+		}
+
+		CompressedSegmentHeader pSegmentHeader;
+		pSegmentHeader.nSegmentSize = nSegmentSize;
+		pSegmentHeader.nBlocks = (unsigned int)pBlocks.size();
+
+		std::size_t nDataOffset = sizeof(SegmentHeader) + sizeof(CompressedSegmentHeader) + pBlocks.size() * sizeof(CompressedBlock);
+		std::string pCompressed;
+		pCompressed.resize(nDataOffset);
+		for (CompressedBlock& pBlock : pBlocks)
+		{
+			std::size_t nPos = pCompressed.size();
+			pBlock.nFileOffset = (unsigned int)nPos;
+			pCompressed.resize(nPos + Compression::GetMaxCompressedSize(pBlock.nSize));
+
+			std::size_t nCompressedSize = Compression::Compress(pSegment + pBlock.nOffset, pBlock.nSize, pCompressed.data() + nPos, pCompressed.size() - nPos);
+			if (nCompressedSize == 0 || nCompressedSize >= pBlock.nSize)
+			{
+				std::memcpy(pCompressed.data() + nPos, pSegment + pBlock.nOffset, pBlock.nSize);
+				nCompressedSize = pBlock.nSize;
+			}
+
+			pBlock.nCompressedSize = (unsigned int)nCompressedSize;
+			pCompressed.resize(nPos + nCompressedSize);
+		}
+		FileSystem::UnmapView(pView);
+
+		if (pCompressed.size() >= nSegmentSize)
+			return; // Not worth it, keep it uncompressed.
+
+		pHeader.nBlockRecordFormat = pHeader.nRecordFormat;
+		pHeader.nRecordFormat = RECORD_FORMAT_COMPRESSED;
+		std::memcpy(pCompressed.data(), &pHeader, sizeof(pHeader));
+		std::memcpy(pCompressed.data() + sizeof(pHeader), &pSegmentHeader, sizeof(pSegmentHeader));
+		std::memcpy(pCompressed.data() + sizeof(pHeader) + sizeof(pSegmentHeader), pBlocks.data(), pBlocks.size() * sizeof(CompressedBlock));
+
+		char nTempFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nTempFileName, sizeof(nTempFileName), nSegment, ".tmp");
+
+		pFile = FileSystem::OpenDescriptor(nTempFileName, true, true);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return;
+
+		Durability nCurrentDurability = nDurability;
+		bool bSuccess = FileSystem::WriteAt(pFile, pCompressed.data(), pCompressed.size(), 0);
+		if (bSuccess && (nCurrentDurability == Durability::SYNC_BATCH || nCurrentDurability == Durability::SYNC_ENTRY))
+			bSuccess = FileSystem::SyncDescriptor(pFile); // The rename must never replace the segment with data that isn't on disk yet.
+
+		FileSystem::CloseDescriptor(pFile);
+		if (bSuccess)
+		{
+			// Replaced under pMutex so that an export started meanwhile either lists the compressed segment or defers us.
+			std::lock_guard<std::mutex> lock(pMutex);
+			bSuccess = !DeferCompression(nSegment) && FileSystem::RenameFile(nTempFileName, nSegmentFileName);
+		}
+
+		if (!bSuccess)
+		{
+			FileSystem::RemoveFile(nTempFileName);
+			return;
+		}
+
+		g_nCompressionInputBytes += nSegmentSize;
+		g_nCompressionOutputBytes += pCompressed.size();
+	}
+
+	// Part of RecoverFromSegments, adds the records of the newest segment to our LogIndex.
+	void RecoverLastSegment(unsigned int nSegment)
+	{
+		char nSegmentFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nSegmentFileName);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return;
+
+		unsigned long long nFileSize = FileSystem::DescriptorSize(pFile);
+		SegmentReader pReader;
+		if (!pReader.Open(pFile, true, nFileSize))
+			return; // Not even the header was written, it'll be recreated by the next write.
+
+		if (pReader.IsCompressed()) // Only sealed segments are compressed, so it's full.
+		{
+			pIndex.nEntries += pIndex.nSegmentEntries;
+			pIndex.nTotalSize += GetSegmentRecordsSize(nSegment);
+			return;
+		}
+
+		std::string pOffsets;
+		std::string pTimes;
+		unsigned int nEntries = 0;
+		const char* pData;
+		EntrySize nSize;
+		while (nEntries < pIndex.nSegmentEntries)
+		{
+			EntryOffset nOffset = (EntryOffset)pReader.GetOffset();
+			if (pReader.ReadNext(pData, nSize) == SegmentReader::RECORD_END)
+				break;
+
+			pOffsets.append((char*)&nOffset, sizeof(nOffset));
+
+			EntryTimestamp nTimestamp = pReader.GetTimestamp();
+			if ((nEntries % TIME_INDEX_INTERVAL) == 0)
+				pTimes.append((char*)&nTimestamp, sizeof(nTimestamp));
+
+			++nEntries;
+		}
+
+		unsigned long long nEndOffset = pReader.GetOffset();
+		pReader.Close();
+
+		if (nEntries == 0)
+			return; // Only the header, it'll be recreated by the next write.
+
+		if (nFileSize > nEndOffset)
+		{
+			printf("Cut off %llu bytes of a torn write in segment %u of \"%s\"\n", nFileSize - nEndOffset, nSegment, pIndex.nIndexName);
+			FileSystem::TurnaceFile(nSegmentFileName, (unsigned int)nEndOffset);
+		}
+
+		WriteSegmentSidecar(nSegment, pLogOffsetsExtension, pOffsets);
+		WriteSegmentSidecar(nSegment, pLogTimesExtension, pTimes);
+
+		pIndex.nEntries += nEntries;
+		pIndex.nTotalSize += nEndOffset - sizeof(SegmentHeader);
+		pIndex.nActiveSegmentSize = (unsigned int)nEndOffset;
+	}
+
+	// Returns the size of all records inside the given segment, for compressed segments it's their uncompressed size.
+	unsigned long long GetSegmentRecordsSize(unsigned int nSegment)
+	{
+		char nSegmentFileName[FileSystem::MAX_PATH];
+		BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+
+		FileDescriptor_t pFile = FileSystem::OpenDescriptor(nSegmentFileName);
+		if (pFile == FileSystem::INVALID_DESCRIPTOR)
+			return 0;
+
+		unsigned long long nSegmentSize = FileSystem::DescriptorSize(pFile);
+		SegmentHeader pHeader;
+		CompressedSegmentHeader pSegmentHeader;
+		if (FileSystem::ReadAt(pFile, &pHeader, sizeof(pHeader), 0) == sizeof(pHeader) && pHeader.nRecordFormat == RECORD_FORMAT_COMPRESSED)
+		{
+			if (FileSystem::ReadAt(pFile, &pSegmentHeader, sizeof(pSegmentHeader), sizeof(pHeader)) == sizeof(pSegmentHeader))
+				nSegmentSize = pSegmentHeader.nSegmentSize;
+		}
+		FileSystem::CloseDescriptor(pFile);
+
+		return nSegmentSize > sizeof(SegmentHeader) ? nSegmentSize - sizeof(SegmentHeader) : 0;
+	}
+
+	// Previously this rewrote the entire data file to remove the oldest entries which was VERY expensive.
+	// Now we simply unlink the oldest segment which always holds exactly nSegmentEntries entries.
+	void DoEntryDeletionCycle()
+	{
+		if (pIndex.nEntries <= pIndex.nSegmentEntries)
+			return; // Not enouth entries! We'd delete the active segment.
+
+		pIndex.nTotalSize -= std::min(pIndex.nTotalSize, GetSegmentRecordsSize(pIndex.nFirstSegment));
+
+		// Readers only know the segments from nFirstSegment on, so once it's moved the files can be unlinked by the compactor.
+		CompactionJob pJob;
+		for (const char* pExtension : {pLogExtension, pLogOffsetsExtension, pLogTimesExtension, pLogTrigramsExtension, pLogBloomExtension})
+		{
+			char nSegmentFileName[FileSystem::MAX_PATH];
+			BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), pIndex.nFirstSegment, pExtension);
+			pJob.pRemoveFiles.push_back(nSegmentFileName);
+		}
+		QueueCompaction(std::move(pJob));
+
+		++pIndex.nFirstSegment;
+		pIndex.nEntries -= pIndex.nSegmentEntries;
+	}
+
+	// We got touched >:3
+	void MarkTouched()
+	{
+		nLastTouched = std::chrono::system_clock::now();
+	}
+
+public:
+	LogIndex pIndex;
+	std::mutex pMutex; // Used to lock this LogIndex while we write/read from it as we cannot guarantee safetry in our setup in any different way.
+	std::size_t pIndexHash = 0;
+	std::atomic<unsigned int> nPins = 0; // Requests & threads using us right now, we aren't unloaded while there are any. See PinnedLog.
+
+private:
+	LogIndex_V4 pSavedIndex; // What the index file on disk contains, see MarkIndexSaved.
+	std::atomic<Durability> nDurability = Durability::FLUSH; // Atomic since the compactor reads it without pMutex, see CompressSegment.
+	RetentionPolicy pRetention;
+
+	// We don't close the files instantly to heavily improve performance.
+	FileDescriptor_t pEntryFile = FileSystem::INVALID_DESCRIPTOR;
+	FileDescriptor_t pOffsetFile = FileSystem::INVALID_DESCRIPTOR; // Offsets sidecar of the segment pEntryFile has open.
+	FileDescriptor_t pTimeFile = FileSystem::INVALID_DESCRIPTOR; // Times sidecar of the segment pEntryFile has open.
+	unsigned int nEntryFileSegment = 0; // The segment pEntryFile currently has open.
+	unsigned long long nWrittenSegmentSize = 0; // How much of the active segment was actually written, pIndex.nActiveSegmentSize includes queued records.
+	unsigned long long nWrittenOffsetsSize = 0;
+	unsigned long long nWrittenTimesSize = 0;
+	EntryOffset nLastEntryOffset = 0; // Offset of the newest record inside its segment, 0 if we don't know it yet.
+
+	// Records that were queued by WriteRecord but not yet written by FlushWrites.
+	struct PendingRecord
+	{
+		char pHeader[MAX_RECORD_HEADER_SIZE]; // Already encoded
+		unsigned char nHeaderSize = 0;
+		EntrySize nSize = 0;
+		const char* pData = nullptr; // nullptr if the data was copied into pOwnedData
+		std::size_t nOwnedOffset = 0;
+	};
+	std::vector<PendingRecord> pPendingRecords;
+	std::vector<IOVector> pWriteVectors;
+	std::string pOwnedData;
+	std::string pOffsetBuffer;
+	std::string pTimeBuffer;
+	EntryTimestamp nLastTimestamp = 0; // Timestamp of the last batch we wrote.
+
+	// Trigram posting lists of the active segment, written into its ".tri" sidecar once it's sealed.
+	TrigramPostings pActiveTrigrams;
+	unsigned int nTrigramSegment = 0;
+	bool bHasActiveTrigrams = false;
+	std::vector<unsigned int> pTrigramBuffer;
+
+	// Group commit queue, see g_nGroupCommitWindow
+	std::mutex pQueueMutex;
+	std::condition_variable pQueueCondition;
+	std::vector<PendingEntry*> pPendingEntries;
+	std::size_t nPendingBytes = 0;
+	bool bHasCommitLeader = false;
+
+	// Tailing readers, see WaitForEntries. They wait using pMutex.
+	std::condition_variable pTailCondition;
+	std::atomic<unsigned int> nTailWaiters = 0;
+	std::atomic<unsigned int> nPendingCompactions = 0; // Queued CompactionJob's that reference us.
+
+	// Exports send the segment files as they are, see BeginExport. Both are guarded by pMutex.
+	unsigned int nExports = 0;
+	std::vector<unsigned int> pDeferredCompressions; // Segments CompressSegment didn't replace since they were exported.
+
+	// Last time we touched this Log entry.
+	std::chrono::system_clock::time_point nLastTouched;
+};
+
+
+// Reads the entries [nBegin, nEnd) of a Log segment by segment, the pMutex of the Log has to stay locked while it's used.
+class EntryScanner
+{
+public:
+	// nBeginOffset is the offset of nBegin inside its segment if it's already known, else it's looked up in the offsets sidecar.
+	void Open(Log* pNewLog, unsigned int nBegin, unsigned int nNewEnd, EntryOffset nBeginOffset = 0)
+	{
+		pLog = pNewLog;
+		nEntry = nBegin;
+		nEnd = std::min(nNewEnd, pLog->pIndex.nEntries);
+		nNextOffset = nBeginOffset;
+		nSegmentEntries = 0;
+	}
+
+	// Returns false once nEnd was reached. Corrupted entries are skipped but still count as read.
+	bool Next(const char*& pData, EntrySize& nSize)
+	{
+		while (nEntry < nEnd)
+		{
+			if (nSegmentEntries == 0 && !OpenSegment())
+				continue;
+
+			SegmentReader::RecordResult nResult = pReader.ReadNext(pData, nSize);
+			if (nResult == SegmentReader::RECORD_END)
+			{
+				printf("Segment %u of \"%s\" is missing %u records!\n", pLog->GetSegmentForEntry(nEntry), pLog->pIndex.nIndexName, nSegmentEntries);
+				nEntry += nSegmentEntries;
+				nSegmentEntries = 0;
+				continue;
+			}
+
+			++nEntry;
+			--nSegmentEntries;
+			if (nResult == SegmentReader::RECORD_CORRUPTED)
+			{
+				printf("Skipped corrupted entry %u of \"%s\"!\n", nEntry - 1, pLog->pIndex.nIndexName);
+				continue;
+			}
+
+			return true;
+		}
+
+		return false;
+	}
+
+	// The entry that Next will return next & its offset inside its segment, the offset is 0 if it's unknown.
+	unsigned int GetNextEntry() const { return nEntry; }
+	EntryOffset GetNextOffset() const { return nSegmentEntries > 0 ? (EntryOffset)pReader.GetOffset() : 0; }
+	// Timestamp of the entry that Next returned last.
+	EntryTimestamp GetTimestamp() const { return pReader.GetTimestamp(); }
+
+private:
+	bool OpenSegment()
+	{
+		unsigned int nSegment = pLog->GetSegmentForEntry(nEntry);
+		unsigned int nSegmentEntry = nEntry % pLog->pIndex.nSegmentEntries;
+		nSegmentEntries = std::min(nEnd - nEntry, pLog->pIndex.nSegmentEntries - nSegmentEntry);
+
+		EntryOffset nOffset = nNextOffset;
+		nNextOffset = 0;
+		if (!pLog->OpenSegmentReader(nSegment, pReader) || (nSegmentEntry > 0 && ((nOffset == 0 && !pLog->GetEntryOffset(nEntry, nOffset)) || !pReader.Seek(nOffset))))
+		{
+			printf("Failed to read segment %u of \"%s\"!\n", nSegment, pLog->pIndex.nIndexName);
+			nEntry += nSegmentEntries;
+			nSegmentEntries = 0;
+			return false;
+		}
+
+		return true;
+	}
+
+	Log* pLog = nullptr;
+	SegmentReader pReader;
+	unsigned int nEntry = 0;
+	unsigned int nEnd = 0;
+	unsigned int nSegmentEntries = 0; // Entries left to read in the open segment.
+	EntryOffset nNextOffset = 0;
+};
+
+/*
+	The loaded indexes keyed by their full name. They are split into LOADED_INDEX_SHARDS shards with their own lock each,
+	so a lookup is a single hash map lookup & requests for different indexes rarely contend for the same lock.
+*/
+static constexpr std::size_t LOADED_INDEX_SHARDS = 64;
+struct alignas(64) LoadedIndexShard // Own cache line so that the locks of neighbouring shards don't share one.
+{
+	std::shared_mutex pMutex;
+	std::unordered_map<std::string, std::unique_ptr<Log>> pLogs;
+	std::unordered_set<std::string> pLoading; // Indexes that FindOrCreateLogIndex is loading or creating right now.
+	std::condition_variable_any pLoadCondition; // Notified once one of pLoading is done.
+};
+static LoadedIndexShard g_pLoadedIndexes[LOADED_INDEX_SHARDS];
+
+static inline LoadedIndexShard& GetLoadedIndexShard(const std::string& strIndexName)
+{
+	return g_pLoadedIndexes[std::hash<std::string>{}(strIndexName) % LOADED_INDEX_SHARDS];
+}
+
+// Keeps a loaded Log from being unloaded until it goes out of scope.
+// Logs are only pinned while holding the lock of their shard, UnloadAnyNonTouchedIndexes checks nPins under its write lock.
+struct LogUnpinner
+{
+	void operator()(Log* pLog) const
+	{
+		--pLog->nPins;
+	}
+};
+typedef std::unique_ptr<Log, LogUnpinner> PinnedLog;
+
+static inline PinnedLog PinLog(Log* pLog)
+{
+	++pLog->nPins;
+	return PinnedLog(pLog);
+}
+
+static void UnloadAnyNonTouchedIndexes()
+{
+	while (true)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(INDEX_LOADED_CHECK_INTERVALS));
+
+		std::vector<Log*> pLogsToDelete;
+		for (LoadedIndexShard& pShard : g_pLoadedIndexes)
+		{
+			bool bHasIndexesToDelete = false;
+			{
+				std::shared_lock<std::shared_mutex> readLock(pShard.pMutex);
+				auto pCurrentTime = std::chrono::system_clock::now();
+				for (auto& [strName, pLog] : pShard.pLogs)
+				{
+					if (!pLog->ShouldUnload(pCurrentTime))
+						continue;
+
+					bHasIndexesToDelete = true;
+					break;
+				}
+			}
+
+			if (!bHasIndexesToDelete)
+				continue;
+
+			std::unique_lock<std::shared_mutex> writeLock(pShard.pMutex);
+			auto pCurrentTime = std::chrono::system_clock::now();
+			for (auto it = pShard.pLogs.begin(); it != pShard.pLogs.end(); )
+			{
+				if (!it->second->ShouldUnload(pCurrentTime))
+				{
+					it++;
+					continue;
+				}
+
+				// Deleting the logs in here would block everything!
+				// So we move it outside of our lock to unblock the shard
+				pLogsToDelete.push_back(it->second.release());
+				it = pShard.pLogs.erase(it);
+			}
+		}
+
+		if (pLogsToDelete.empty())
+			continue;
+
+		for (Log* pLog : pLogsToDelete)
+		{
+			printf("Unloaded Log Index \"%s\" from memory\n", pLog->pIndex.nIndexName);
+			delete pLog;
+		}
+
+		extern void CheckLogState();
+		CheckLogState();
+	}
+}
+
+static std::thread g_pLoggingIndexesThread(UnloadAnyNonTouchedIndexes);
+
+static void RunCompactions()
+{
+	while (true)
+	{
+		CompactionJob pJob;
+		{
+			std::unique_lock<std::mutex> lock(g_pCompactionMutex);
+			g_pCompactionCondition.wait(lock, [] { return !g_pCompactionQueue.empty(); });
+			pJob = std::move(g_pCompactionQueue.front());
+			g_pCompactionQueue.pop_front();
+		}
+
+		if (pJob.pLog && pJob.bVerify)
+			pJob.pLog->VerifyQueued();
+		else if (pJob.pLog)
+			pJob.pLog->CompactSegment(pJob);
+
+		for (const std::string& strFileName : pJob.pRemoveFiles)
+			FileSystem::RemoveFile(strFileName.c_str());
+	}
+}
+
+static std::thread g_pCompactionThread(RunCompactions);
+
+// Enforces the RetentionPolicy of every loaded index, unloaded ones don't get new entries & are checked once they're loaded again.
+static void EnforceRetentionOfLoadedIndexes()
+{
+	while (true)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(RETENTION_CHECK_INTERVAL));
+
+		std::vector<PinnedLog> pLogs;
+		for (LoadedIndexShard& pShard : g_pLoadedIndexes)
+		{
+			// Deleting segments takes a while, so we only pin them under the lock which keeps them from being unloaded.
+			{
+				std::shared_lock<std::shared_mutex> readLock(pShard.pMutex);
+				for (auto& [strName, pLog] : pShard.pLogs)
+					pLogs.push_back(PinLog(pLog.get()));
+			}
+
+			for (PinnedLog& pLog : pLogs)
+			{
+				unsigned int nDeleted = pLog->EnforceRetention();
+				if (nDeleted > 0)
+					printf("Deleted the %u oldest segments of \"%s\" due to its retention\n", nDeleted, pLog->pIndex.nIndexName);
+			}
+			pLogs.clear();
+		}
+	}
+}
+
+static std::thread g_pRetentionThread(EnforceRetentionOfLoadedIndexes);
+
+// Runs Log::RecoverFromSegments for every index on disk, spread across a thread per core since each index only touches its own files.
+static void RecoverIndexes()
+{
+	auto pStart = std::chrono::steady_clock::now();
+
+	std::vector<std::string> pIndexFiles;
+	std::error_code pError;
+	for (auto& pFile : std::filesystem::directory_iterator(pLogIndexesDir, pError))
+	{
+		if (!pFile.is_regular_file())
+			continue;
+
+		if (pFile.path().extension() == pLogIndexTempExtension)
+			FileSystem::RemoveFile(pFile.path().string().c_str()); // We crashed while saving it, the old index is still there.
+		else if (pFile.path().extension() == pLogExtension)
+			pIndexFiles.push_back(pFile.path().string());
+	}
+
+	extern bool IsInLogState(const char* pIndexName);
+	extern void MarkLogStateChecked(bool bRebuild);
+
+	std::atomic<std::size_t> nNextIndex = 0;
+	std::atomic<unsigned int> nRecovered = 0;
+	std::atomic<bool> bUnlisted = false;
+	auto pWorker = [&]()
+	{
+		std::size_t nIndex;
+		while ((nIndex = nNextIndex++) < pIndexFiles.size())
+		{
+			FileHandle_t pHandle = FileSystem::OpenReadFile(pIndexFiles[nIndex]);
+			LogIndex pLogIndex;
+			if (!pHandle.is_open() || !LoadLogIndex(pLogIndex, pHandle))
+			{
+				printf("Failed to read index \"%s\" for recovery\n", pIndexFiles[nIndex].c_str());
+				continue;
+			}
+			pHandle.close();
+
+			// A crash can lose the slot of an index that was just created, it would then never be found again.
+			if (!IsInLogState(pLogIndex.nIndexName))
+				bUnlisted = true;
+
+			// The Log writes the LogIndex back once it's deleted, but only if the recovery changed it.
+			std::unique_ptr<Log> pLog = std::make_unique<Log>();
+			pLog->pIndex = pLogIndex;
+			pLog->MarkIndexSaved();
+			if (pLog->RecoverFromSegments())
+				++nRecovered;
+		}
+	};
+
+	std::size_t nThreads = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), pIndexFiles.size());
+	std::vector<std::thread> pThreads;
+	for (std::size_t i = 1; i < nThreads; ++i)
+		pThreads.emplace_back(pWorker);
+
+	pWorker();
+	for (std::thread& pThread : pThreads)
+		pThread.join();
+
+	if (bUnlisted)
+		printf("Some indexes are missing from the Log state\n");
+
+	MarkLogStateChecked(bUnlisted);
+
+	printf("Checked %i indexes in %.3fs, %u had to be recovered\n", (int)pIndexFiles.size(),
+		std::chrono::duration<double>(std::chrono::steady_clock::now() - pStart).count(), (unsigned int)nRecovered);
+}
+void LogSystem::Init()
+{
+	FileSystem::CreateDirectory("logdata/data");
+	FileSystem::CreateDirectory("logdata/indexes");
+	FileSystem::SyncDirectory("logdata");
+
+	g_nGroupCommitWindow = CommandLine::GetParamInt("-groupcommitwindow", (int)g_nGroupCommitWindow);
+	int nGroupCommitBytes = CommandLine::GetParamInt("-groupcommitbytes", (int)g_nGroupCommitBytes);
+	if (nGroupCommitBytes >= 0)
+		g_nGroupCommitBytes = nGroupCommitBytes;
+	else
+		printf("Invalid \"-groupcommitbytes\" given! Expected a positive number of bytes\n");
+
+	if (CommandLine::HasParam("-durability") && !ParseDurability(CommandLine::GetParamString("-durability"), g_nDefaultDurability))
+		printf("Invalid \"-durability\" given! Expected none, flush, fdatasync-batch or fdatasync-entry\n");
+
+	g_pDurabilityRules = Util::ParseIndexRules(CommandLine::GetParamString("-durabilityrules"));
+
+	if (CommandLine::HasParam("-retention") && !ParseRetention(CommandLine::GetParamString("-retention"), g_pDefaultRetention))
+		printf("Invalid \"-retention\" given! Expected something like entries:16384,bytes:512m,age:7d\n");
+
+	g_pRetentionRules = Util::ParseIndexRules(CommandLine::GetParamString("-retentionrules"));
+
+	FileSystem::InitIOEngine(!CommandLine::HasParam("-noiouring"));
+
+	g_bCompression = !CommandLine::HasParam("-nocompression");
+	g_bVerifyOnLoad = CommandLine::HasParam("-verifyonload");
+	g_bTrigramIndex = !CommandLine::HasParam("-notrigrams");
+
+	if (!CommandLine::HasParam("-norecovery"))
+		RecoverIndexes();
+
+	printf("Using %s CRC32C\n", Checksum::HasHardwareCRC32C() ? "hardware (SSE4.2)" : "software");
+	printf("Using %s substring search\n", StringSearch::GetInstructionSet());
+
+	Util::SetThreadName(g_pLoggingIndexesThread, "UnloadAnyNonTouchedIndexes");
+	Util::SetThreadName(g_pRetentionThread, "EnforceRetentionOfLoadedIndexes");
+	Util::SetThreadName(g_pCompactionThread, "RunCompactions");
+}
+
+#ifdef LOGSYSTEM_MULTIPLE_KEYS
+static Log* FindOrCreateLogIndex(const std::unordered_map<std::string, std::string>& entryKeys)
+{
+	{
+		std::shared_lock<std::shared_mutex> readLock(g_LogIndexesMutex);
+		for (Log& pLog : g_pLogIndexes)
+		{
+			LogIndex& pIndex = pLog.pIndex;
+			if (pIndex.nKeys == 0)
+				continue; // Useless.
+
+			if (pIndex.nKeys != entryKeys.size())
+				continue; // Different entryKeys!
+
+			bool bMatches = true; // All the keys have to match!
+			for (int nKey = 0; nKey < pIndex.nKeys; ++nKey)
+			{
+				const LogKey& pKey = pIndex.nKeysData[nKey];
+				auto it = entryKeys.find(pKey.nKeyName);
+				if (it == entryKeys.end())
+				{
+					bMatches = false;
+					break; // Key doesn't match. GG
+				}
+
+				if (it->second != pKey.nKeyValue)
+				{
+					bMatches = false;
+					break; // Value doesn't match. Another GG
+				}
+			}
+
+			if (bMatches)
+				return pLog;
+		}
+	}
+
+	std::unique_lock<std::shared_mutex> writeLock(g_LogIndexesMutex);
+	return g_pLogIndexes.emplace_back();
+}
+
+// Every entryKeys is limited by Util::ReadFakeJson to 64 characters per key or value & in total they can be 512 characters.
+static void FillLogIndexKeys(LogIndex& pIndex, const std::unordered_map<std::string, std::string>& entryKeys)
+{
+	// If it already has keys, we can skip since for the LogIndex to be picked all keys had to match
+	if (pIndex.nKeys > 0)
+		return;
+
+	for (auto& [key, val] : entryKeys)
+	{
+		const LogKey& pKey = pIndex.nKeysData[nKey];
+		auto it = entryKeys.find(pKey.nKeyName);
+		if (it == entryKeys.end())
+			continue; // Key doesn't match. GG
+
+		if (it->second == pKey.nKeyValue)
+			return pLog; // We found our index.
+	}
+}
+#endif
+
+/*
+	logdata/state.dat maps the hash of an index name to the file id of its LogIndex, so an index that isn't loaded can be found without reading every index file.
+	It's an open addressing hash table with linear probing which we keep mapped into memory, a lookup touches one or two cache lines & no syscall.
+	Layout: [LogStateHeader][LogStateSlot * nCapacity], a slot with a hash of 0 is empty.
+	New slots are written into the file directly, the mapping is shared so it sees them right away.
+	Once more than half of the slots are used, the table is rebuilt with twice the capacity.
+*/
+static constexpr unsigned int LOG_STATE_MAGIC = 0x54534C48; // "HLST"
+static constexpr unsigned int LOG_STATE_VERSION = 1;
+static constexpr unsigned long long LOG_STATE_MIN_CAPACITY = 1024; // Needs to be a power of 2
+static constexpr const char* pLogStateFile = "logdata/state.dat";
+static constexpr const char* pLogStateTempFile = "logdata/state.tmp";
+
+struct LogStateHeader
+{
+	unsigned int nMagic = LOG_STATE_MAGIC;
+	unsigned int nVersion = LOG_STATE_VERSION;
+	unsigned long long nCapacity = 0;
+	unsigned long long nUsed = 0;
+	unsigned long long nReserved = 0;
+};
+static_assert(sizeof(LogStateHeader) == 32, "LogStateHeader needs to be 32 bytes so that no slot crosses a cache line");
+
+struct LogStateSlot
+{
+	unsigned long long nHash = 0;
+	UniqueFilenameId pFileID;
+	char nPadding[32 - sizeof(unsigned long long) - sizeof(UniqueFilenameId)] = {0};
+};
+static_assert(sizeof(LogStateSlot) == 32, "LogStateSlot needs to be 32 bytes so that no slot crosses a cache line");
+
+// 0 marks an empty slot so an index name that actually hashes to 0 is moved to 1.
+static inline unsigned long long GetLogStateHash(std::size_t nHash)
+{
+	return nHash != 0 ? (unsigned long long)nHash : 1;
+}
+
+struct LogState
+{
+	LogState()
+	{
+		CheckState();
+	}
+
+	~LogState()
+	{
+		Close();
+	}
+
+	enum FindResult
+	{
+		FIND_NOT_FOUND = 0, // There is no such index, it can be created.
+		FIND_LOADED = 1,
+		FIND_FAILED = 2, // The index exists but couldn't be loaded, it must not be replaced by a new one.
+	};
+
+	FindResult FindLog(const std::string entryKey, Log*& pLog, bool bSecondCall = false)
+	{
+		pLog = nullptr;
+		UniqueFilenameId pIndexID;
+		std::size_t pKeyHash = std::hash<std::string>{}(entryKey);
+		if (!GetIndex(pKeyHash, pIndexID))
+		{
+			printf("Failed to find Log index \"%s\" in state\n", entryKey.c_str());
+			return FIND_NOT_FOUND;
+		}
+
+		char nIndexFileName[FileSystem::MAX_PATH];
+		std::memcpy(nIndexFileName, pLogIndexesDir, pLogIndexesDirLength);
+		int nWritten = Util::WriteUniqueFilenameIntoBuffer(pIndexID, nIndexFileName + pLogIndexesDirLength, sizeof(nIndexFileName) - pLogIndexesDirLength);
+		std::memcpy(nIndexFileName + pLogIndexesDirLength + nWritten, pLogExtension, pLogExtensionLength);
+		nIndexFileName[pLogIndexesDirLength + nWritten + pLogExtensionLength] = '\0';
+
+		FileHandle_t pFile = FileSystem::OpenReadFile(nIndexFileName);
+		if (!pFile.is_open())
+		{
+			printf("Failed to open Log index \"%s\" from state!\n", entryKey.c_str());
+			if (bSecondCall)
+				return FIND_FAILED; // The rebuilt state still has it, so its file exists.
+
+			RebuildState();
+			return FindLog(entryKey, pLog, true); // Recursion... Yay
+		}
+
+		pLog = new Log();
+		if (!LoadLogIndex(pLog->pIndex, pFile))
+		{
+			printf("Failed to read Log index \"%s\" from state!\n", entryKey.c_str());
+			pFile.close();
+			pLog->MarkIndexSaved(); // Don't overwrite the index file with what we failed to read.
+			delete pLog;
+			pLog = nullptr;
+			return FIND_FAILED;
+		}
+		pFile.close();
+		pLog->MarkIndexSaved();
+		pLog->SetIndexHash(pKeyHash);
+
+		// Its legacy data file is kept, so the migration is tried again with the next request.
+		if (pLog->pIndex.version != INDEX_VERSION_LATEST && !pLog->MigrateLegacyDataFile())
+		{
+			delete pLog;
+			pLog = nullptr;
+			return FIND_FAILED;
+		}
+
+		return FIND_LOADED;
+	}
+
+	bool GetIndex(const std::size_t pKeyHash, UniqueFilenameId& pIndexID)
+	{
+		{
+			std::shared_lock<std::shared_mutex> readLock(pMutex);
+			if (pView.pData)
+				return FindSlot(GetLogStateHash(pKeyHash), pIndexID);
+		}
+
+		std::unique_lock<std::shared_mutex> writeLock(pMutex);
+		if (!EnsureOpen())
+			return false;
+
+		return FindSlot(GetLogStateHash(pKeyHash), pIndexID);
+	}
+
+	// Returns false if it couldn't be written or the name already has a slot, an existing index is never replaced.
+	// bSync forces the slot onto the disk, else a crash can lose it & the index can no longer be found.
+	bool AddEntryToList(const std::string& pIndexName, const UniqueFilenameId& pIndexFileID, bool bSync)
+	{
+		std::unique_lock<std::shared_mutex> writeLock(pMutex);
+		if (!EnsureOpen())
+			return false;
+
+		unsigned long long nHash = GetLogStateHash(std::hash<std::string>{}(pIndexName));
+		const LogStateHeader* pHeader = GetHeader();
+		if ((pHeader->nUsed + 1) * 2 > pHeader->nCapacity)
+		{
+			std::vector<LogStateSlot> pSlots;
+			CollectSlots(pSlots);
+			if (!WriteState(pSlots, pHeader->nCapacity * 2))
+				return false;
+
+			pHeader = GetHeader();
+		}
+
+		unsigned long long nMask = pHeader->nCapacity - 1;
+		unsigned long long nSlot = nHash & nMask;
+		unsigned long long nProbes = 0;
+		const LogStateSlot* pSlots = GetSlots();
+		while (pSlots[nSlot].nHash != 0 && pSlots[nSlot].nHash != nHash)
+		{
+			if (++nProbes == pHeader->nCapacity)
+				return false; // Full which can only happen if someone messed with the file.
+
+			nSlot = (nSlot + 1) & nMask;
+		}
+
+		// FindLog rebuilds the state if the index file of a slot is gone, so a slot that is still here belongs to an index that exists.
+		if (pSlots[nSlot].nHash != 0)
+		{
+			printf("Log index \"%s\" already exists in the state!\n", pIndexName.c_str());
+			return false;
+		}
+
+		LogStateSlot pSlot;
+		pSlot.nHash = nHash;
+		pSlot.pFileID = pIndexFileID;
+		if (!FileSystem::WriteAt(pStateFile, &pSlot, sizeof(pSlot), sizeof(LogStateHeader) + nSlot * sizeof(LogStateSlot)))
+		{
+			printf("Failed to write Log index \"%s\" into the state!\n", pIndexName.c_str());
+			return false;
+		}
+
+		unsigned long long nUsed = pHeader->nUsed + 1;
+		FileSystem::WriteAt(pStateFile, &nUsed, sizeof(nUsed), offsetof(LogStateHeader, nUsed));
+		if (bSync && !FileSystem::SyncDescriptor(pStateFile))
+		{
+			printf("Failed to sync Log index \"%s\" into the state!\n", pIndexName.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+private:
+	FileDescriptor_t pStateFile = FileSystem::INVALID_DESCRIPTOR;
+	MappedView pView;
+	std::shared_mutex pMutex;
+
+	const LogStateHeader* GetHeader() const
+	{
+		return (const LogStateHeader*)pView.pData;
+	}
+
+	const LogStateSlot* GetSlots() const
+	{
+		return (const LogStateSlot*)(pView.pData + sizeof(LogStateHeader));
+	}
+
+	bool FindSlot(unsigned long long nHash, UniqueFilenameId& pIndexID) const
+	{
+		unsigned long long nCapacity = GetHeader()->nCapacity;
+		const LogStateSlot* pSlots = GetSlots();
+		unsigned long long nSlot = nHash & (nCapacity - 1);
+		for (unsigned long long nProbes = 0; nProbes < nCapacity && pSlots[nSlot].nHash != 0; ++nProbes, nSlot = (nSlot + 1) & (nCapacity - 1))
+		{
+			if (pSlots[nSlot].nHash == nHash)
+			{
+				pIndexID = pSlots[nSlot].pFileID;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void CollectSlots(std::vector<LogStateSlot>& pSlots) const
+	{
+		const LogStateHeader* pHeader = GetHeader();
+		const LogStateSlot* pCurrentSlots = GetSlots();
+		pSlots.reserve(pHeader->nUsed);
+		for (unsigned long long nSlot = 0; nSlot < pHeader->nCapacity; ++nSlot)
+		{
+			if (pCurrentSlots[nSlot].nHash != 0)
+				pSlots.push_back(pCurrentSlots[nSlot]);
+		}
+	}
+
+	void Close()
+	{
+		FileSystem::UnmapView(pView);
+		if (pStateFile != FileSystem::INVALID_DESCRIPTOR)
+		{
+			FileSystem::CloseDescriptor(pStateFile);
+			pStateFile = FileSystem::INVALID_DESCRIPTOR;
+		}
+	}
+
+	// Opens & maps the state file, returns false if it's missing or isn't a valid table.
+	bool OpenState()
+	{
+		Close();
+		if (!FileSystem::FileExists(pLogStateFile))
+			return false;
+
+		pStateFile = FileSystem::OpenDescriptor(pLogStateFile);
+		if (pStateFile == FileSystem::INVALID_DESCRIPTOR)
+			return false;
+
+		LogStateHeader pHeader;
+		unsigned long long nFileSize = FileSystem::DescriptorSize(pStateFile);
+		if (FileSystem::ReadAt(pStateFile, &pHeader, sizeof(pHeader), 0) != sizeof(pHeader)
+			|| pHeader.nMagic != LOG_STATE_MAGIC || pHeader.nVersion != LOG_STATE_VERSION
+			|| pHeader.nCapacity < LOG_STATE_MIN_CAPACITY || (pHeader.nCapacity & (pHeader.nCapacity - 1)) != 0
+			|| pHeader.nUsed >= pHeader.nCapacity || nFileSize != sizeof(LogStateHeader) + pHeader.nCapacity * sizeof(LogStateSlot))
+		{
+			Close();
+			return false;
+		}
+
+		if (!FileSystem::MapDescriptor(pStateFile, (std::size_t)nFileSize, pView, true))
+		{
+			Close();
+			return false;
+		}
+
+		return true;
+	}
+
+	// Writes a new table into a temp file & then switches it with the current one so a crash never leaves a half written state behind.
+	bool WriteState(const std::vector<LogStateSlot>& pEntries, unsigned long long nCapacity)
+	{
+		while (nCapacity < LOG_STATE_MIN_CAPACITY || nCapacity < pEntries.size() * 2)
+			nCapacity = nCapacity < LOG_STATE_MIN_CAPACITY ? LOG_STATE_MIN_CAPACITY : nCapacity * 2;
+
+		LogStateHeader pHeader;
+		pHeader.nCapacity = nCapacity;
+		std::vector<LogStateSlot> pSlots(nCapacity);
+		unsigned long long nMask = nCapacity - 1;
+		for (const LogStateSlot& pEntry : pEntries)
+		{
+			unsigned long long nSlot = pEntry.nHash & nMask;
+			while (pSlots[nSlot].nHash != 0 && pSlots[nSlot].nHash != pEntry.nHash)
+				nSlot = (nSlot + 1) & nMask;
+
+			if (pSlots[nSlot].nHash != 0)
+				continue; // Two index files share a name, the first one wins like it did with the old list.
+
+			pSlots[nSlot] = pEntry;
+			++pHeader.nUsed;
+		}
+
+		FileDescriptor_t pTempFile = FileSystem::OpenDescriptor(pLogStateTempFile, true, true);
+		if (pTempFile == FileSystem::INVALID_DESCRIPTOR)
+		{
+			printf("Failed to write Log state!\n");
+			return false;
+		}
+
+		IOVector pVectors[2] = {
+			{ &pHeader, sizeof(pHeader) },
+			{ pSlots.data(), pSlots.size() * sizeof(LogStateSlot) },
+		};
+		bool bWritten = FileSystem::WriteVectorAt(pTempFile, pVectors, 2, 0) && FileSystem::SyncDescriptor(pTempFile);
+		FileSystem::CloseDescriptor(pTempFile);
+
+		Close(); // Windows won't let us replace a file that is still mapped
+		if (!bWritten || !FileSystem::RenameFile(pLogStateTempFile, pLogStateFile))
+		{
+			printf("Failed to write Log state!\n");
+			FileSystem::RemoveFile(pLogStateTempFile);
+			OpenState();
+			return false;
+		}
+
+		FileSystem::SyncDirectory("logdata"); // Rare enouth that we don't care which durability is used.
+		return OpenState();
+	}
+
+	bool EnsureOpen()
+	{
+		if (pView.pData)
+			return true;
+
+		if (OpenState())
+			return true;
+
+		if (!FileSystem::FileExists(pLogIndexesDir))
+			return false; // Init didn't create our folders yet.
+
+		return RebuildFromIndexes(); // Missing, broken or still the old flat list.
+	}
+
+	// Only called while holding the write lock.
+	bool RebuildFromIndexes()
+	{
+		printf("Rebuilding Log state...\n");
+
+		std::vector<LogStateSlot> pEntries;
+		std::error_code pError;
+		for (auto& pFile : std::filesystem::recursive_directory_iterator(pLogIndexesDir, pError))
+		{
+			if (!pFile.is_regular_file() || pFile.path().extension() != pLogExtension)
+				continue;
+
+			FileHandle_t pIndexHandle = FileSystem::OpenReadFile(pFile.path().string());
+			if (!pIndexHandle.is_open())
+			{
+				printf("Failed to open index \"%s\"\n", pFile.path().string().c_str());
+				continue;
+			}
+
+			LogIndex pLogIndex;
+			if (!LoadLogIndex(pLogIndex, pIndexHandle))
+			{
+				printf("Failed to read index \"%s\"\n", pFile.path().string().c_str());
+				continue;
+			}
+
+			std::string pFileName = pFile.path().string().substr(pLogIndexesDirLength);
+			pFileName.erase(pFileName.size() - pLogExtensionLength); // Nuke .dat
+
+			LogStateSlot& pEntry = pEntries.emplace_back();
+			Util::ReadUniqueFilenameFromBuffer(pFileName.c_str(), pEntry.pFileID);
+			pEntry.nHash = GetLogStateHash(std::hash<std::string>{}(pLogIndex.nIndexName));
+		}
+
+		return WriteState(pEntries, LOG_STATE_MIN_CAPACITY);
+	}
+
+public:
+	/*
+		In a current unknown race condition our state file can become corrupted.
+		If that happens, the hashes and filenameIDs won't match causing possible issues.
+		It's also rebuilt if an index file isn't in it, since a crash can lose slots that weren't synced.
+	*/
+	void RebuildState()
+	{
+		std::unique_lock<std::shared_mutex> writeLock(pMutex);
+		Close();
+		if (!FileSystem::FileExists(pLogIndexesDir))
+			return;
+
+		RebuildFromIndexes();
+	}
+
+	// Only rebuilds the state if it's missing or broken since new indexes are added to it once they're created.
+	void CheckState()
+	{
+		std::unique_lock<std::shared_mutex> writeLock(pMutex);
+		EnsureOpen();
+	}
+};
+
+static LogState g_pLogState;
+void CheckLogState()
+{
+	g_pLogState.CheckState();
+}
+
+bool IsInLogState(const char* pIndexName)
+{
+	UniqueFilenameId pIndexID;
+	return g_pLogState.GetIndex(std::hash<std::string>{}(pIndexName), pIndexID);
+}
+
+// Set once the state was checked against every index file on disk, see RecoverIndexes.
+static std::atomic<bool> g_bLogStateChecked = false;
+void MarkLogStateChecked(bool bRebuild)
+{
+	if (bRebuild)
+		g_pLogState.RebuildState();
+
+	g_bLogStateChecked = true;
+}
+
+// Part of FindOrCreateLogIndex, runs without the lock of the shard. The returned Log isn't loaded yet.
+static Log* LoadOrCreateLogIndex(const std::string& pKey, bool bCreate)
+{
+	// With -norecovery nothing checked yet that every index file on disk is in the state, so we do before the first index could be created.
+	if (bCreate && !g_bLogStateChecked)
+		MarkLogStateChecked(true);
+
+	Log* pLog = nullptr;
+	LogState::FindResult nResult = g_pLogState.FindLog(pKey, pLog);
+	if (nResult == LogState::FIND_FAILED)
+		return nullptr; // Creating it would make the existing index unreachable.
+
+	if (pLog)
+	{
+		pLog->SetDurability(GetDurabilityForIndex(pLog->pIndex.nIndexName));
+		pLog->SetRetention(GetRetentionForIndex(pLog->pIndex.nIndexName));
+		pLog->QueueMissingCompactions();
+		if (g_bVerifyOnLoad)
+			pLog->QueueVerify();
+
+		printf("Loaded Log Index \"%s\" from state\n", pLog->pIndex.nIndexName);
+		return pLog;
+	}
+
+	if (!bCreate)
+		return nullptr;
+
+	pLog = new Log();
+	pLog->SetIndexName(pKey);
+	Durability nDurability = GetDurabilityForIndex(pKey);
+	pLog->SetDurability(nDurability);
+	pLog->SetRetention(GetRetentionForIndex(pKey));
+	if (!g_pLogState.AddEntryToList(pKey, pLog->pIndex.nFileName, nDurability == Durability::SYNC_BATCH || nDurability == Durability::SYNC_ENTRY)) // Save it into our state for disk based lookups
+	{
+		pLog->MarkIndexSaved(); // Nothing may point at it, so it must not leave an index file behind.
+		delete pLog;
+		return nullptr;
+	}
+
+	printf("Created a new Log Index \"%s\"\n", pKey.c_str());
+	return pLog;
+}
+
+// The returned Log stays loaded until the PinnedLog goes out of scope.
+static PinnedLog FindOrCreateLogIndex(const std::string& entryKey, bool bCreate = true)
+{
+	std::string pKey = entryKey.substr(0, MAX_KEY_SIZE - 1); // Limit it to MAX_KEY_SIZE
+	LoadedIndexShard& pShard = GetLoadedIndexShard(pKey);
+	{
+		std::shared_lock<std::shared_mutex> readLock(pShard.pMutex);
+		auto it = pShard.pLogs.find(pKey);
+		if (it != pShard.pLogs.end())
+			return PinLog(it->second.get());
+	}
+
+	// Only one request loads or creates an index, others wait for it without holding the lock since a migration can take a while.
+	{
+		std::unique_lock<std::shared_mutex> writeLock(pShard.pMutex);
+		while (true)
+		{
+			auto it = pShard.pLogs.find(pKey);
+			if (it != pShard.pLogs.end())
+				return PinLog(it->second.get()); // Someone else was faster.
+
+			if (pShard.pLoading.insert(pKey).second)
+				break;
+
+			pShard.pLoadCondition.wait(writeLock);
+		}
+	}
+
+	Log* pLog = LoadOrCreateLogIndex(pKey, bCreate);
+
+	PinnedLog pPinnedLog;
+	{
+		std::unique_lock<std::shared_mutex> writeLock(pShard.pMutex);
+		pShard.pLoading.erase(pKey);
+		if (pLog)
+		{
+			pShard.pLogs.emplace(pKey, std::unique_ptr<Log>(pLog));
+			pPinnedLog = PinLog(pLog);
+		}
+	}
+	pShard.pLoadCondition.notify_all();
+
+	return pPinnedLog;
+}
+
+// The entryData is limited by the httpserver payload limit inside of HttpServer::Start (-maxpayload)
+bool LogSystem::AddEntry(const std::string& entryKey, const std::string& entryData)
+{
+	PinnedLog pLog = FindOrCreateLogIndex(entryKey);
+	if (!pLog)
+		return false;
+
+	return pLog->AddEntry(entryData);
+}
+
+bool LogSystem::GetEntry(const std::string& entryKey, unsigned int nIndex, std::string& pOutput)
+{
+	PinnedLog pLog = FindOrCreateLogIndex(entryKey, false);
+	if (!pLog)
+		return false;
+
+	std::unique_lock<std::mutex> writeLock(pLog->pMutex);
+	pLog->PrepareRead();
+	return pLog->ReadEntry(nIndex, pOutput);
+}
+
+void LogSystem::GetLastEntry(const std::string& entryKey, std::string& pOutput)
+{
+	PinnedLog pLog = FindOrCreateLogIndex(entryKey, false);
+	if (!pLog)
+	{
+		pOutput = "";
+		return;
+	}
+
+	std::unique_lock<std::mutex> writeLock(pLog->pMutex);
+	pLog->PrepareRead();
+	if (!pLog->ReadLastEntry(pOutput))
+		pOutput = "";
+}
+
+// Cursors use absolute entry numbers (counted from the very first entry of the index) so that deletion cycles don't shift them.
+static constexpr std::size_t CURSOR_LENGTH = 24; // 16 hex digits for the entry, 8 for its offset inside its segment.
+static std::string EncodeCursor(unsigned long long nEntry, EntryOffset nOffset)
+{
+	char pBuffer[CURSOR_LENGTH + 1];
+	std::snprintf(pBuffer, sizeof(pBuffer), "%016llx%08x", nEntry, nOffset);
+	return pBuffer;
+}
+
+bool LogSystem::ParseCursor(const std::string& strCursor, EntryQuery& pQuery)
+{
+	if (strCursor.length() != CURSOR_LENGTH || strCursor.find_first_not_of("0123456789abcdef") != std::string::npos)
+		return false;
+
+	pQuery.bHasCursor = true;
+	pQuery.nCursorEntry = std::strtoull(strCursor.substr(0, 16).c_str(), nullptr, 16);
+	pQuery.nCursorOffset = (unsigned int)std::strtoul(strCursor.substr(16).c_str(), nullptr, 16);
+	return true;
+}
+
+// Neither format allocates anything besides growing pOutput.
+static inline void AppendEntry(std::string& pOutput, const char* pData, EntrySize nSize, LogSystem::EntryFormat nFormat)
+{
+	if (nFormat == LogSystem::ENTRY_FORMAT_BINARY)
+	{
+		char pSize[4] = {(char)(nSize & 0xFF), (char)((nSize >> 8) & 0xFF), (char)((nSize >> 16) & 0xFF), (char)((nSize >> 24) & 0xFF)};
+		pOutput.append(pSize, sizeof(pSize));
+		pOutput.append(pData, nSize);
 		return;
+	}
 
-	for (auto& [key, val] : entryKeys)
+	if (nFormat == LogSystem::ENTRY_FORMAT_EVENT_STREAM)
 	{
-		const LogKey& pKey = pIndex.nKeysData[nKey];
-		auto it = entryKeys.find(pKey.nKeyName);
-		if (it == entryKeys.end())
-			continue; // Key doesn't match. GG
+		// Any of \r\n, \r & \n ends a line in an event stream.
+		std::size_t nLineStart = 0;
+		for (std::size_t i=0; i<=nSize; ++i)
+		{
+			if (i < nSize && pData[i] != '\r' && pData[i] != '\n')
+				continue;
 
-		if (it->second == pKey.nKeyValue)
-			return pLog; // We found our index.
+			pOutput.append("data: ", 6);
+			pOutput.append(pData + nLineStart, i - nLineStart);
+			pOutput.push_back('\n');
+			if (i + 1 < nSize && pData[i] == '\r' && pData[i + 1] == '\n')
+				++i;
+
+			nLineStart = i + 1;
+		}
+		pOutput.push_back('\n');
+		return;
 	}
+
+	char pNumber[16];
+	char* pEnd = std::to_chars(pNumber, pNumber + sizeof(pNumber), nSize).ptr;
+	*pEnd++ = '\0';
+	pOutput.append(pNumber, pEnd - pNumber);
+	pOutput.append(pData, nSize);
+	pOutput.push_back('\0');
 }
-#endif
 
-struct LogState
+unsigned int LogSystem::GetEntries(const std::string& entryKey, std::string& pOutput, const EntryQuery& pQuery, std::string* pNextCursor)
 {
-	LogState()
-	{
-		CheckState();
-	}
+	pOutput = "";
+	if (pNextCursor)
+		pNextCursor->clear();
 
-	Log* FindLog(const std::string entryKey, bool bSecondCall = false)
+	PinnedLog pLog = FindOrCreateLogIndex(entryKey, false);
+	if (!pLog)
+		return 0;
+
+	std::unique_lock<std::mutex> writeLock(pLog->pMutex); // Lock it just in case any writes try to come in.
+	pLog->PrepareRead();
+
+	// Only entries in [nBegin, nEnd) can match, the time range only narrows it down to TIME_INDEX_INTERVAL.
+	unsigned int nEntries = pLog->pIndex.nEntries;
+	unsigned int nBegin = pLog->FindEntryForTimestamp(pQuery.nFrom);
+	unsigned int nEnd = nEntries;
+	if (pQuery.nTo != ULLONG_MAX)
+		nEnd = pLog->FindEntryForTimestamp(pQuery.nTo + 1, true);
+
+	unsigned long long nBaseEntry = (unsigned long long)pLog->pIndex.nFirstSegment * pLog->pIndex.nSegmentEntries;
+	EntryOffset nBeginOffset = 0;
+	if (pQuery.bHasCursor)
 	{
-		UniqueFilenameId pIndexID;
-		std::size_t pKeyHash = std::hash<std::string>{}(entryKey);
-		if (!GetIndex(pKeyHash, pIndexID))
+		// If the entry of the cursor was already deleted, we continue at the oldest one we still have.
+		unsigned int nCursorEntry = 0;
+		if (pQuery.nCursorEntry >= nBaseEntry)
+			nCursorEntry = (unsigned int)std::min<unsigned long long>(pQuery.nCursorEntry - nBaseEntry, nEntries);
+
+		if (pQuery.bNewestFirst)
 		{
-			printf("Failed to find Log index \"%s\" in state\n", entryKey.c_str());
-			return nullptr;
+			nEnd = std::min(nEnd, nCursorEntry);
+		} else if (nCursorEntry >= nBegin) {
+			nBegin = nCursorEntry;
+			if (pQuery.nCursorEntry >= nBaseEntry)
+				nBeginOffset = pLog->ValidateCursorOffset(nBegin, pQuery.nCursorOffset);
 		}
+	} else if (pQuery.bNewestFirst) {
+		nEnd = std::min(nEnd, nEntries - std::min(pQuery.nOffset, nEntries));
+	} else {
+		nBegin = std::max(nBegin, pQuery.nOffset);
+	}
 
-		char nIndexFileName[FileSystem::MAX_PATH];
-		std::memcpy(nIndexFileName, pLogIndexesDir, pLogIndexesDirLength);
-		int nWritten = Util::WriteUniqueFilenameIntoBuffer(pIndexID, nIndexFileName + pLogIndexesDirLength, sizeof(nIndexFileName) - pLogIndexesDirLength);
-		std::memcpy(nIndexFileName + pLogIndexesDirLength + nWritten, pLogExtension, pLogExtensionLength);
-		nIndexFileName[pLogIndexesDirLength + nWritten + pLogExtensionLength] = '\0';
+	if (pQuery.nEndEntry < nBaseEntry + nEnd)
+		nEnd = pQuery.nEndEntry > nBaseEntry ? (unsigned int)(pQuery.nEndEntry - nBaseEntry) : 0;
 
-		FileHandle_t pFile = FileSystem::OpenReadFile(nIndexFileName);
-		if (!pFile.is_open())
+	const char* pData;
+	EntrySize nSize;
+	EntryScanner pScanner;
+	if (!pQuery.bNewestFirst)
+	{
+		// Without a time range or limit we know exactly how much we'll need.
+		if (pQuery.nFrom == 0 && pQuery.nTo == ULLONG_MAX && pQuery.nLimit == 0 && pQuery.nMaxBytes == 0 && nBegin == 0)
+			pOutput.reserve(2 + pLog->pIndex.nTotalSize + (8 * pLog->pIndex.nEntries));
+
+		unsigned int nReturned = 0;
+		pScanner.Open(pLog.get(), nBegin, nEnd, nBeginOffset);
+		while (pScanner.Next(pData, nSize))
 		{
-			printf("Failed to open Log index \"%s\" from state!\n", entryKey.c_str());
-			if (bSecondCall)
-				return nullptr;
+			EntryTimestamp nTimestamp = pScanner.GetTimestamp();
+			if (nTimestamp < pQuery.nFrom)
+				continue;
 
-			RebuildState();
-			return FindLog(entryKey, true); // Recursion... Yay
-		}
+			if (nTimestamp > pQuery.nTo)
+				break; // Everything after it is newer
 
-		Log* pLog = new Log();
-		pFile.read((char*)&pLog->pIndex, sizeof(LogIndex));
-		pFile.close();
-		pLog->SetIndexHash(pKeyHash);
+			AppendEntry(pOutput, pData, nSize, pQuery.nFormat);
+			if (++nReturned == pQuery.nLimit || (pQuery.nMaxBytes > 0 && pOutput.size() >= pQuery.nMaxBytes))
+			{
+				if (pNextCursor && pScanner.GetNextEntry() < nEnd)
+					*pNextCursor = EncodeCursor(nBaseEntry + pScanner.GetNextEntry(), pScanner.GetNextOffset());
 
-		return pLog;
+				break;
+			}
+		}
+
+		return nReturned;
 	}
 
-	bool GetIndex(const std::size_t pKeyHash, UniqueFilenameId& pIndexID)
+	// Records can only be read forwards, so we read the page in chunks starting at its end & append each chunk reversed.
+	// With nMaxBytes only the newest entries of a chunk that reach it are kept, older ones are dropped while the chunk is read.
+	static constexpr unsigned int NEWEST_FIRST_CHUNK_ENTRIES = 1024;
+	struct ChunkEntry
 	{
-		std::shared_lock<std::shared_mutex> readLock(pMutex);
-		if (!EnsureOpen())
-			return false;
-
-		pReadStateFile.seekg(0);
-		while (true)
+		std::size_t nOffset; // Where the entry starts inside pChunk
+		unsigned int nEntry;
+	};
+	std::string pChunk;
+	std::vector<ChunkEntry> pChunkEntries;
+	unsigned int nReturned = 0;
+	while (nEnd > nBegin && (pQuery.nLimit == 0 || nReturned < pQuery.nLimit) && (pQuery.nMaxBytes == 0 || pOutput.size() < pQuery.nMaxBytes))
+	{
+		unsigned int nChunkEntries = pQuery.nLimit == 0 ? NEWEST_FIRST_CHUNK_ENTRIES : pQuery.nLimit - nReturned;
+		unsigned int nChunkBegin = nEnd - std::min(nEnd - nBegin, nChunkEntries);
+		std::size_t nBudget = pQuery.nMaxBytes > 0 ? pQuery.nMaxBytes - pOutput.size() : 0;
+
+		pChunk.clear();
+		pChunkEntries.clear();
+		std::size_t nFirstKept = 0;
+		pScanner.Open(pLog.get(), nChunkBegin, nEnd);
+		while (pScanner.Next(pData, nSize))
 		{
-			std::size_t pHash;
-			pReadStateFile.read((char*)&pHash, sizeof(pHash));
-			if (pReadStateFile.gcount() != sizeof(pHash))
-				break;
+			EntryTimestamp nTimestamp = pScanner.GetTimestamp();
+			if (nTimestamp < pQuery.nFrom || nTimestamp > pQuery.nTo)
+				continue;
+
+			pChunkEntries.push_back({pChunk.size(), pScanner.GetNextEntry() - 1});
+			AppendEntry(pChunk, pData, nSize, pQuery.nFormat);
+			if (nBudget == 0)
+				continue;
+
+			while (nFirstKept + 1 < pChunkEntries.size() && pChunk.size() - pChunkEntries[nFirstKept + 1].nOffset >= nBudget)
+				++nFirstKept; // The newer entries alone already reach the budget.
 
-			if (pHash == pKeyHash)
+			std::size_t nDropped = pChunkEntries[nFirstKept].nOffset;
+			if (nDropped > pChunk.size() / 2) // Only every now and then so that moving the rest stays cheap.
 			{
-				pReadStateFile.read((char*)&pIndexID, sizeof(pIndexID));
-				if (pReadStateFile.gcount() != sizeof(pIndexID))
-					break;
+				pChunk.erase(0, nDropped);
+				pChunkEntries.erase(pChunkEntries.begin(), pChunkEntries.begin() + nFirstKept);
+				for (ChunkEntry& pEntry : pChunkEntries)
+					pEntry.nOffset -= nDropped;
 
-				pReadStateFile.close();
-				return true;
+				nFirstKept = 0;
 			}
+		}
+
+		std::size_t nChunkEnd = pChunk.size();
+		for (std::size_t i = pChunkEntries.size(); i-- > nFirstKept;)
+		{
+			pOutput.append(pChunk, pChunkEntries[i].nOffset, nChunkEnd - pChunkEntries[i].nOffset);
+			nChunkEnd = pChunkEntries[i].nOffset;
+			++nReturned;
 
-			pReadStateFile.seekg(sizeof(UniqueFilenameId), std::ios::cur);
+			if (pQuery.nMaxBytes > 0 && pOutput.size() >= pQuery.nMaxBytes)
+			{
+				nChunkBegin = pChunkEntries[i].nEntry; // The next page continues with the entries before this one.
+				break;
+			}
 		}
-		pReadStateFile.close();
 
-		return false;
+		nEnd = nChunkBegin;
 	}
 
-	void AddEntryToList(const std::string& pIndexName, const UniqueFilenameId& pIndexFileID)
+	if (pNextCursor && nEnd > nBegin)
+		*pNextCursor = EncodeCursor(nBaseEntry + nEnd, 0);
+
+	return nReturned;
+}
+
+unsigned long long LogSystem::GetNextEntryNumber(const std::string& entryKey)
+{
+	PinnedLog pLog = FindOrCreateLogIndex(entryKey, false);
+	if (!pLog)
+		return 0;
+
+	std::unique_lock<std::mutex> writeLock(pLog->pMutex);
+	return pLog->GetNextAbsoluteEntry();
+}
+
+static constexpr std::size_t TAIL_CHUNK_SIZE = 1 << 16; // If more was written since the cursor, the rest is returned by the next TailEntries call.
+unsigned int LogSystem::TailEntries(const std::string& entryKey, std::string& strCursor, std::string& pOutput, EntryFormat nFormat, unsigned int nTimeout)
+{
+	pOutput = "";
+	EntryQuery pQuery;
+	if (!strCursor.empty() && !ParseCursor(strCursor, pQuery))
+		return 0;
+
+	PinnedLog pLog = FindOrCreateLogIndex(entryKey, false);
+	if (!pLog)
 	{
-		// I bet Append is causing stuff to be corrupted, like this is the only file where we use append and its the only file where corruption happens
-		// ToDo: Fix it, though for now this should still work.
-		RebuildState();
-		/*std::unique_lock<std::shared_mutex> writeLock(pMutex);
-		if (pReadStateFile.is_open())
-			pReadStateFile.close();
+		strCursor.clear();
+		return 0;
+	}
 
-		FileHandle_t pHandle = FileSystem::OpenAppendFile("logdata/state.dat");
-		if (pHandle.is_open())
-		{
-			pHandle.seekp(0, std::ios::end);
+	std::unique_lock<std::mutex> writeLock(pLog->pMutex);
+	pLog->PrepareRead();
 
-			std::size_t pHash = std::hash<std::string>{}(pIndexName);
+	unsigned long long nNextEntry = pQuery.bHasCursor ? pQuery.nCursorEntry : pLog->GetNextAbsoluteEntry();
+	EntryOffset nNextOffset = pQuery.bHasCursor ? pQuery.nCursorOffset : pLog->GetNextEntryOffset();
+	strCursor = EncodeCursor(nNextEntry, nNextOffset);
+	if (!pLog->WaitForEntries(writeLock, nNextEntry, std::chrono::milliseconds(nTimeout)))
+		return 0;
 
-			pHandle.write((char*)&pHash, sizeof(pHash));
-			pHandle.write((char*)&pIndexFileID, sizeof(pIndexFileID));
+	pLog->PrepareRead();
 
-			pHandle.close();
-		}*/
+	// If the entry of the cursor was already deleted, we continue at the oldest one we still have.
+	unsigned long long nBaseEntry = (unsigned long long)pLog->pIndex.nFirstSegment * pLog->pIndex.nSegmentEntries;
+	unsigned int nBegin = 0;
+	if (nNextEntry >= nBaseEntry)
+		nBegin = (unsigned int)std::min<unsigned long long>(nNextEntry - nBaseEntry, pLog->pIndex.nEntries);
+
+	nNextOffset = nNextEntry >= nBaseEntry ? pLog->ValidateCursorOffset(nBegin, nNextOffset) : 0;
+
+	const char* pData;
+	EntrySize nSize;
+	EntryScanner pScanner;
+	unsigned int nReturned = 0;
+	pScanner.Open(pLog.get(), nBegin, pLog->pIndex.nEntries, nNextOffset);
+	while (pOutput.size() < TAIL_CHUNK_SIZE && pScanner.Next(pData, nSize))
+	{
+		AppendEntry(pOutput, pData, nSize, nFormat);
+		++nReturned;
 	}
 
-private:
-	FileHandle_t pReadStateFile;
-	std::shared_mutex pMutex;
+	if (pScanner.GetNextEntry() < pLog->pIndex.nEntries)
+		strCursor = EncodeCursor(nBaseEntry + pScanner.GetNextEntry(), pScanner.GetNextOffset());
+	else
+		strCursor = EncodeCursor(pLog->GetNextAbsoluteEntry(), pLog->GetNextEntryOffset());
 
-	bool EnsureOpen()
+	if (nFormat == ENTRY_FORMAT_EVENT_STREAM)
+		pOutput.append("id: ").append(strCursor).append("\n\n");
+
+	return nReturned;
+}
+
+// Passes every record starting inside one of the [start, end) offset ranges to pCallback, until it returns false.
+template<typename Callback>
+static void ReadSegmentRanges(SegmentReader& pReader, const std::vector<std::pair<EntryOffset, EntryOffset>>& pRanges, const Callback& pCallback)
+{
+	const char* pData;
+	EntrySize nSize;
+	for (auto& pRange : pRanges)
 	{
-		if (pReadStateFile.is_open())
-			return true;
+		if (!pReader.Seek(pRange.first))
+			continue;
+
+		while (pReader.GetOffset() < pRange.second)
+		{
+			SegmentReader::RecordResult nResult = pReader.ReadNext(pData, nSize);
+			if (nResult == SegmentReader::RECORD_END)
+				break;
 
-		pReadStateFile = FileSystem::OpenReadFile("logdata/state.dat");
-		return pReadStateFile.is_open();
+			if (nResult == SegmentReader::RECORD_OK && !pCallback(pData, nSize))
+				return;
+		}
 	}
+}
 
-	/*
-		In a current unknown race condition our state file can become corrupted.
-		If that happens, the hashes and filenameIDs won't match causing possible issues.
-	*/
-	void RebuildState()
+unsigned int LogSystem::SearchEntries(const std::string& entryKey, const std::string& strNeedle, std::string& pOutput, const EntryQuery& pQuery)
+{
+	pOutput = "";
+	PinnedLog pLog = FindOrCreateLogIndex(entryKey, false);
+	if (!pLog || strNeedle.empty())
+		return 0;
+
+	std::unique_lock<std::mutex> writeLock(pLog->pMutex);
+	pLog->PrepareRead();
+
+	// Shorter needles have no trigrams so every entry has to be checked.
+	std::vector<unsigned int> pTrigrams;
+	CollectTrigrams(strNeedle.data(), strNeedle.size(), pTrigrams);
+
+	// Without a trigram index, only ranges whose Bloom filters contain every complete token of the needle are read.
+	std::vector<unsigned long long> pTokenHashes;
+	CollectTokenHashes(strNeedle.data(), strNeedle.size(), true, pTokenHashes);
+
+	unsigned int nReturned = 0;
+	auto pMatch = [&](SegmentReader& pReader, const char* pData, EntrySize nSize) {
+		EntryTimestamp nTimestamp = pReader.GetTimestamp();
+		if (nTimestamp < pQuery.nFrom || nTimestamp > pQuery.nTo)
+			return;
+
+		if (!StringSearch::Find(pData, nSize, strNeedle.data(), strNeedle.size()))
+			return;
+
+		AppendEntry(pOutput, pData, nSize, pQuery.nFormat);
+		++nReturned;
+	};
+
+	std::vector<TrigramPosting> pCandidates;
+	std::vector<EntryOffset> pOffsets;
+	std::vector<std::pair<EntryOffset, EntryOffset>> pRanges;
+	SegmentReader pReader;
+	unsigned int nRemainingEntries = pLog->pIndex.nEntries;
+	for (unsigned int nSegment = pLog->pIndex.nFirstSegment; nRemainingEntries > 0 && (pQuery.nLimit == 0 || nReturned < pQuery.nLimit); ++nSegment)
 	{
-		std::unique_lock<std::shared_mutex> writeLock(pMutex);
-		printf("Rebuilding Log state...\n");
+		unsigned int nSegmentEntries = std::min(nRemainingEntries, pLog->pIndex.nSegmentEntries);
+		nRemainingEntries -= nSegmentEntries;
+
+		bool bIndexed = !pTrigrams.empty() && pLog->FindTrigramCandidates(nSegment, pTrigrams, pCandidates);
+		if (bIndexed && pCandidates.empty())
+			continue;
 
-		pReadStateFile.close();
-		FileHandle_t pHandle = FileSystem::OpenWriteFile("logdata/state.dat");
-		if (!pHandle.is_open())
+		bool bFiltered = !bIndexed && pLog->FindBloomRanges(nSegment, pTokenHashes, pRanges);
+		if (bFiltered && pRanges.empty())
+			continue;
+
+		if (!pLog->OpenSegmentReader(nSegment, pReader) || (bIndexed && !pLog->ReadSegmentOffsets(nSegment, pOffsets)))
 		{
-			printf("Failed to rebuild log state! It's already open!\n");
-			return;
+			printf("Failed to read segment %u of \"%s\"!\n", nSegment, pLog->pIndex.nIndexName);
+			continue;
 		}
 
-		pHandle.seekp(0);
-		for(auto& pFile : std::filesystem::recursive_directory_iterator(pLogIndexesDir))
+		const char* pData;
+		EntrySize nSize;
+		if (bIndexed)
 		{
-			if (!pFile.is_regular_file())
-				continue;
-
-			FileHandle_t pIndexHandle = FileSystem::OpenReadFile(pFile.path().string());
-			if (!pIndexHandle.is_open())
+			for (std::size_t i=0; i<pCandidates.size() && (pQuery.nLimit == 0 || nReturned < pQuery.nLimit); ++i)
 			{
-				printf("Failed to open index \"%s\"\n", pFile.path().string().c_str());
-				continue;
-			}
+				if (pCandidates[i] >= nSegmentEntries || pCandidates[i] >= pOffsets.size() || !pReader.Seek(pOffsets[pCandidates[i]]))
+					continue;
 
-			LogIndex pLogIndex;
-			if (!LoadLogIndex(pLogIndex, pIndexHandle))
-			{
-				printf("Failed to read index \"%s\"\n", pFile.path().string().c_str());
-				continue;
+				if (pReader.ReadNext(pData, nSize) == SegmentReader::RECORD_OK)
+					pMatch(pReader, pData, nSize);
 			}
 
-			std::string pFileName = pFile.path().string().substr(pLogIndexesDirLength);
-			pFileName.erase(pFileName.size() - pLogExtensionLength); // Nuke .dat
+			continue;
+		}
+
+		if (!bFiltered)
+			pRanges.assign(1, {(EntryOffset)pReader.GetOffset(), UINT_MAX});
+
+		ReadSegmentRanges(pReader, pRanges, [&](const char* pData, EntrySize nSize) {
+			pMatch(pReader, pData, nSize);
+			return pQuery.nLimit == 0 || nReturned < pQuery.nLimit;
+		});
+	}
+
+	return nReturned;
+}
+
+unsigned int LogSystem::GrepEntries(const std::string& entryKey, const std::vector<std::string>& pNeedles, bool bMatchAll, std::string& pOutput, const EntryQuery& pQuery)
+{
+	pOutput = "";
+	PinnedLog pLog = FindOrCreateLogIndex(entryKey, false);
+	if (!pLog || pNeedles.empty())
+		return 0;
+
+	std::unique_lock<std::mutex> writeLock(pLog->pMutex);
+	pLog->PrepareRead();
+
+	// With bMatchAll a range has to contain every complete token of every needle so they are all checked at once,
+	// else the ranges of each needle are combined which only works if every needle has a complete token.
+	std::vector<std::vector<unsigned long long>> pNeedleTokens(bMatchAll ? 1 : pNeedles.size());
+	bool bCanFilter = true;
+	for (std::size_t i=0; i<pNeedles.size(); ++i)
+	{
+		std::vector<unsigned long long>& pTokenHashes = pNeedleTokens[bMatchAll ? 0 : i];
+		CollectTokenHashes(pNeedles[i].data(), pNeedles[i].size(), true, pTokenHashes);
+		if (!bMatchAll && pTokenHashes.empty())
+			bCanFilter = false;
+	}
 
-			UniqueFilenameId pIndexFileID;
-			Util::ReadUniqueFilenameFromBuffer(pFileName.c_str(), pIndexFileID);
+	unsigned int nReturned = 0;
+	auto pMatch = [&](SegmentReader& pReader, const char* pData, EntrySize nSize) {
+		EntryTimestamp nTimestamp = pReader.GetTimestamp();
+		if (nTimestamp < pQuery.nFrom || nTimestamp > pQuery.nTo)
+			return;
 
-			for (size_t idx = 0; idx < pLogIndex.nKeys; ++idx)
+		bool bMatches = bMatchAll;
+		for (const std::string& strNeedle : pNeedles)
+		{
+			if ((StringSearch::Find(pData, nSize, strNeedle.data(), strNeedle.size()) != nullptr) != bMatchAll)
 			{
-				std::size_t pHash = std::hash<std::string>{}(pLogIndex.nKeysData[idx].nKeyValue);
-				pHandle.write((char*)&pHash, sizeof(pHash));
-				pHandle.write((char*)&pIndexFileID, sizeof(UniqueFilenameId));
+				bMatches = !bMatchAll;
+				break;
 			}
 		}
-		pHandle.close();
-	}
 
-public:
-	void CheckState()
-	{
-		if (!EnsureOpen())
+		if (!bMatches)
 			return;
 
-		RebuildState();
+		AppendEntry(pOutput, pData, nSize, pQuery.nFormat);
+		++nReturned;
+	};
+
+	std::vector<std::pair<EntryOffset, EntryOffset>> pRanges;
+	std::vector<std::pair<EntryOffset, EntryOffset>> pNeedleRanges;
+	SegmentReader pReader;
+	unsigned int nRemainingEntries = pLog->pIndex.nEntries;
+	for (unsigned int nSegment = pLog->pIndex.nFirstSegment; nRemainingEntries > 0 && (pQuery.nLimit == 0 || nReturned < pQuery.nLimit); ++nSegment)
+	{
+		nRemainingEntries -= std::min(nRemainingEntries, pLog->pIndex.nSegmentEntries);
+
+		pRanges.clear();
+		bool bFiltered = bCanFilter;
+		for (std::size_t i=0; i<pNeedleTokens.size() && bFiltered; ++i)
+		{
+			bFiltered = pLog->FindBloomRanges(nSegment, pNeedleTokens[i], pNeedleRanges);
+			pRanges.insert(pRanges.end(), pNeedleRanges.begin(), pNeedleRanges.end());
+		}
 
-		/*printf("Checking Log state...\n");
-		bool bBroken = false;
-		int pIndexes = 0;
-		for(auto& pFile : std::filesystem::recursive_directory_iterator(pLogIndexesDir))
-			++pIndexes;
+		if (bFiltered && pRanges.empty())
+			continue;
 
+		if (bFiltered && pNeedleTokens.size() > 1)
 		{
-			std::shared_lock<std::shared_mutex> readLock(pMutex);
-			pReadStateFile.seekg(0);
-			int nFoundIndexes = 0;
-			while (true)
+			// Overlapping ranges of different needles would be read twice & could return an entry twice.
+			std::sort(pRanges.begin(), pRanges.end());
+			std::size_t nMerged = 0;
+			for (std::size_t i=1; i<pRanges.size(); ++i)
 			{
-				std::size_t pHash;
-				pReadStateFile.read((char*)&pHash, sizeof(pHash));
-				if (pReadStateFile.gcount() != sizeof(pHash))
-					break;
-
-				UniqueFilenameId pIndexID;
-				pReadStateFile.read((char*)&pIndexID, sizeof(pIndexID));
-				// printf("Found hash %u\n", pHash);
-				char nIndexFileName[FileSystem::MAX_PATH];
-				std::memcpy(nIndexFileName, pLogIndexesDir, pLogIndexesDirLength);
-				int nWritten = Util::WriteUniqueFilenameIntoBuffer(pIndexID, nIndexFileName + pLogIndexesDirLength, sizeof(nIndexFileName) - pLogIndexesDirLength);
-				std::memcpy(nIndexFileName + pLogIndexesDirLength + nWritten, pLogExtension, pLogExtensionLength);
-				nIndexFileName[pLogIndexesDirLength + nWritten + pLogExtensionLength] = '\0';
-
-				FileHandle_t pFile = FileSystem::OpenReadFile(nIndexFileName);
-				if (!pFile.is_open())
-				{
-					printf("Failed to open Log index \"%u\" - %llu %u %u from state!\n", pHash, pIndexID.timestamp, pIndexID.threadHash, pIndexID.randomSuffix);
-					bBroken = true;
-					break;
-				}
-				pFile.close();
-				++nFoundIndexes;
+				if (pRanges[i].first <= pRanges[nMerged].second)
+					pRanges[nMerged].second = std::max(pRanges[nMerged].second, pRanges[i].second);
+				else
+					pRanges[++nMerged] = pRanges[i];
 			}
+			pRanges.resize(nMerged + 1);
+		}
 
-			if (!bBroken && pIndexes != nFoundIndexes)
-				bBroken = true;
+		if (!pLog->OpenSegmentReader(nSegment, pReader))
+		{
+			printf("Failed to read segment %u of \"%s\"!\n", nSegment, pLog->pIndex.nIndexName);
+			continue;
 		}
 
-		if (bBroken)
-			RebuildState();
-		else
-			printf("Log state is fine :3\n");*/
+		if (!bFiltered)
+			pRanges.assign(1, {(EntryOffset)pReader.GetOffset(), UINT_MAX});
+
+		ReadSegmentRanges(pReader, pRanges, [&](const char* pData, EntrySize nSize) {
+			pMatch(pReader, pData, nSize);
+			return pQuery.nLimit == 0 || nReturned < pQuery.nLimit;
+		});
 	}
+
+	return nReturned;
+}
+
+// The export starts with an ExportHeader followed by every segment as an ExportSegmentHeader + the segment file exactly like it's on disk.
+static constexpr unsigned int EXPORT_MAGIC = 0x58474C48; // "HLGX"
+static constexpr unsigned short EXPORT_VERSION = 1;
+struct ExportHeader
+{
+	unsigned int nMagic = EXPORT_MAGIC;
+	unsigned short nVersion = EXPORT_VERSION;
+	unsigned short nReserved = 0;
+	unsigned int nSegmentEntries = 0;
+	unsigned int nSegments = 0;
 };
 
-static LogState g_pLogState;
-void CheckLogState()
+struct ExportSegmentHeader
 {
-	g_pLogState.CheckState();
+	unsigned int nSegment = 0;
+	unsigned int nEntries = 0;
+	unsigned long long nSize = 0; // Size of the segment file that follows
+};
+
+// A part of an export is either one of our headers or a segment file.
+struct ExportPart
+{
+	unsigned long long nStart = 0; // Offset of the part inside the export.
+	unsigned long long nSize = 0;
+	std::string pHeader;
+	std::string strFileName; // Sealed segments are only opened once they're read, see ReadExport.
+	FileDescriptor_t pFile = FileSystem::INVALID_DESCRIPTOR;
+	MappedView pView; // Mapped once the part is read the first time.
+};
+
+static void CloseExportPart(ExportPart& pPart)
+{
+	FileSystem::UnmapView(pPart.pView);
+	if (pPart.pFile != FileSystem::INVALID_DESCRIPTOR)
+		FileSystem::CloseDescriptor(pPart.pFile);
+
+	pPart.pFile = FileSystem::INVALID_DESCRIPTOR;
 }
 
-static Log* FindOrCreateLogIndex(const std::string& entryKey, bool bCreate = true)
+struct LogSystem::IndexExport
 {
-	std::string pKey = entryKey.substr(0, MAX_KEY_SIZE - 1); // Limit it to MAX_KEY_SIZE
-	std::size_t pKeyHash = std::hash<std::string>{}(pKey);
+	~IndexExport()
 	{
-		std::shared_lock<std::shared_mutex> readLock(g_LogIndexesMutex);
-		for (auto& pLog : g_pLogIndexes)
+		for (ExportPart& pPart : pParts)
+			CloseExportPart(pPart);
+
+		if (pLog)
+			pLog->EndExport();
+	}
+
+	PinnedLog pLog;
+	std::vector<ExportPart> pParts;
+	unsigned long long nSize = 0;
+	std::string strETag;
+	std::size_t nOpenPart = SIZE_MAX; // The sealed segment that is currently open, only one is so that large indexes don't need a descriptor per segment.
+	std::unique_ptr<char[]> pBuffer; // Only used if a segment couldn't be mapped.
+};
+
+static constexpr std::size_t EXPORT_BUFFER_SIZE = 1 << 20;
+std::shared_ptr<LogSystem::IndexExport> LogSystem::OpenExport(const std::string& entryKey)
+{
+	PinnedLog pLog = FindOrCreateLogIndex(entryKey, false);
+	if (!pLog)
+		return nullptr;
+
+	auto pExport = std::make_shared<IndexExport>();
+	std::unique_lock<std::mutex> writeLock(pLog->pMutex);
+	pLog->PrepareRead();
+
+	ExportHeader pHeader;
+	pHeader.nSegmentEntries = pLog->pIndex.nSegmentEntries;
+	pHeader.nSegments = pLog->pIndex.nEntries > 0 ? pLog->GetSegmentForEntry(pLog->pIndex.nEntries - 1) - pLog->pIndex.nFirstSegment + 1 : 0;
+
+	ExportPart& pHeaderPart = pExport->pParts.emplace_back();
+	pHeaderPart.pHeader.assign((const char*)&pHeader, sizeof(pHeader));
+	pHeaderPart.nSize = pHeaderPart.pHeader.size();
+
+	unsigned int nRemainingEntries = pLog->pIndex.nEntries;
+	for (unsigned int nSegment = pLog->pIndex.nFirstSegment; nRemainingEntries > 0; ++nSegment)
+	{
+		ExportSegmentHeader pSegmentHeader;
+		pSegmentHeader.nSegment = nSegment;
+		pSegmentHeader.nEntries = std::min(nRemainingEntries, pLog->pIndex.nSegmentEntries);
+		nRemainingEntries -= pSegmentHeader.nEntries;
+
+		// The active segment is opened now since only what was written so far is part of the export.
+		// Sealed segments aren't compressed while we're exported, see Log::BeginExport. ReadExport fails if they were deleted since.
+		FileDescriptor_t pFile = FileSystem::INVALID_DESCRIPTOR;
+		char nSegmentFileName[FileSystem::MAX_PATH];
+		if (pLog->IsSegmentSealed(nSegment))
 		{
-			if (pLog.get()->pIndexHash == pKeyHash)
-				return pLog.get();
+			pLog->BuildSegmentFileName(nSegmentFileName, sizeof(nSegmentFileName), nSegment);
+			pSegmentHeader.nSize = FileSystem::FileSize(nSegmentFileName);
+		} else {
+			pFile = pLog->OpenSegmentSnapshot(nSegment, pSegmentHeader.nSize);
+			if (pFile == FileSystem::INVALID_DESCRIPTOR)
+				pSegmentHeader.nSize = 0;
 		}
 
-		Log* pLog = g_pLogState.FindLog(pKey);
-		if (pLog)
+		if (pSegmentHeader.nSize == 0)
+			printf("Failed to export segment %u of \"%s\"!\n", nSegment, pLog->pIndex.nIndexName);
+
+		ExportPart& pPart = pExport->pParts.emplace_back();
+		pPart.pHeader.assign((const char*)&pSegmentHeader, sizeof(pSegmentHeader));
+		pPart.nSize = pPart.pHeader.size();
+
+		if (pSegmentHeader.nSize > 0)
 		{
-			printf("Loaded Log Index \"%s\" from state\n", pLog->pIndex.nIndexName);
-			g_pLogIndexes.push_back(std::unique_ptr<Log>(pLog));
-			return pLog;
+			ExportPart& pFilePart = pExport->pParts.emplace_back();
+			pFilePart.nSize = pSegmentHeader.nSize;
+			pFilePart.pFile = pFile;
+			if (pFile == FileSystem::INVALID_DESCRIPTOR)
+				pFilePart.strFileName = nSegmentFileName;
 		}
 	}
 
-	if (!bCreate)
-		return nullptr;
-
-	std::unique_lock<std::shared_mutex> writeLock(g_LogIndexesMutex);
+	// Our headers describe every segment & its size, so the same snapshot always gets the same ETag.
+	uint32_t nChecksum = Checksum::CRC32C(&pLog->pIndex.nFileName, sizeof(pLog->pIndex.nFileName));
+	for (ExportPart& pPart : pExport->pParts)
+	{
+		nChecksum = Checksum::CRC32C(pPart.pHeader.data(), pPart.pHeader.size(), nChecksum);
+		pPart.nStart = pExport->nSize;
+		pExport->nSize += pPart.nSize;
+	}
 
-	Log* pLog = new Log();
-	pLog->SetIndexName(pKey);
-	g_pLogIndexes.push_back(std::unique_ptr<Log>(pLog));
-	g_pLogState.AddEntryToList(pKey, pLog->pIndex.nFileName); // Save it into our state for disk based lookups
-	printf("Created a new Log Index \"%s\"\n", pKey.c_str());
+	char pETag[32];
+	snprintf(pETag, sizeof(pETag), "\"%08x-%llx\"", nChecksum, pExport->nSize);
+	pExport->strETag = pETag;
 
-	return pLog;
+	pLog->BeginExport();
+	pExport->pLog = std::move(pLog);
+	return pExport;
 }
 
-// The entryData is limited to around 32kb by the httpserver payload limit inside of HttpServer::Start
-bool LogSystem::AddEntry(const std::string& entryKey, const std::string& entryData)
+const std::string& LogSystem::GetExportETag(const IndexExport& pExport)
 {
-	Log* pLog = FindOrCreateLogIndex(entryKey);
-
-	pLog->AddEntry(entryData);
+	return pExport.strETag;
+}
 
-	return true;
+unsigned long long LogSystem::GetExportSize(const IndexExport& pExport)
+{
+	return pExport.nSize;
 }
 
-void LogSystem::GetEntries(const std::string& entryKey, std::string& pOutput)
+const char* LogSystem::ReadExport(IndexExport& pExport, unsigned long long nOffset, std::size_t& nSize)
 {
-	Log* pLog = FindOrCreateLogIndex(entryKey, false);
-	if (!pLog)
-	{
-		pOutput = "";
-		return;
-	}
+	auto it = std::upper_bound(pExport.pParts.begin(), pExport.pParts.end(), nOffset, [](unsigned long long nValue, const ExportPart& pPart) {
+		return nValue < pPart.nStart;
+	});
 
-	std::unique_lock<std::mutex> writeLock(pLog->pMutex); // Lock it just in case any writes try to come in.
-	FileHandle_t& pFile = pLog->OpenDataFile(Log::FileMode::READ);
-	if (!pFile.is_open())
+	if (it == pExport.pParts.begin() || nOffset >= pExport.nSize)
+		return nullptr;
+
+	ExportPart& pPart = *(it - 1);
+	unsigned long long nPartOffset = nOffset - pPart.nStart;
+	nSize = (std::size_t)std::min<unsigned long long>(nSize, pPart.nSize - nPartOffset);
+	if (pPart.pFile == FileSystem::INVALID_DESCRIPTOR && pPart.strFileName.empty())
+		return pPart.pHeader.data() + nPartOffset;
+
+	if (pPart.pFile == FileSystem::INVALID_DESCRIPTOR)
 	{
-		pOutput = "";
-		return;
+		if (pExport.nOpenPart < pExport.pParts.size())
+			CloseExportPart(pExport.pParts[pExport.nOpenPart]);
+
+		pPart.pFile = FileSystem::OpenDescriptor(pPart.strFileName.c_str());
+		if (pPart.pFile == FileSystem::INVALID_DESCRIPTOR || FileSystem::DescriptorSize(pPart.pFile) != pPart.nSize)
+		{
+			printf("Segment \"%s\" was deleted while it was exported\n", pPart.strFileName.c_str());
+			CloseExportPart(pPart);
+			return nullptr;
+		}
+
+		pExport.nOpenPart = (std::size_t)(&pPart - pExport.pParts.data());
 	}
 
-	pFile.seekg(0);
+	// Segments are sent straight out of the page cache, they're only read into our buffer if they can't be mapped.
+	if (pPart.pView.pData || FileSystem::MapDescriptor(pPart.pFile, (std::size_t)pPart.nSize, pPart.pView))
+		return pPart.pView.pData + nPartOffset;
 
-	// Just to be safe we add 8 more bytes per nEntries
-	pOutput.resize(2 + pLog->pIndex.nTotalSize + (8 * pLog->pIndex.nEntries));
+	if (!pExport.pBuffer)
+		pExport.pBuffer = std::make_unique<char[]>(EXPORT_BUFFER_SIZE);
 
-	std::size_t nPos = 0;
-	for (size_t i=0; i<pLog->pIndex.nEntries; ++i)
+	nSize = std::min(nSize, EXPORT_BUFFER_SIZE);
+	long long nRead = FileSystem::ReadAt(pPart.pFile, pExport.pBuffer.get(), nSize, nPartOffset);
+	if (nRead <= 0)
+		return nullptr;
+
+	nSize = (std::size_t)nRead;
+	return pExport.pBuffer.get();
+}
+
+void LogSystem::GetCompressionStats(const std::string& entryKey, std::string& pOutput)
+{
+	unsigned long long nInputBytes = g_nCompressionInputBytes;
+	unsigned long long nOutputBytes = g_nCompressionOutputBytes;
+	unsigned long long nDecompressedBytes = g_nDecompressedBytes;
+	double nDecompressionTime = g_nDecompressionTime / 1e9;
+
+	char pBuffer[512];
+	int nWritten = std::snprintf(pBuffer, sizeof(pBuffer),
+		"{\"enabled\": %s, \"compressedInputBytes\": %llu, \"compressedOutputBytes\": %llu, \"compressionRatio\": %.3f, \"decompressedBytes\": %llu, \"decompressionSeconds\": %.6f, \"decompressionMBps\": %.1f",
+		g_bCompression ? "true" : "false",
+		nInputBytes,
+		nOutputBytes,
+		nOutputBytes > 0 ? (double)nInputBytes / nOutputBytes : 1.0,
+		nDecompressedBytes,
+		nDecompressionTime,
+		nDecompressionTime > 0 ? (nDecompressedBytes / (1024.0 * 1024.0)) / nDecompressionTime : 0.0
+	);
+	pOutput.assign(pBuffer, nWritten);
+
+	PinnedLog pLog = entryKey.empty() ? nullptr : FindOrCreateLogIndex(entryKey, false);
+	if (pLog)
 	{
-		EntrySize nSize;
-		pFile.read((char*)&nSize, sizeof(nSize));
+		std::unique_lock<std::mutex> writeLock(pLog->pMutex);
+		pLog->PrepareRead();
+
+		// Includes the SegmentHeader's on disk while nTotalSize doesn't, for our ratio that difference doesn't matter.
+		unsigned long long nIndexBytes = pLog->pIndex.nTotalSize;
+		unsigned long long nDiskBytes = pLog->GetDiskSize();
+		nWritten = std::snprintf(pBuffer, sizeof(pBuffer),
+			", \"indexBytes\": %llu, \"indexDiskBytes\": %llu, \"indexCompressionRatio\": %.3f",
+			nIndexBytes,
+			nDiskBytes,
+			nDiskBytes > 0 ? (double)nIndexBytes / nDiskBytes : 1.0
+		);
+		pOutput.append(pBuffer, nWritten);
+	}
 
-		char pFileBuffer[USHRT_MAX];
-		pFile.read(pFileBuffer, nSize);
+	pOutput += "}";
+}
 
-		std::string strNumber = std::to_string(nSize);
-		memcpy(&pOutput[nPos], strNumber.c_str(), strNumber.size());
-		nPos += strNumber.size();
-		pOutput[nPos++] = '\0';
+bool LogSystem::VerifyIndex(const std::string& entryKey, std::string& pOutput)
+{
+	PinnedLog pLog = FindOrCreateLogIndex(entryKey, false);
+	if (!pLog)
+		return false;
 
-		memcpy(&pOutput[nPos], pFileBuffer, nSize);
-		nPos += nSize;
-		pOutput[nPos++] = '\0';
+	VerifyResult pResult;
+	{
+		std::unique_lock<std::mutex> writeLock(pLog->pMutex);
+		pLog->PrepareRead();
+		pLog->VerifySegments(pResult);
 	}
 
-	pOutput.resize(nPos);
+	char pBuffer[512];
+	int nWritten = std::snprintf(pBuffer, sizeof(pBuffer),
+		"{\"segments\": %u, \"records\": %u, \"corruptedRecords\": %u, \"missingRecords\": %u, \"bytes\": %llu, \"seconds\": %.6f, \"MBps\": %.1f, \"hardwareCRC32C\": %s}",
+		pResult.nSegments,
+		pResult.nRecords,
+		pResult.nCorruptedRecords,
+		pResult.nMissingRecords,
+		pResult.nBytes,
+		pResult.nSeconds,
+		pResult.nSeconds > 0 ? (pResult.nBytes / (1024.0 * 1024.0)) / pResult.nSeconds : 0.0,
+		Checksum::HasHardwareCRC32C() ? "true" : "false"
+	);
+	pOutput.assign(pBuffer, nWritten);
 
-	pFile.close();
+	return true;
 }
\ No newline at end of file
@@ -1,14 +1,93 @@
 #include "unordered_map"
 #include "string"
+#include "climits"
+#include "memory"
+#include "vector"
 
 //#define LOGSYSTEM_MULTIPLE_KEYS
 namespace LogSystem
 {
+	enum EntryFormat : int // Fixed so that util.h can declare it without us.
+	{
+		ENTRY_FORMAT_TEXT = 0, // "<size>\0<data>\0" with the size in decimal.
+		ENTRY_FORMAT_BINARY = 1, // [uint32 little endian size][data]
+		ENTRY_FORMAT_EVENT_STREAM = 2, // A Server-Sent Event per entry, every line of it being a "data:" field.
+	};
+
+	// Optional filters of GetEntries, timestamps are in milliseconds since the unix epoch and set by us once an entry is written.
+	struct EntryQuery
+	{
+		unsigned long long nFrom = 0; // Only entries written at or after this.
+		unsigned long long nTo = ULLONG_MAX; // Only entries written at or before this.
+		unsigned int nOffset = 0; // Number of entries to skip, counted from the newest one if bNewestFirst is set.
+		unsigned int nLimit = 0; // Maximum number of entries to return, 0 means no limit.
+		std::size_t nMaxBytes = 0; // The page ends with the entry that reaches this output size, 0 means no limit. Used to stream responses in chunks.
+		unsigned long long nEndEntry = ULLONG_MAX; // Entries from this one on are ignored, see GetNextEntryNumber. Keeps a streamed response from growing while it's sent.
+		bool bNewestFirst = false;
+		EntryFormat nFormat = ENTRY_FORMAT_TEXT;
+
+		// Set by ParseCursor, continues after the page that returned the cursor. nOffset is ignored then.
+		bool bHasCursor = false;
+		unsigned long long nCursorEntry = 0;
+		unsigned int nCursorOffset = 0;
+	};
+
+	// Returns false if strCursor isn't a cursor returned by GetEntries.
+	extern bool ParseCursor(const std::string& strCursor, EntryQuery& pQuery);
+
 	extern void Init();
 #ifdef LOGSYSTEM_MULTIPLE_KEYS
 	extern bool AddEntry(const std::unordered_map<std::string, std::string>& entryKeys, const std::string& entryData);
 #else
 	extern bool AddEntry(const std::string& entryKey, const std::string& entryData);
 #endif
-	extern void GetEntries(const std::string& entryKey, std::string& pOutput);
+	// Writes every entry matching pQuery in pQuery.nFormat and returns how many were written.
+	// If the page was cut short by nLimit or nMaxBytes, pNextCursor is set to the cursor of the next page.
+	extern unsigned int GetEntries(const std::string& entryKey, std::string& pOutput, const EntryQuery& pQuery = EntryQuery(), std::string* pNextCursor = nullptr);
+
+	// The number the next written entry will get, numbers are never reused even once older entries were deleted. 0 if the index doesn't exist.
+	extern unsigned long long GetNextEntryNumber(const std::string& entryKey);
+
+	// Returns only the newest entry, this never scans the data file.
+	extern void GetLastEntry(const std::string& entryKey, std::string& pOutput);
+
+	// Reads a single entry, nIndex being relative to the oldest entry that still exists.
+	// Returns false if the index or entry doesn't exist.
+	extern bool GetEntry(const std::string& entryKey, unsigned int nIndex, std::string& pOutput);
+
+	// Writes the compression ratio & decode throughput since startup as json, if entryKey is given the ratio of that index is included too.
+	extern void GetCompressionStats(const std::string& entryKey, std::string& pOutput);
+
+	// Writes every entry containing strNeedle like GetEntries does. Each segment keeps trigram posting lists
+	// so that only entries which can contain strNeedle are read, with -notrigrams the Bloom filters of sealed segments are used instead.
+	// Only nFrom, nTo, nLimit & nFormat of pQuery are used.
+	extern unsigned int SearchEntries(const std::string& entryKey, const std::string& strNeedle, std::string& pOutput, const EntryQuery& pQuery = EntryQuery());
+
+	// Writes every entry containing all of pNeedles (or any of them if bMatchAll is false) like SearchEntries does.
+	// This doesn't use the trigram index, the records are scanned with StringSearch::Find & only the Bloom filters of sealed segments skip ranges.
+	extern unsigned int GrepEntries(const std::string& entryKey, const std::vector<std::string>& pNeedles, bool bMatchAll, std::string& pOutput, const EntryQuery& pQuery = EntryQuery());
+
+	// Writes the entries after strCursor like GetEntries does & sets strCursor to continue after them, an empty cursor starts at the newest entry.
+	// If there are none yet, it waits up to nTimeout milliseconds for AddEntry to commit some.
+	// Returns 0 if it timed out, if the index doesn't exist strCursor is cleared.
+	// With ENTRY_FORMAT_EVENT_STREAM the cursor is also sent as the id of the last event so a reconnecting EventSource continues there.
+	extern unsigned int TailEntries(const std::string& entryKey, std::string& strCursor, std::string& pOutput, EntryFormat nFormat, unsigned int nTimeout);
+
+	// A snapshot of the segments of an index that can be sent as a raw export, created by OpenExport.
+	// Format: [ExportHeader][ExportSegmentHeader][Segment file exactly like it's on disk]... see logsystem.cpp
+	struct IndexExport;
+
+	// Returns nullptr if the index doesn't exist.
+	extern std::shared_ptr<IndexExport> OpenExport(const std::string& entryKey);
+	extern unsigned long long GetExportSize(const IndexExport& pExport);
+	// Changes whenever the exported segments do, a range request only continues an export if its If-Range still matches.
+	extern const std::string& GetExportETag(const IndexExport& pExport);
+
+	// Returns a pointer to the export data at nOffset & sets nSize to how much of it is available there, atmost nSize.
+	// The data stays valid until the next call. Returns nullptr if it couldn't be read.
+	extern const char* ReadExport(IndexExport& pExport, unsigned long long nOffset, std::size_t& nSize);
+
+	// Validates the checksum of every record of the index and writes the result as json.
+	// Returns false if the index doesn't exist.
+	extern bool VerifyIndex(const std::string& entryKey, std::string& pOutput);
 }
\ No newline at end of file
@@ -28,7 +28,11 @@ public:
 				return;
 			}
 
-			LogSystem::AddEntry(entryIndex, req.body);
+			if (!LogSystem::AddEntry(entryIndex, req.body))
+			{
+				res.status = 500;
+				return;
+			}
 #endif
 			res.set_header("Content-Type", "text/plain");
 			res.status = 200;
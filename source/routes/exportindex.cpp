@@ -0,0 +1,48 @@
+#include "httpserver.h"
+#include "logsystem.h"
+#include "util.h"
+
+class ExportIndex : HttpRoute
+{
+public:
+	virtual const char* GetName() { return "ExportIndex"; };
+	virtual void Setup(httplib::Server& pServer)
+	{
+		pServer.Get("/ExportIndex", [&](const httplib::Request& req, httplib::Response& res)
+		{
+			std::string entryIndex = req.get_header_value("entryIndex");
+			if (entryIndex.empty())
+			{
+				res.status = 400;
+				return;
+			}
+
+			std::shared_ptr<LogSystem::IndexExport> pExport = LogSystem::OpenExport(entryIndex);
+			if (!pExport)
+			{
+				res.status = 404;
+				return;
+			}
+
+			// The size is known upfront, so range requests can resume an interrupted export.
+			// httplib already parsed the Range header, if If-Range doesn't match anymore we drop it so that the new export is sent in full.
+			const std::string& strETag = LogSystem::GetExportETag(*pExport);
+			if (req.has_header("If-Range") && req.get_header_value("If-Range") != strETag)
+				const_cast<httplib::Request&>(req).ranges.clear();
+
+			res.set_header("ETag", strETag);
+			res.set_header("Accept-Ranges", "bytes");
+			res.set_content_provider(LogSystem::GetExportSize(*pExport), "application/octet-stream", [pExport](std::size_t nOffset, std::size_t nLength, httplib::DataSink& pSink)
+			{
+				std::size_t nSize = std::min<std::size_t>(nLength, EXPORT_CHUNK_SIZE);
+				const char* pData = LogSystem::ReadExport(*pExport, nOffset, nSize);
+				return pData && pSink.write(pData, nSize);
+			});
+			// No status, httplib sets 200 or 206 depending on the range.
+		});
+	}
+
+private:
+	static constexpr std::size_t EXPORT_CHUNK_SIZE = 1 << 20;
+};
+static ExportIndex pExportIndex;
\ No newline at end of file
@@ -0,0 +1,21 @@
+#include "httpserver.h"
+#include "logsystem.h"
+#include "util.h"
+
+class GetCompressionStats : HttpRoute
+{
+public:
+	virtual const char* GetName() { return "GetCompressionStats"; };
+	virtual void Setup(httplib::Server& pServer)
+	{
+		pServer.Get("/GetCompressionStats", [&](const httplib::Request& req, httplib::Response& res)
+		{
+			std::string entryIndex = req.get_header_value("entryIndex"); // Optional
+
+			LogSystem::GetCompressionStats(entryIndex, res.body);
+			res.set_header("Content-Type", "application/json");
+			res.status = 200;
+		});
+	}
+};
+static GetCompressionStats pGetCompressionStats;
\ No newline at end of file
@@ -17,10 +17,79 @@ public:
 				return;
 			}
 
-			LogSystem::GetEntries(entryIndex, res.body);
-			res.set_header("Content-Type", "text/plain");
+			// Everything is optional. from & to are in milliseconds since the unix epoch,
+			// offset & limit are in entries and a cursor continues where the previous page ended.
+			LogSystem::EntryQuery pQuery;
+			unsigned long long nOffset = 0;
+			unsigned long long nLimit = 0;
+			if (!Util::ParseNumber(req, "from", pQuery.nFrom) || !Util::ParseNumber(req, "to", pQuery.nTo) ||
+				!Util::ParseNumber(req, "offset", nOffset) || !Util::ParseNumber(req, "limit", nLimit) || nOffset > UINT_MAX || nLimit > UINT_MAX)
+			{
+				res.status = 400;
+				return;
+			}
+			pQuery.nOffset = (unsigned int)nOffset;
+			pQuery.nLimit = (unsigned int)nLimit;
+
+			std::string strNewestFirst = req.get_param_value("newestFirst");
+			pQuery.bNewestFirst = strNewestFirst == "1" || strNewestFirst == "true";
+
+			// The binary format is used if it's asked for with format=binary or the Accept header.
+			if (!Util::ParseEntryFormat(req, pQuery.nFormat))
+			{
+				res.status = 400;
+				return;
+			}
+			const char* pContentType = pQuery.nFormat == LogSystem::ENTRY_FORMAT_BINARY ? Util::BINARY_CONTENT_TYPE : "text/plain";
+
+			if (req.has_param("cursor") && !LogSystem::ParseCursor(req.get_param_value("cursor"), pQuery))
+			{
+				res.status = 400;
+				return;
+			}
+
+			if (pQuery.nLimit == 0)
+			{
+				// Without a limit the response can be as large as the index, so it's streamed in chunks that are read while the previous one is sent.
+				// The index is only locked while a chunk is read, so writers aren't stuck behind slow clients.
+				auto pState = std::make_shared<StreamState>();
+				pState->pQuery = pQuery;
+				pState->pQuery.nMaxBytes = STREAM_CHUNK_SIZE;
+				res.set_chunked_content_provider(pContentType, [entryIndex, pState](std::size_t /*nOffset*/, httplib::DataSink& pSink)
+				{
+					if (pState->pQuery.nEndEntry == ULLONG_MAX) // First chunk, entries written while we stream aren't part of the response.
+						pState->pQuery.nEndEntry = LogSystem::GetNextEntryNumber(entryIndex);
+
+					std::string strNextCursor;
+					LogSystem::GetEntries(entryIndex, pState->pChunk, pState->pQuery, &strNextCursor);
+					if (!pState->pChunk.empty() && !pSink.write(pState->pChunk.data(), pState->pChunk.size()))
+						return false;
+
+					if (strNextCursor.empty() || !LogSystem::ParseCursor(strNextCursor, pState->pQuery))
+						pSink.done();
+
+					return true;
+				});
+				res.status = 200;
+				return;
+			}
+
+			std::string strNextCursor;
+			LogSystem::GetEntries(entryIndex, res.body, pQuery, &strNextCursor);
+			if (!strNextCursor.empty())
+				res.set_header("X-Next-Cursor", strNextCursor);
+
+			res.set_header("Content-Type", pContentType);
 			res.status = 200;
 		});
 	}
+
+private:
+	static constexpr std::size_t STREAM_CHUNK_SIZE = 1 << 16;
+	struct StreamState
+	{
+		LogSystem::EntryQuery pQuery; // Continues using the cursor of the previous chunk.
+		std::string pChunk; // Reused for every chunk.
+	};
 };
 static GetEntries pGetEntries;
\ No newline at end of file
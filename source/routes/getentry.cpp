@@ -0,0 +1,40 @@
+#include "httpserver.h"
+#include "logsystem.h"
+#include "util.h"
+
+class GetEntry : HttpRoute
+{
+public:
+	virtual const char* GetName() { return "GetEntry"; };
+	virtual void Setup(httplib::Server& pServer)
+	{
+		pServer.Get("/GetEntry", [&](const httplib::Request& req, httplib::Response& res)
+		{
+			std::string entryIndex = req.get_header_value("entryIndex");
+			std::string strIndex = req.get_param_value("index");
+			if (entryIndex.empty() || strIndex.empty())
+			{
+				res.status = 400;
+				return;
+			}
+
+			char* pEnd = nullptr;
+			unsigned long nIndex = std::strtoul(strIndex.c_str(), &pEnd, 10);
+			if (pEnd == strIndex.c_str() || *pEnd != '\0')
+			{
+				res.status = 400;
+				return;
+			}
+
+			if (!LogSystem::GetEntry(entryIndex, (unsigned int)nIndex, res.body))
+			{
+				res.status = 404;
+				return;
+			}
+
+			res.set_header("Content-Type", "text/plain");
+			res.status = 200;
+		});
+	}
+};
+static GetEntry pGetEntry;
\ No newline at end of file
@@ -0,0 +1,62 @@
+#include "httpserver.h"
+#include "logsystem.h"
+#include "util.h"
+
+class Grep : HttpRoute
+{
+public:
+	virtual const char* GetName() { return "Grep"; };
+	virtual void Setup(httplib::Server& pServer)
+	{
+		pServer.Get("/Grep", [&](const httplib::Request& req, httplib::Response& res)
+		{
+			std::string entryIndex = req.get_header_value("entryIndex");
+			std::size_t nNeedles = req.get_param_value_count("q");
+			if (entryIndex.empty() || nNeedles == 0)
+			{
+				res.status = 400;
+				return;
+			}
+
+			// Every q is a substring, by default entries containing any of them are returned like with grep -e.
+			std::vector<std::string> pNeedles;
+			for (std::size_t i=0; i<nNeedles; ++i)
+			{
+				pNeedles.push_back(req.get_param_value("q", i));
+				if (pNeedles.back().empty())
+				{
+					res.status = 400;
+					return;
+				}
+			}
+
+			std::string strMatch = req.get_param_value("match");
+			if (!strMatch.empty() && strMatch != "any" && strMatch != "all")
+			{
+				res.status = 400;
+				return;
+			}
+
+			// Same optional parameters & formats as Search.
+			LogSystem::EntryQuery pQuery;
+			unsigned long long nLimit = 0;
+			if (!Util::ParseNumber(req, "from", pQuery.nFrom) || !Util::ParseNumber(req, "to", pQuery.nTo) || !Util::ParseNumber(req, "limit", nLimit) || nLimit > UINT_MAX)
+			{
+				res.status = 400;
+				return;
+			}
+			pQuery.nLimit = (unsigned int)nLimit;
+
+			if (!Util::ParseEntryFormat(req, pQuery.nFormat))
+			{
+				res.status = 400;
+				return;
+			}
+
+			LogSystem::GrepEntries(entryIndex, pNeedles, strMatch == "all", res.body, pQuery);
+			res.set_header("Content-Type", pQuery.nFormat == LogSystem::ENTRY_FORMAT_BINARY ? Util::BINARY_CONTENT_TYPE : "text/plain");
+			res.status = 200;
+		});
+	}
+};
+static Grep pGrep;
\ No newline at end of file
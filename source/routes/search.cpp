@@ -0,0 +1,43 @@
+#include "httpserver.h"
+#include "logsystem.h"
+#include "util.h"
+
+class Search : HttpRoute
+{
+public:
+	virtual const char* GetName() { return "Search"; };
+	virtual void Setup(httplib::Server& pServer)
+	{
+		pServer.Get("/Search", [&](const httplib::Request& req, httplib::Response& res)
+		{
+			std::string entryIndex = req.get_header_value("entryIndex");
+			std::string strNeedle = req.get_param_value("q");
+			if (entryIndex.empty() || strNeedle.empty())
+			{
+				res.status = 400;
+				return;
+			}
+
+			// Same optional parameters & formats as GetEntries, besides paging.
+			LogSystem::EntryQuery pQuery;
+			unsigned long long nLimit = 0;
+			if (!Util::ParseNumber(req, "from", pQuery.nFrom) || !Util::ParseNumber(req, "to", pQuery.nTo) || !Util::ParseNumber(req, "limit", nLimit) || nLimit > UINT_MAX)
+			{
+				res.status = 400;
+				return;
+			}
+			pQuery.nLimit = (unsigned int)nLimit;
+
+			if (!Util::ParseEntryFormat(req, pQuery.nFormat))
+			{
+				res.status = 400;
+				return;
+			}
+
+			LogSystem::SearchEntries(entryIndex, strNeedle, res.body, pQuery);
+			res.set_header("Content-Type", pQuery.nFormat == LogSystem::ENTRY_FORMAT_BINARY ? Util::BINARY_CONTENT_TYPE : "text/plain");
+			res.status = 200;
+		});
+	}
+};
+static Search pSearch;
\ No newline at end of file
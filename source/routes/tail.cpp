@@ -0,0 +1,115 @@
+#include "httpserver.h"
+#include "logsystem.h"
+#include "util.h"
+#include <atomic>
+
+class Tail : HttpRoute
+{
+public:
+	virtual const char* GetName() { return "Tail"; };
+	virtual void Setup(httplib::Server& pServer)
+	{
+		pServer.Get("/Tail", [&](const httplib::Request& req, httplib::Response& res)
+		{
+			// EventSource can't send headers, so the index can be given as a parameter too.
+			std::string entryIndex = req.get_header_value("entryIndex");
+			if (entryIndex.empty())
+				entryIndex = req.get_param_value("entryIndex");
+
+			if (entryIndex.empty())
+			{
+				res.status = 400;
+				return;
+			}
+
+			// A reconnecting EventSource sends the id of the last event it got, which is our cursor.
+			std::string strCursor = req.get_param_value("cursor");
+			if (strCursor.empty())
+				strCursor = req.get_header_value("Last-Event-ID");
+
+			LogSystem::EntryQuery pCursorQuery;
+			unsigned long long nTimeout = LONG_POLL_TIMEOUT;
+			if ((!strCursor.empty() && !LogSystem::ParseCursor(strCursor, pCursorQuery)) || !Util::ParseNumber(req, "timeout", nTimeout) || nTimeout > MAX_LONG_POLL_TIMEOUT)
+			{
+				res.status = 400;
+				return;
+			}
+
+			LogSystem::EntryFormat nFormat = LogSystem::ENTRY_FORMAT_TEXT;
+			if (!Util::ParseEntryFormat(req, nFormat, true))
+			{
+				res.status = 400;
+				return;
+			}
+			bool bEventStream = nFormat == LogSystem::ENTRY_FORMAT_EVENT_STREAM;
+
+			// Every waiting request keeps a thread, so we limit how many there can be.
+			if (++nActiveTails > HttpServer::GetMaxTails())
+			{
+				--nActiveTails;
+				res.status = 503;
+				return;
+			}
+
+			// This also turns an empty cursor into one pointing at the next entry, so nothing written from now on is missed.
+			std::string strFirstChunk;
+			LogSystem::TailEntries(entryIndex, strCursor, strFirstChunk, nFormat, bEventStream ? 0 : (unsigned int)nTimeout);
+			if (strCursor.empty())
+			{
+				--nActiveTails;
+				res.status = 404;
+				return;
+			}
+
+			if (!bEventStream)
+			{
+				// Long-poll, returns as soon as there are new entries or the timeout passed, continue using X-Next-Cursor.
+				--nActiveTails;
+				res.body = std::move(strFirstChunk);
+				res.set_header("X-Next-Cursor", strCursor);
+				res.set_header("Content-Type", nFormat == LogSystem::ENTRY_FORMAT_BINARY ? Util::BINARY_CONTENT_TYPE : "text/plain");
+				res.status = 200;
+				return;
+			}
+
+			auto pState = std::make_shared<StreamState>();
+			pState->strCursor = strCursor;
+			pState->pChunk = std::move(strFirstChunk);
+			res.set_header("Cache-Control", "no-cache");
+			res.set_chunked_content_provider(Util::EVENT_STREAM_CONTENT_TYPE, [entryIndex, pState](std::size_t /*nOffset*/, httplib::DataSink& pSink)
+			{
+				// While nothing is written we only send a comment now & then, which is how we notice that the client is gone.
+				if (pState->pChunk.empty() && LogSystem::TailEntries(entryIndex, pState->strCursor, pState->pChunk, LogSystem::ENTRY_FORMAT_EVENT_STREAM, EVENT_STREAM_KEEPALIVE) == 0)
+				{
+					if (pState->strCursor.empty())
+					{
+						pSink.done();
+						return true;
+					}
+
+					pState->pChunk = ": keepalive\n\n";
+				}
+
+				bool bWritten = pSink.write(pState->pChunk.data(), pState->pChunk.size());
+				pState->pChunk.clear();
+				return bWritten;
+			}, [](bool /*bSuccess*/)
+			{
+				--nActiveTails;
+			});
+			res.status = 200;
+		});
+	}
+
+private:
+	static constexpr unsigned long long LONG_POLL_TIMEOUT = 25000; // in ms, below the usual 30 seconds after which proxies give up.
+	static constexpr unsigned long long MAX_LONG_POLL_TIMEOUT = 120000;
+	static constexpr unsigned int EVENT_STREAM_KEEPALIVE = 15000;
+	static inline std::atomic<int> nActiveTails = 0;
+	struct StreamState
+	{
+		std::string strCursor; // Continues after the last event that was sent.
+		std::string pChunk; // Reused for every event.
+	};
+};
+static Tail pTail;
\ No newline at end of file
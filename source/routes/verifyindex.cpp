@@ -0,0 +1,31 @@
+#include "httpserver.h"
+#include "logsystem.h"
+#include "util.h"
+
+class VerifyIndex : HttpRoute
+{
+public:
+	virtual const char* GetName() { return "VerifyIndex"; };
+	virtual void Setup(httplib::Server& pServer)
+	{
+		pServer.Get("/VerifyIndex", [&](const httplib::Request& req, httplib::Response& res)
+		{
+			std::string entryIndex = req.get_header_value("entryIndex");
+			if (entryIndex.empty())
+			{
+				res.status = 400;
+				return;
+			}
+
+			if (!LogSystem::VerifyIndex(entryIndex, res.body))
+			{
+				res.status = 404;
+				return;
+			}
+
+			res.set_header("Content-Type", "application/json");
+			res.status = 200;
+		});
+	}
+};
+static VerifyIndex pVerifyIndex;
\ No newline at end of file
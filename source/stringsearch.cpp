@@ -0,0 +1,183 @@
+#include "stringsearch.h"
+#include <cstring>
+#include <cstdint>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define STRINGSEARCH_X86
+#define STRINGSEARCH_TARGET_SSE2
+#define STRINGSEARCH_TARGET_AVX2
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <cpuid.h>
+#define STRINGSEARCH_X86
+#define STRINGSEARCH_TARGET_SSE2 __attribute__((target("sse2")))
+#define STRINGSEARCH_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+static const char* FindScalar(const char* pHaystack, std::size_t nHaystackSize, const char* pNeedle, std::size_t nNeedleSize)
+{
+	const char* pEnd = pHaystack + nHaystackSize - nNeedleSize + 1; // Last position the needle can start at + 1
+	while (pHaystack < pEnd)
+	{
+		pHaystack = (const char*)std::memchr(pHaystack, pNeedle[0], pEnd - pHaystack);
+		if (!pHaystack)
+			return nullptr;
+
+		if (std::memcmp(pHaystack + 1, pNeedle + 1, nNeedleSize - 1) == 0)
+			return pHaystack;
+
+		++pHaystack;
+	}
+
+	return nullptr;
+}
+
+#ifdef STRINGSEARCH_X86
+static inline unsigned int CountTrailingZeros(uint32_t nValue)
+{
+#ifdef _MSC_VER
+	unsigned long nIndex;
+	_BitScanForward(&nIndex, nValue);
+	return (unsigned int)nIndex;
+#else
+	return (unsigned int)__builtin_ctz(nValue);
+#endif
+}
+
+// Both SIMD versions first look for positions where the first & last byte of the needle match
+// which rules out nearly everything, only those get compared fully.
+STRINGSEARCH_TARGET_AVX2 static const char* FindAVX2(const char* pHaystack, std::size_t nHaystackSize, const char* pNeedle, std::size_t nNeedleSize)
+{
+	const __m256i pFirst = _mm256_set1_epi8(pNeedle[0]);
+	const __m256i pLast = _mm256_set1_epi8(pNeedle[nNeedleSize - 1]);
+	std::size_t nPos = 0;
+	for (; nPos + nNeedleSize - 1 + 32 <= nHaystackSize; nPos += 32)
+	{
+		__m256i pBlockFirst = _mm256_loadu_si256((const __m256i*)(pHaystack + nPos));
+		__m256i pBlockLast = _mm256_loadu_si256((const __m256i*)(pHaystack + nPos + nNeedleSize - 1));
+		uint32_t nMask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(pFirst, pBlockFirst), _mm256_cmpeq_epi8(pLast, pBlockLast)));
+		while (nMask != 0)
+		{
+			unsigned int nBit = CountTrailingZeros(nMask);
+			if (nNeedleSize <= 2 || std::memcmp(pHaystack + nPos + nBit + 1, pNeedle + 1, nNeedleSize - 2) == 0)
+				return pHaystack + nPos + nBit;
+
+			nMask &= nMask - 1;
+		}
+	}
+
+	if (nPos + nNeedleSize > nHaystackSize)
+		return nullptr;
+
+	return FindScalar(pHaystack + nPos, nHaystackSize - nPos, pNeedle, nNeedleSize);
+}
+
+STRINGSEARCH_TARGET_SSE2 static const char* FindSSE2(const char* pHaystack, std::size_t nHaystackSize, const char* pNeedle, std::size_t nNeedleSize)
+{
+	const __m128i pFirst = _mm_set1_epi8(pNeedle[0]);
+	const __m128i pLast = _mm_set1_epi8(pNeedle[nNeedleSize - 1]);
+	std::size_t nPos = 0;
+	for (; nPos + nNeedleSize - 1 + 16 <= nHaystackSize; nPos += 16)
+	{
+		__m128i pBlockFirst = _mm_loadu_si128((const __m128i*)(pHaystack + nPos));
+		__m128i pBlockLast = _mm_loadu_si128((const __m128i*)(pHaystack + nPos + nNeedleSize - 1));
+		uint32_t nMask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(pFirst, pBlockFirst), _mm_cmpeq_epi8(pLast, pBlockLast)));
+		while (nMask != 0)
+		{
+			unsigned int nBit = CountTrailingZeros(nMask);
+			if (nNeedleSize <= 2 || std::memcmp(pHaystack + nPos + nBit + 1, pNeedle + 1, nNeedleSize - 2) == 0)
+				return pHaystack + nPos + nBit;
+
+			nMask &= nMask - 1;
+		}
+	}
+
+	if (nPos + nNeedleSize > nHaystackSize)
+		return nullptr;
+
+	return FindScalar(pHaystack + nPos, nHaystackSize - nPos, pNeedle, nNeedleSize);
+}
+
+enum InstructionSet
+{
+	INSTRUCTION_SET_SCALAR,
+	INSTRUCTION_SET_SSE2,
+	INSTRUCTION_SET_AVX2,
+};
+
+static InstructionSet CheckInstructionSet()
+{
+#ifdef _MSC_VER
+	int pInfo[4];
+	__cpuid(pInfo, 1);
+	bool bSSE2 = (pInfo[3] & (1 << 26)) != 0;
+	bool bOSXSAVE = (pInfo[2] & (1 << 27)) != 0;
+	bool bAVX = (pInfo[2] & (1 << 28)) != 0;
+	__cpuidex(pInfo, 7, 0);
+	bool bAVX2 = (pInfo[1] & (1 << 5)) != 0;
+#else
+	unsigned int nEax, nEbx, nEcx, nEdx;
+	if (!__get_cpuid(1, &nEax, &nEbx, &nEcx, &nEdx))
+		return INSTRUCTION_SET_SCALAR;
+
+	bool bSSE2 = (nEdx & bit_SSE2) != 0;
+	bool bOSXSAVE = (nEcx & bit_OSXSAVE) != 0;
+	bool bAVX = (nEcx & bit_AVX) != 0;
+	bool bAVX2 = __get_cpuid_count(7, 0, &nEax, &nEbx, &nEcx, &nEdx) && (nEbx & bit_AVX2) != 0;
+#endif
+
+	// The OS also has to save the ymm registers on context switches, else we can't use them.
+	if (bAVX2 && bAVX && bOSXSAVE)
+	{
+#ifdef _MSC_VER
+		unsigned long long nXCR0 = _xgetbv(0);
+#else
+		unsigned int nXCR0Low, nXCR0High;
+		__asm__ volatile("xgetbv" : "=a"(nXCR0Low), "=d"(nXCR0High) : "c"(0));
+		unsigned long long nXCR0 = nXCR0Low;
+#endif
+		if ((nXCR0 & 0x6) == 0x6)
+			return INSTRUCTION_SET_AVX2;
+	}
+
+	return bSSE2 ? INSTRUCTION_SET_SSE2 : INSTRUCTION_SET_SCALAR;
+}
+static const InstructionSet g_nInstructionSet = CheckInstructionSet();
+#endif
+
+const char* StringSearch::Find(const char* pHaystack, std::size_t nHaystackSize, const char* pNeedle, std::size_t nNeedleSize)
+{
+	if (nNeedleSize == 0)
+		return pHaystack;
+
+	if (nNeedleSize > nHaystackSize)
+		return nullptr;
+
+	if (nNeedleSize == 1)
+		return (const char*)std::memchr(pHaystack, pNeedle[0], nHaystackSize);
+
+#ifdef STRINGSEARCH_X86
+	if (g_nInstructionSet == INSTRUCTION_SET_AVX2)
+		return FindAVX2(pHaystack, nHaystackSize, pNeedle, nNeedleSize);
+
+	if (g_nInstructionSet == INSTRUCTION_SET_SSE2)
+		return FindSSE2(pHaystack, nHaystackSize, pNeedle, nNeedleSize);
+#endif
+
+	return FindScalar(pHaystack, nHaystackSize, pNeedle, nNeedleSize);
+}
+
+const char* StringSearch::GetInstructionSet()
+{
+#ifdef STRINGSEARCH_X86
+	if (g_nInstructionSet == INSTRUCTION_SET_AVX2)
+		return "AVX2";
+
+	if (g_nInstructionSet == INSTRUCTION_SET_SSE2)
+		return "SSE2";
+#endif
+
+	return "scalar";
+}
\ No newline at end of file
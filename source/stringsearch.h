@@ -0,0 +1,16 @@
+#include <cstddef>
+
+/*
+	Substring search used to grep through records.
+	On x86 CPUs it compares the first & last byte of the needle against 32 (AVX2) or 16 (SSE2) positions at once
+	and only does a full compare where both match, everywhere else it falls back to memchr + memcmp.
+*/
+namespace StringSearch
+{
+	// Returns a pointer to the first occurrence of pNeedle inside pHaystack or nullptr if there is none.
+	// An empty needle matches at pHaystack.
+	extern const char* Find(const char* pHaystack, std::size_t nHaystackSize, const char* pNeedle, std::size_t nNeedleSize);
+
+	// Returns the name of the instruction set Find uses, "AVX2", "SSE2" or "scalar".
+	extern const char* GetInstructionSet();
+}
\ No newline at end of file
@@ -1,4 +1,6 @@
 #include "util.h"
+#include "httplib.h"
+#include "logsystem.h"
 #include <string>
 #include <chrono>
 #include <random>
@@ -180,4 +182,99 @@ void Util::SetThreadName(std::thread& pThread, std::string strThreadName)
 #else
 	pthread_setname_np(pThread.native_handle(), strThreadName.c_str());
 #endif
-}
\ No newline at end of file
+}
+
+std::vector<IndexRule> Util::ParseIndexRules(const std::string& strRules)
+{
+	std::vector<IndexRule> pRules;
+	std::size_t nStart = 0;
+	while (nStart < strRules.length())
+	{
+		std::size_t nEnd = strRules.find(';', nStart);
+		if (nEnd == std::string::npos)
+			nEnd = strRules.length();
+
+		std::size_t nEquals = strRules.find('=', nStart);
+		if (nEquals != std::string::npos && nEquals > nStart && nEquals < nEnd)
+		{
+			IndexRule pRule;
+			pRule.strName = strRules.substr(nStart, nEquals - nStart);
+			pRule.strValue = strRules.substr(nEquals + 1, nEnd - nEquals - 1);
+			if (pRule.strName.back() == '*')
+			{
+				pRule.strName.pop_back();
+				pRule.bPrefix = true;
+			}
+
+			pRules.push_back(pRule);
+		} else {
+			printf("Ignoring invalid rule \"%s\"\n", strRules.substr(nStart, nEnd - nStart).c_str());
+		}
+
+		nStart = nEnd + 1;
+	}
+
+	return pRules;
+}
+
+const std::string* Util::FindIndexRule(const std::vector<IndexRule>& pRules, const std::string& strIndexName)
+{
+	const IndexRule* pBestRule = nullptr;
+	for (const IndexRule& pRule : pRules)
+	{
+		if (!pRule.bPrefix)
+		{
+			if (pRule.strName == strIndexName)
+				return &pRule.strValue; // Exact matches always win.
+
+			continue;
+		}
+
+		if (strIndexName.compare(0, pRule.strName.length(), pRule.strName) != 0)
+			continue;
+
+		if (!pBestRule || pRule.strName.length() > pBestRule->strName.length())
+			pBestRule = &pRule;
+	}
+
+	return pBestRule ? &pBestRule->strValue : nullptr;
+}
+
+bool Util::ParseNumber(const httplib::Request& req, const char* pName, unsigned long long& nValue)
+{
+	if (!req.has_param(pName))
+		return true;
+
+	std::string strValue = req.get_param_value(pName);
+	char* pEnd = nullptr;
+	unsigned long long nParsed = std::strtoull(strValue.c_str(), &pEnd, 10);
+	if (pEnd == strValue.c_str() || *pEnd != '\0')
+		return false;
+
+	nValue = nParsed;
+	return true;
+}
+
+bool Util::ParseEntryFormat(const httplib::Request& req, LogSystem::EntryFormat& nFormat, bool bAllowEventStream)
+{
+	std::string strFormat = req.get_param_value("format");
+	if (strFormat.empty())
+	{
+		std::string strAccept = req.get_header_value("Accept");
+		if (bAllowEventStream && strAccept.find(EVENT_STREAM_CONTENT_TYPE) != std::string::npos)
+			strFormat = "sse";
+		else if (strAccept.find(BINARY_CONTENT_TYPE) != std::string::npos)
+			strFormat = "binary";
+	}
+
+	if (strFormat.empty() || strFormat == "text")
+		nFormat = LogSystem::ENTRY_FORMAT_TEXT;
+	else if (strFormat == "binary")
+		nFormat = LogSystem::ENTRY_FORMAT_BINARY;
+	else if (bAllowEventStream && strFormat == "sse")
+		nFormat = LogSystem::ENTRY_FORMAT_EVENT_STREAM;
+	else
+		return false;
+
+	return true;
+}
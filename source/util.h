@@ -1,6 +1,7 @@
 #include "unordered_map"
 #include "string"
 #include "thread"
+#include "vector"
 
 #if _WIN32
 __pragma(pack(push, 2))
@@ -19,6 +20,24 @@ __pragma(pack(pop))
 #pragma pack(pop)
 #endif
 
+namespace httplib
+{
+	struct Request;
+}
+
+namespace LogSystem
+{
+	enum EntryFormat : int;
+}
+
+// A single "name=value" rule from the command line. If the name ends with a * it matches every index starting with it.
+struct IndexRule
+{
+	std::string strName;
+	std::string strValue;
+	bool bPrefix = false;
+};
+
 namespace Util
 {
 	// Reads a simple Json key-value pair that are both strings. (We don't actually use any real json library)
@@ -33,4 +52,19 @@ namespace Util
 	extern int WriteUniqueFilenameIntoBuffer(const UniqueFilenameId& nFileID, char* pBuffer, int nBufferSize);
 	extern bool ReadUniqueFilenameFromBuffer(const char* pBuffer, UniqueFilenameId& nFileID);
 	extern void SetThreadName(std::thread& pThread, std::string strThreadName);
+
+	// Parses rules like "audit=value;debug_*=value" which allows options to be set per index or per name prefix.
+	extern std::vector<IndexRule> ParseIndexRules(const std::string& strRules);
+	// Returns the value of the exact match or else of the longest matching prefix. nullptr if no rule matches.
+	extern const std::string* FindIndexRule(const std::vector<IndexRule>& pRules, const std::string& strIndexName);
+
+	// Content types of the entry formats that aren't text, see LogSystem::EntryFormat.
+	inline constexpr const char* BINARY_CONTENT_TYPE = "application/x-holylogs-entries";
+	inline constexpr const char* EVENT_STREAM_CONTENT_TYPE = "text/event-stream";
+
+	// Parses the given query parameter of a request. Leaves nValue untouched if it wasn't given, returns false if it's not a number.
+	extern bool ParseNumber(const httplib::Request& req, const char* pName, unsigned long long& nValue);
+	// Picks the format asked for with the "format" parameter (text, binary or sse) or else the Accept header.
+	// Returns false if it's unknown or sse isn't allowed by the route.
+	extern bool ParseEntryFormat(const httplib::Request& req, LogSystem::EntryFormat& nFormat, bool bAllowEventStream = false);
 }
\ No newline at end of file